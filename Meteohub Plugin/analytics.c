@@ -0,0 +1,196 @@
+#include "mhpmpi.h"
+#include <math.h>
+
+/*
+	analytics.c
+
+	battery analytics worked out on the host from the readings that go by
+	anyway: a coulomb counter for state of charge, time to empty or to
+	full at the present current, and today's energy in, out and net with
+	the round trip efficiency that gives. The battery is whatever the
+	shunts labelled Battery measure, their amps (and watts, for shunts 1
+	and 2) are added up.
+
+	Every poll and sample read that has the battery amps or watts in it
+	is integrated with the trapezoidal rule on the monotonic time the read
+	finished, so sampling makes the integration finer without anything
+	else changing. Readings further apart than ANALYTICS_MAX_GAP_PERIODS
+	poll intervals, a failed read in between for example, aren't
+	integrated across. The state is a few numbers per device, nothing is
+	read back from the ring or the archive.
+
+	The state of charge starts from the battery1 percent full the
+	pentametric reports, or from full when that isn't polled, and needs
+	BATTERY_CAPACITY_AH. The energy totals start over at local midnight.
+*/
+
+// take the settings a config (re)load can change, the running totals are kept
+void analytics_configure(struct analytics_t *a, struct config_t *config, uint8_t index)
+{
+	a->enabled = config->analytics;
+	a->id_base = config->analytics_id_base + index * config->device_id_stride;
+	a->capacity_ah = config->battery_capacity_ah;
+	a->seed_from_device = (config->sensor_mask & PENTAMETRIC_BATTERY1_PERCENT_FULL) != 0;
+	a->max_gap_us = (uint64_t)poll_period_ms(config) * 1000 * ANALYTICS_MAX_GAP_PERIODS;
+}
+
+// decoded value of the item for a sensor in a finished read, false if it wasn't read
+static boolean read_value(struct poll_plan_t *plan, struct read_plan_t *read, uint32_t sensor_mask, int32_t *value)
+{
+	uint8_t *msg;
+	uint8_t i;
+
+	for(i = 0; i < plan->count; i++)
+	{
+		if(plan->item[i].sensor->mask != sensor_mask)
+			continue;
+		if((msg = get_plan_msg(read, plan->item[i].address)) == NULL)
+			return false;
+		*value = plan->item[i].decode(msg);
+		return true;
+	}
+	return false;
+}
+
+// today as a number that changes at local midnight
+static int32_t local_day(void)
+{
+	struct tm tm;
+	time_t t = time(NULL);
+
+	localtime_r(&t, &tm);
+	return tm.tm_year * 1000 + tm.tm_yday;
+}
+
+/*
+	fold the battery readings of a finished poll or sample read into the
+	counters. Amps and watts come in 1/100 A and 1/100 W, positive while
+	charging.
+*/
+void analytics_add(struct analytics_t *a, struct poll_plan_t *plan, struct read_plan_t *read, uint8_t shunt_labels, uint64_t now_us)
+{
+	static const uint32_t amps_mask[3] = {PENTAMETRIC_AMPS1, PENTAMETRIC_AMPS2, PENTAMETRIC_AMPS3};
+	static const uint32_t watts_mask[3] = {PENTAMETRIC_WATTS1, PENTAMETRIC_WATTS2, 0}; // shunt 3 has no watts register
+	boolean got_amps = true, got_watts = true;
+	int32_t value, amps = 0, watts = 0;
+	double hours, wh;
+	int32_t day;
+	uint8_t s;
+
+	if(!a->enabled || (shunt_labels & 0x80) || (shunt_labels & (SHUNT1_BATTERY | SHUNT2_BATTERY | SHUNT3_BATTERY)) == 0)
+		return;
+
+	for(s = 0; s < 3; s++)
+	{
+		if(!(shunt_labels & (1 << s)))
+			continue;
+		if(got_amps && read_value(plan, read, amps_mask[s], &value))
+			amps += value;
+		else
+			got_amps = false;
+		if(got_watts && watts_mask[s] != 0 && read_value(plan, read, watts_mask[s], &value))
+			watts += value;
+		else
+			got_watts = false;
+	}
+
+	// the pentametric's own figure is the starting point of the coulomb counter
+	if(!a->seeded && a->capacity_ah > 0)
+	{
+		if(read_value(plan, read, PENTAMETRIC_BATTERY1_PERCENT_FULL, &value)) // 1/100 %
+		{
+			a->charge_ah = a->capacity_ah * value / 10000.0;
+			a->seeded = true;
+		}
+		else if(!a->seed_from_device)
+		{
+			a->charge_ah = a->capacity_ah;
+			a->seeded = true;
+		}
+	}
+
+	if((day = local_day()) != a->day)
+	{
+		a->day = day;
+		a->charged_wh = 0;
+		a->discharged_wh = 0;
+	}
+
+	if(got_amps)
+	{
+		if(a->have_amps && now_us - a->amps_us <= a->max_gap_us)
+		{
+			hours = (now_us - a->amps_us) / 3600e6;
+			a->charge_ah += (a->last_amps + amps / 100.0) / 2 * hours;
+			if(a->charge_ah < 0)
+				a->charge_ah = 0;
+			if(a->capacity_ah > 0 && a->charge_ah > a->capacity_ah)
+				a->charge_ah = a->capacity_ah;
+		}
+		a->last_amps = amps / 100.0;
+		a->amps_us = now_us;
+		a->have_amps = true;
+	}
+
+	if(got_watts)
+	{
+		if(a->have_watts && now_us - a->watts_us <= a->max_gap_us)
+		{
+			hours = (now_us - a->watts_us) / 3600e6;
+			wh = (a->last_watts + watts / 100.0) / 2 * hours;
+			if(wh > 0)
+				a->charged_wh += wh;
+			else
+				a->discharged_wh -= wh;
+		}
+		a->last_watts = watts / 100.0;
+		a->watts_us = now_us;
+		a->have_watts = true;
+	}
+}
+
+// names of the analytics in the sinks that name their values, in analytics_values() order
+const char *const analytics_name[ANALYTICS_COUNT] =
+{
+	"state_of_charge", "hours_to_empty", "hours_to_full", "net_wh_today", "in_wh_today", "out_wh_today", "efficiency_today"
+};
+
+/*
+	a device's analytics in 1/100 units like everything else, -SHRT_MAX
+	for what can't be worked out. They go to meteohub as dataN lines
+	numbered from id_base:
+
+		id_base + 0	state of charge, %
+		id_base + 1	hours to empty at the present current, while discharging
+		id_base + 2	hours to full at the present current, while charging
+		id_base + 3	net energy into the battery today, Wh
+		id_base + 4	energy into the battery today, Wh
+		id_base + 5	energy out of the battery today, Wh
+		id_base + 6	round trip efficiency today, energy out / energy in, %
+*/
+void analytics_values(struct analytics_t *a, int32_t value[ANALYTICS_COUNT])
+{
+	boolean soc = a->seeded && a->capacity_ah > 0;
+	double hours;
+
+	value[0] = soc ? (int32_t)lround(a->charge_ah / a->capacity_ah * 10000) : -SHRT_MAX;
+
+	value[1] = -SHRT_MAX;
+	if(soc && a->have_amps && a->last_amps <= -0.01)
+	{
+		hours = a->charge_ah / -a->last_amps;
+		value[1] = hours < ANALYTICS_MAX_HOURS ? (int32_t)lround(hours * 100) : ANALYTICS_MAX_HOURS * 100;
+	}
+
+	value[2] = -SHRT_MAX;
+	if(soc && a->have_amps && a->last_amps >= 0.01)
+	{
+		hours = (a->capacity_ah - a->charge_ah) / a->last_amps;
+		value[2] = hours < ANALYTICS_MAX_HOURS ? (int32_t)lround(hours * 100) : ANALYTICS_MAX_HOURS * 100;
+	}
+
+	value[3] = a->have_watts ? (int32_t)lround((a->charged_wh - a->discharged_wh) * 100) : -SHRT_MAX;
+	value[4] = a->have_watts ? (int32_t)lround(a->charged_wh * 100) : -SHRT_MAX;
+	value[5] = a->have_watts ? (int32_t)lround(a->discharged_wh * 100) : -SHRT_MAX;
+	value[6] = a->charged_wh >= 0.01 ? (int32_t)lround(a->discharged_wh / a->charged_wh * 10000) : -SHRT_MAX;
+}
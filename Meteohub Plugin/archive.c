@@ -0,0 +1,267 @@
+#include "mhpmpi.h"
+
+/*
+	archive.c
+
+	append-only long term archive of decoded values. Every series (one
+	sensor of one device) fills its own fixed size block in memory:
+
+		header		device, sensor, count, first time and value, last time
+		payload		for each value after the first, a zigzag varint of the
+					delta-of-delta of its millisecond timestamp followed by
+					a zigzag varint of the difference from the previous value
+
+	A poll every SLEEP_SECONDS has a delta-of-delta of a few ms and values
+	that barely move, so most values take 2 or 3 bytes instead of a
+	"dataN value" text line. The decode_format*() values are integers, so
+	nothing is lost.
+
+	A series reserves the next free block slot of the archive when it
+	starts a block. After every poll cycle archive_sync() writes what the
+	block gained since the last sync into that slot, payload first and
+	header last, so a crash or a kill loses at most the cycle in progress
+	instead of every block still filling. When the block is full (or the
+	plug-in stops) it is written whole and its header is appended to the
+	.idx file next to it, so a reader can find a time range without
+	decoding every block. Blocks are self describing: a reader finds the
+	ones still filling from their own headers, and a slot reserved but
+	never written reads as zeros.
+*/
+
+// zigzag maps small negative and positive numbers to small unsigned ones
+static uint64_t zigzag(int64_t v)
+{
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v)
+{
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static uint16_t put_varint(uint8_t *p, uint64_t v)
+{
+	uint16_t n = 0;
+
+	while(v >= 0x80)
+	{
+		p[n++] = (uint8_t)v | 0x80;
+		v >>= 7;
+	}
+	p[n++] = (uint8_t)v;
+	return n;
+}
+
+// returns bytes used, 0 if the varint runs past end
+static uint16_t get_varint(const uint8_t *p, const uint8_t *end, uint64_t *v)
+{
+	uint16_t n = 0;
+	uint8_t shift = 0;
+
+	*v = 0;
+	while(p + n < end && shift < 64)
+	{
+		*v |= (uint64_t)(p[n] & 0x7f) << shift;
+		if(!(p[n++] & 0x80))
+			return n;
+		shift += 7;
+	}
+	return 0;
+}
+
+// blocks are fixed size so the n'th block always starts at n * ARCHIVE_BLOCK_BYTES
+static off_t archive_slot_offset(uint32_t slot)
+{
+	return (off_t)slot * sizeof(struct archive_block_t);
+}
+
+// write a series' block to its slot and its index entry, then start the series over empty
+static void archive_flush_series(struct archive_t *archive, struct archive_series_t *series)
+{
+	struct archive_index_t entry;
+
+	if(series->block.header.count == 0)
+		return;
+
+	if(pwrite(archive->fd, &series->block, sizeof(struct archive_block_t), archive_slot_offset(series->slot)) == sizeof(struct archive_block_t))
+	{
+		entry.block = series->slot;
+		entry.device = series->block.header.device;
+		entry.sensor = series->block.header.sensor;
+		entry.count = series->block.header.count;
+		entry.first_ms = series->block.header.first_ms;
+		entry.last_ms = series->block.header.last_ms;
+		if(archive->index_fd >= 0 && write(archive->index_fd, &entry, sizeof(entry)) != sizeof(entry))
+			archive->errors++;
+		archive->blocks++;
+	}
+	else
+		archive->errors++;
+
+	memset(&series->block, 0, sizeof(struct archive_block_t));
+}
+
+/*
+	open an archive and its .idx file for appending
+
+	returns:	0 = OK
+				-1 = archive could not be opened
+*/
+int archive_open(struct archive_t *archive, char *path)
+{
+	char index_name[FILENAME_MAX];
+	struct stat st;
+
+	memset(archive, 0, sizeof(struct archive_t));
+	archive->index_fd = -1;
+	if((archive->fd = open(path, O_WRONLY | O_CREAT, 0644)) < 0)
+		return -1;
+	if(fstat(archive->fd, &st) < 0)
+	{
+		close(archive->fd);
+		archive->fd = -1;
+		return -1;
+	}
+	// new blocks go after everything already there, a torn last block included
+	archive->next_slot = (uint32_t)((st.st_size + sizeof(struct archive_block_t) - 1) / sizeof(struct archive_block_t));
+
+	snprintf(index_name, sizeof(index_name), "%s.idx", path);
+	archive->index_fd = open(index_name, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	return 0;
+}
+
+// write out every partly filled block and close the files
+void archive_close(struct archive_t *archive)
+{
+	uint16_t i;
+
+	for(i = 0; i < PENTAMETRIC_MAX_DEVICES * PENTAMETRIC_SENSOR_COUNT * 2; i++)
+	{
+		if(archive->series[i] == NULL)
+			continue;
+		if(archive->fd >= 0)
+			archive_flush_series(archive, archive->series[i]);
+		free(archive->series[i]);
+		archive->series[i] = NULL;
+	}
+	if(archive->index_fd >= 0)
+		close(archive->index_fd);
+	if(archive->fd >= 0)
+		close(archive->fd);
+	archive->index_fd = -1;
+	archive->fd = -1;
+}
+
+// add one value to the block of its series, writing the block out when it fills up
+void archive_append(struct archive_t *archive, uint64_t time_ms, uint8_t device, uint8_t sensor, int32_t value)
+{
+	struct archive_series_t *series;
+	struct archive_block_header_t *header;
+	uint16_t slot;
+	int64_t delta;
+
+	if(device >= PENTAMETRIC_MAX_DEVICES || (sensor & ~RING_SAMPLE) >= PENTAMETRIC_SENSOR_COUNT)
+		return;
+
+	// one series per device, sensor and poll/sample, allocated the first time it is seen
+	slot = (device * PENTAMETRIC_SENSOR_COUNT + (sensor & ~RING_SAMPLE)) * 2 + ((sensor & RING_SAMPLE) != 0);
+	if((series = archive->series[slot]) == NULL)
+	{
+		if((series = (struct archive_series_t *)calloc(1, sizeof(struct archive_series_t))) == NULL)
+		{
+			archive->errors++;
+			return;
+		}
+		archive->series[slot] = series;
+	}
+
+	header = &series->block.header;
+	if(header->count > 0 && header->used + ARCHIVE_MAX_RECORD_BYTES > sizeof(series->block.payload))
+		archive_flush_series(archive, series);
+
+	if(header->count == 0)
+	{
+		// grow the file over the new slot so readers see it, unwritten it reads as zeros
+		series->slot = archive->next_slot++;
+		series->synced_count = 0;
+		series->synced_used = 0;
+		if(ftruncate(archive->fd, archive_slot_offset(archive->next_slot)) < 0)
+			archive->errors++;
+		header->magic = ARCHIVE_MAGIC;
+		header->device = device;
+		header->sensor = sensor;
+		header->first_value = value;
+		header->first_ms = time_ms;
+		series->last_delta = 0;
+	}
+	else
+	{
+		delta = (int64_t)(time_ms - header->last_ms);
+		header->used += put_varint(&series->block.payload[header->used], zigzag(delta - series->last_delta));
+		header->used += put_varint(&series->block.payload[header->used], zigzag((int64_t)value - series->last_value));
+		series->last_delta = delta;
+	}
+	header->last_ms = time_ms;
+	header->count++;
+	series->last_value = value;
+}
+
+// write what every block still filling gained since the last sync to its slot
+void archive_sync(struct archive_t *archive)
+{
+	struct archive_series_t *series;
+	off_t offset;
+	uint16_t i;
+
+	for(i = 0; i < PENTAMETRIC_MAX_DEVICES * PENTAMETRIC_SENSOR_COUNT * 2; i++)
+	{
+		if((series = archive->series[i]) == NULL || series->block.header.count == series->synced_count)
+			continue;
+		// the header goes last, so it never counts payload that isn't there
+		offset = archive_slot_offset(series->slot);
+		if(pwrite(archive->fd, &series->block.payload[series->synced_used], series->block.header.used - series->synced_used,
+				offset + sizeof(struct archive_block_header_t) + series->synced_used) != series->block.header.used - series->synced_used ||
+			pwrite(archive->fd, &series->block.header, sizeof(struct archive_block_header_t), offset) != sizeof(struct archive_block_header_t))
+		{
+			archive->errors++;
+			continue;
+		}
+		series->synced_count = series->block.header.count;
+		series->synced_used = series->block.header.used;
+	}
+}
+
+/*
+	decode one block into time_ms[] and value[], which must hold ARCHIVE_MAX_BLOCK_VALUES
+
+	returns:	number of values decoded
+				-1 = not an archive block or the payload is corrupt
+*/
+int archive_decode_block(const struct archive_block_t *block, uint64_t *time_ms, int32_t *value)
+{
+	const struct archive_block_header_t *header = &block->header;
+	const uint8_t *p = block->payload;
+	const uint8_t *end;
+	uint64_t dod, dv;
+	int64_t delta = 0;
+	uint16_t i, n1, n2;
+
+	if(header->magic != ARCHIVE_MAGIC || header->used > sizeof(block->payload) || header->count > ARCHIVE_MAX_BLOCK_VALUES)
+		return -1;
+	if(header->count == 0)
+		return 0;
+
+	end = p + header->used;
+	time_ms[0] = header->first_ms;
+	value[0] = header->first_value;
+	for(i = 1; i < header->count; i++)
+	{
+		if((n1 = get_varint(p, end, &dod)) == 0 || (n2 = get_varint(p + n1, end, &dv)) == 0)
+			return -1;
+		p += n1 + n2;
+		delta += unzigzag(dod);
+		time_ms[i] = time_ms[i - 1] + delta;
+		value[i] = (int32_t)(value[i - 1] + unzigzag(dv));
+	}
+	return p == end && time_ms[i - 1] == header->last_ms ? header->count : -1;
+}
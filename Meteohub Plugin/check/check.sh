@@ -0,0 +1,219 @@
+#!/bin/sh
+#
+# check.sh
+#
+# Regression checks for mhpmpi, run by "make check" after a build. Each check polls pmsim -k,
+# whose registers hold their base values, for a few seconds and compares what mhpmpi wrote with
+# the .golden files next to this script:
+#
+#  block     block reads: the poll plan and the meteohub lines, which pmarc reads back from the
+#            ARCHIVE_FILE of the run
+#  killed    the archive of a run stopped with SIGKILL, its blocks still filling, holds the same
+#            values, read in full or through the index
+#  single    BLOCK_READS 0 gives a short read per sensor and the same lines
+#  faults    dropped bytes and bad checksums are retried and resynchronised and still give the
+#            same lines, and the stats written at exit count them
+#  deadband  DEADBAND_<sensor> writes an unchanging sensor on the first poll only
+#  gone      mhpmpi carries on polling after the reader of its stdout goes away
+#  replay    mhpmpi -P decodes the TRACE_FILE captures of the block and faults runs to the
+#            values pmarc reads back from the archive
+#
+# When a change to pmsim or the decoders means to change the output, run with -u to rewrite the
+# golden files, and check the difference before committing them.
+
+here=$(cd "$(dirname "$0")" && pwd)
+bin=$(dirname "$here")
+work=$(mktemp -d /tmp/mhpmpi-check.XXXXXX)
+update=false
+failed=0
+sim=
+mhpmpi=
+stop=TERM
+
+[ "${1:-}" = "-u" ] && update=true
+
+# mhpmpi reads <argv[0]>.conf first, so run it from the work directory to keep the
+# mhpmpi.conf next to the binary out of the checks
+ln -s "$bin/mhpmpi" "$work/mhpmpi"
+
+trap 'for p in $mhpmpi $sim; do kill $p 2>/dev/null; done; rm -rf "$work"' EXIT
+
+# simulate "<pmsim options>", start pmsim on $work/ttyPM
+simulate()
+{
+	rm -f "$work/ttyPM"
+	"$bin/pmsim" -k -l "$work/ttyPM" $1 > /dev/null 2> "$work/pmsim.err" &
+	sim=$!
+	n=0
+	while [ ! -e "$work/ttyPM" ] && [ $n -lt 50 ]
+	do
+		sleep 0.1
+		n=$((n + 1))
+	done
+}
+
+# configure <name> [mhpmpi.conf lines ...], mhpmpi.conf for polling $work/ttyPM every second
+configure()
+{
+	name=$1
+	shift
+
+	{
+		echo "DEVICE $work/ttyPM"
+		echo "WRITE_LOG 1"
+		echo "LOG_LEVEL 2"
+		echo "LOG_FILE_NAME $work/$name.log"
+		echo "SENSOR_MASK 0x3ffffff"
+		echo "SLEEP_MS 1000"
+		echo "WATCH_CONFIG 0"
+		for line in "$@"
+		do
+			echo "$line"
+		done
+	} > "$work/mhpmpi.conf"
+}
+
+# finish, stop pmsim
+finish()
+{
+	kill $sim 2> /dev/null
+	wait $sim 2> /dev/null
+	sim=
+}
+
+# run <name> <seconds> "<pmsim options>" [mhpmpi.conf lines ...], stdout goes to $work/<name>.out,
+# mhpmpi is stopped with SIG$stop
+run()
+{
+	name=$1
+	seconds=$2
+	simulate "$3"
+	shift 3
+	configure "$name" "$@"
+	(cd "$work" && exec ./mhpmpi > "$work/$name.out" 2> "$work/$name.err") &
+	mhpmpi=$!
+	sleep "$seconds"
+	kill -s $stop $mhpmpi 2> /dev/null
+	wait $mhpmpi
+	mhpmpi=
+	finish
+}
+
+# compare <name> [golden], $work/<name> against <golden or name>.golden
+compare()
+{
+	golden="$here/${2:-$1}.golden"
+	if $update
+	then
+		cp "$work/$1" "$golden"
+		echo "UPDATED $1"
+	elif diff -u "$golden" "$work/$1" > "$work/$1.diff"
+	then
+		echo "PASS $1"
+	else
+		echo "FAIL $1"
+		cat "$work/$1.diff"
+		failed=1
+	fi
+}
+
+# expect <status> <message>, for checks without a golden file
+expect()
+{
+	if [ "$1" = 0 ]
+	then
+		echo "PASS $2"
+	else
+		echo "FAIL $2"
+		failed=1
+	fi
+}
+
+# the poll plan the log reports, without the program name and time in front
+plan()
+{
+	sed -n 's/^.*): \(Poll plan: .*\)$/\1/p' "$work/$1.log" | sort -u
+}
+
+# every distinct meteohub line written
+values()
+{
+	LC_ALL=C sort -u "$work/$1.out"
+}
+
+# every distinct value mhpmpi -P decodes from <name>.trace, as device,sensor_bit,value
+replayed()
+{
+	(cd "$work" && ./mhpmpi -P "$1.trace" 2> /dev/null) | cut -d , -f 2- | LC_ALL=C sort -u
+}
+
+# every distinct value polled into <name>.pma, as device,sensor_bit,value, [pmarc options]
+archived()
+{
+	"$bin/pmarc" $2 "$work/$1.pma" | awk -F , '$4 == "p" { print $2 "," $3 "," $5 }' | LC_ALL=C sort -u
+}
+
+run block 4 "" "ARCHIVE_FILE $work/block.pma" "TRACE_FILE $work/block.trace"
+stop=KILL
+run killed 4 "" "ARCHIVE_FILE $work/killed.pma"
+stop=TERM
+run single 4 "" "BLOCK_READS 0"
+run faults 6 "-D 0.02 -c 0.1 -r 7" "SERIAL_RETRIES 8" "TRACE_FILE $work/faults.trace"
+run deadband 4 "" "DEADBAND_AMPS1 0" "DEADBAND_TEMPERATURE 5"
+
+{
+	echo "block: $(plan block)"
+	echo "single: $(plan single)"
+} > "$work/plan"
+compare plan
+
+values block > "$work/values"
+compare values
+archived block > "$work/decoded"
+compare decoded
+archived killed > "$work/killed"
+compare killed decoded
+archived killed "-s 25" > "$work/killed.indexed"
+grep '^0,25,' "$here/decoded.golden" | diff -u - "$work/killed.indexed" > /dev/null
+expect $? "killed.indexed"
+values single > "$work/single"
+compare single values
+values faults > "$work/faults"
+compare faults values
+
+# the stats written when mhpmpi stops count the retries and resyncs the faults needed
+awk '/ timeouts [0-9]+ checksum_errors [0-9]+ retries [0-9]+ resyncs [0-9]+\.$/ { r += $(NF - 2); s += $NF } END { exit !(r > 0 && s > 0) }' "$work/faults.log"
+expect $? "faults stats"
+
+# a line written on one poll only belongs to a deadbanded sensor, the rest are written every poll
+values deadband > "$work/deadband.values"
+compare deadband.values values
+LC_ALL=C sort "$work/deadband.out" | uniq -u > "$work/deadband"
+compare deadband
+
+# the reader of stdout reads part of the first cycle and exits, like meteohub restarting
+simulate ""
+configure gone
+mkfifo "$work/gone.fifo"
+head -c 20 < "$work/gone.fifo" > /dev/null &
+(cd "$work" && exec ./mhpmpi > "$work/gone.fifo" 2> "$work/gone.err") &
+mhpmpi=$!
+sleep 4
+kill -0 $mhpmpi 2> /dev/null
+expect $? "gone still polling"
+kill $mhpmpi 2> /dev/null
+wait $mhpmpi
+expect $? "gone stopped cleanly"
+mhpmpi=
+finish
+grep -q "could not write to stdout" "$work/gone.log"
+expect $? "gone logged"
+awk '/stats cycles / { for(i = 1; i < NF; i++) if($i == "cycles") n = $(i + 1) } END { exit !(n >= 3) }' "$work/gone.log"
+expect $? "gone cycles"
+
+replayed block > "$work/replay"
+compare replay decoded
+replayed faults > "$work/faults.replay"
+compare faults.replay decoded
+
+exit $failed
@@ -1,4 +1,5 @@
 #include "mhpmpi.h"
+#include <strings.h>
 
 /********************************************************************
  * get_configuration()
@@ -27,11 +28,12 @@ int get_configuration(struct config_t *config, char *path)
 	char inputline[1000] = "";
 	char token[100] = "";
 	char val[100] = "";
+	uint8_t i;
 
 	// open the config file
 	fptr = NULL;
-	if (path != NULL)
-		fptr = fopen(path, "r"); //try the pathname passed in
+	if (path != NULL && (fptr = fopen(path, "r")) != NULL) //try the pathname passed in
+		snprintf(config->config_path, sizeof(config->config_path), "%s", path);
 
 	if (fptr == NULL) //then try default search
 	{
@@ -43,8 +45,13 @@ int get_configuration(struct config_t *config, char *path)
 				{
 					return(false); // none of the conf files are exist or are readable
 				}
+				strcpy(config->config_path, "/etc/mhpmpi.conf");
 			}
+			else
+				strcpy(config->config_path, "/usr/local/etc/mhpmpi.conf");
 		}
+		else
+			strcpy(config->config_path, "./mhpmpi.conf");
 	}
 
 	while (fscanf(fptr, "%[^\n]\n", inputline) != EOF)
@@ -53,15 +60,59 @@ int get_configuration(struct config_t *config, char *path)
 		if (token[0] == '#')	// # character starts a comment
 			continue;
 
+		if ((strcmp(token,"ARCHIVE_FILE")==0) && (strlen(val) != 0))
+		{
+			strcpy(config->archive_file_name,val);
+			continue;
+		}
+
+		if ((strcmp(token,"ARCHIVE_SAMPLES")==0) && (strlen(val) != 0))
+		{
+			config->archive_samples = (boolean)atoi(val);
+			continue;
+		}
+
+		if ((strcmp(token,"BLOCK_READS")==0) && (strlen(val) != 0))
+		{
+			config->block_reads = (boolean)atoi(val);
+			continue;
+		}
+
 		if ((strcmp(token,"CLOSE_DEVICE")==0) && (strlen(val) != 0))
 		{
 			config->close_tty_file = (boolean)atoi(val);
 			continue;
 		}
 		
+		if ((strncmp(token,"DEADBAND_",9)==0) && (strlen(val) != 0)) // DEADBAND_<sensor name> change, or change% of the last value
+		{
+			for (i = 0; i < PENTAMETRIC_SENSOR_COUNT; i++)
+			{
+				if (strcasecmp(token + 9, get_sensor(i)->name) != 0)
+					continue;
+				config->deadband_relative[i] = (val[strlen(val) - 1] == '%');
+				config->deadband[i] = config->deadband_relative[i] ? (int32_t)(atof(val) * 100 + 0.5) : atoi(val);
+				config->report_by_exception = true;
+			}
+			continue;
+		}
+
 		if ((strcmp(token,"DEVICE")==0) && (strlen(val) != 0))
 		{
-			strcpy(config->device,val);
+			if (config->device_count < PENTAMETRIC_MAX_DEVICES) // each DEVICE line adds another pentametric
+				strcpy(config->device[config->device_count++],val);
+			continue;
+		}
+
+		if ((strcmp(token,"DEVICE_ID_STRIDE")==0) && (strlen(val) != 0))
+		{
+			config->device_id_stride = (uint16_t)atoi(val);
+			continue;
+		}
+
+		if ((strcmp(token,"WATCH_CONFIG")==0) && (strlen(val) != 0))
+		{
+			config->watch_config = (boolean)atoi(val);
 			continue;
 		}
 
@@ -77,24 +128,225 @@ int get_configuration(struct config_t *config, char *path)
 			continue;
 		}
 
+		if ((strcmp(token,"LOG_LEVEL")==0) && (strlen(val) != 0))
+		{
+			config->log_level = (uint8_t)atoi(val);
+			continue;
+		}
+
+		if ((strcmp(token,"LOG_ROTATE_BYTES")==0) && (strlen(val) != 0))
+		{
+			config->log_rotate_bytes = (uint32_t)strtoul(val, (char **)NULL, 0);
+			continue;
+		}
+
+		if ((strcmp(token,"LOG_ROTATE_SECONDS")==0) && (strlen(val) != 0))
+		{
+			config->log_rotate_seconds = (uint32_t)strtoul(val, (char **)NULL, 0);
+			continue;
+		}
+
+		if ((strcmp(token,"LOG_ROTATE_KEEP")==0) && (strlen(val) != 0))
+		{
+			config->log_rotate_keep = (uint8_t)atoi(val);
+			continue;
+		}
+
+		if ((strncmp(token,"PERIOD_",7)==0) && (strlen(val) != 0)) // PERIOD_<sensor name> seconds
+		{
+			for (i = 0; i < PENTAMETRIC_SENSOR_COUNT; i++)
+				if (strcasecmp(token + 7, get_sensor(i)->name) == 0)
+					config->sensor_period[i] = (uint32_t)atoi(val);
+			continue;
+		}
+
+		if ((strcmp(token,"PIPELINE_DEPTH")==0) && (strlen(val) != 0))
+		{
+			config->pipeline_depth = (uint8_t)atoi(val);
+			continue;
+		}
+
 		if ((strcmp(token,"RESET_AMP_HRS")==0) && (strlen(val) != 0))
 		{
 			config->reset_amp_hrs = (boolean)atoi(val);
 			continue;
 		}
 
+		if ((strcmp(token,"ANALYTICS")==0) && (strlen(val) != 0))
+		{
+			config->analytics = (boolean)atoi(val);
+			continue;
+		}
+
+		if ((strcmp(token,"ANALYTICS_ID_BASE")==0) && (strlen(val) != 0))
+		{
+			config->analytics_id_base = (uint16_t)atoi(val);
+			continue;
+		}
+
+		if ((strcmp(token,"BATTERY_CAPACITY_AH")==0) && (strlen(val) != 0))
+		{
+			config->battery_capacity_ah = (uint32_t)atol(val);
+			continue;
+		}
+
+		if ((strcmp(token,"RING_FILE")==0) && (strlen(val) != 0))
+		{
+			strcpy(config->ring_file_name,val);
+			continue;
+		}
+
+		if ((strcmp(token,"METADATA_FILE")==0) && (strlen(val) != 0))
+		{
+			snprintf(config->metadata_file_name, sizeof(config->metadata_file_name), "%s", val);
+			continue;
+		}
+
+		if ((strcmp(token,"METADATA_REFRESH_SECONDS")==0) && (strlen(val) != 0))
+		{
+			config->metadata_refresh_seconds = (uint32_t)atol(val);
+			continue;
+		}
+
+		if ((strcmp(token,"BINARY_FILE")==0) && (strlen(val) != 0))
+		{
+			snprintf(config->binary_file, sizeof(config->binary_file), "%s", val);
+			continue;
+		}
+
+		if ((strcmp(token,"BINARY_SPILL_FILE")==0) && (strlen(val) != 0))
+		{
+			snprintf(config->binary_spill_file, sizeof(config->binary_spill_file), "%s", val);
+			continue;
+		}
+
+		if ((strcmp(token,"CSV_FILE")==0) && (strlen(val) != 0))
+		{
+			snprintf(config->csv_file, sizeof(config->csv_file), "%s", val);
+			continue;
+		}
+
+		if ((strcmp(token,"JSON_FIFO")==0) && (strlen(val) != 0))
+		{
+			snprintf(config->json_fifo, sizeof(config->json_fifo), "%s", val);
+			continue;
+		}
+
+		if ((strcmp(token,"JSON_SPILL_FILE")==0) && (strlen(val) != 0))
+		{
+			snprintf(config->json_spill_file, sizeof(config->json_spill_file), "%s", val);
+			continue;
+		}
+
+		if ((strcmp(token,"SINK_QUEUE_BYTES")==0) && (strlen(val) != 0))
+		{
+			config->sink_queue_bytes = (uint32_t)strtoul(val, (char **)NULL, 0);
+			continue;
+		}
+
+		if ((strcmp(token,"TRACE_FILE")==0) && (strlen(val) != 0))
+		{
+			snprintf(config->trace_file_name, sizeof(config->trace_file_name), "%s", val);
+			continue;
+		}
+
+		if ((strcmp(token,"OUTPUT_QUEUE_BYTES")==0) && (strlen(val) != 0))
+		{
+			config->output_queue_bytes = (uint32_t)strtoul(val, (char **)NULL, 0);
+			continue;
+		}
+
+		if ((strcmp(token,"OUTPUT_SPILL_FILE")==0) && (strlen(val) != 0))
+		{
+			snprintf(config->output_spill_file, sizeof(config->output_spill_file), "%s", val);
+			continue;
+		}
+
+		if ((strcmp(token,"OUTPUT_SPILL_MAX_BYTES")==0) && (strlen(val) != 0))
+		{
+			config->output_spill_max_bytes = (uint32_t)strtoul(val, (char **)NULL, 0);
+			continue;
+		}
+
+		if ((strcmp(token,"RING_RECORDS")==0) && (strlen(val) != 0))
+		{
+			config->ring_records = (uint32_t)strtoul(val, (char **)NULL, 0);
+			continue;
+		}
+
+		if ((strcmp(token,"SAMPLE_ID_BASE")==0) && (strlen(val) != 0))
+		{
+			config->sample_id_base = (uint16_t)atoi(val);
+			continue;
+		}
+
+		if ((strcmp(token,"SAMPLE_MASK")==0) && (strlen(val) != 0))
+		{
+			config->sample_mask = (uint32_t)strtol(val, (char **)NULL, 0);
+			continue;
+		}
+
 		if ((strcmp(token,"SENSOR_MASK")==0) && (strlen(val) != 0))
 		{
 			config->sensor_mask = (uint32_t)strtol(val, (char **)NULL, 0);
 			continue;
 		}
 
+		if ((strcmp(token,"SERIAL_TIMEOUT_MS")==0) && (strlen(val) != 0))
+		{
+			config->serial_timeout_ms = (uint16_t)atoi(val);
+			continue;
+		}
+
+		if ((strcmp(token,"SERIAL_RETRIES")==0) && (strlen(val) != 0))
+		{
+			config->serial_retries = (uint8_t)atoi(val);
+			continue;
+		}
+
+		if ((strcmp(token,"HEARTBEAT_SECONDS")==0) && (strlen(val) != 0))
+		{
+			config->heartbeat_seconds = (uint32_t)atoi(val);
+			continue;
+		}
+
+		if ((strcmp(token,"HTTP_ADDRESS")==0) && (strlen(val) != 0))
+		{
+			snprintf(config->http_address,sizeof(config->http_address),"%s",val);
+			continue;
+		}
+
+		if ((strcmp(token,"HTTP_PORT")==0) && (strlen(val) != 0))
+		{
+			config->http_port = (uint16_t)atoi(val);
+			continue;
+		}
+
+		if ((strcmp(token,"SHM_NAME")==0) && (strlen(val) != 0))
+		{
+			strncpy(config->shm_name,val,sizeof(config->shm_name) - 1);
+			continue;
+		}
+
+		if ((strcmp(token,"SOCKET_PATH")==0) && (strlen(val) != 0))
+		{
+			strcpy(config->socket_path,val);
+			continue;
+		}
+
 		if ((strcmp(token,"SLEEP_SECONDS")==0) && (strlen(val) != 0))
 		{
 			config->sleep_seconds = (uint16_t)atoi(val);
 			continue;
 		}
+
+		if ((strcmp(token,"SLEEP_MS")==0) && (strlen(val) != 0))
+		{
+			config->sleep_ms = (uint32_t)atol(val);
+			continue;
+		}
 	}
 
+	fclose(fptr);
 	return (true);
 }
@@ -0,0 +1,315 @@
+#include "mhpmpi.h"
+
+/*
+	device.c
+
+	per-pentametric setup: open its serial port, read and log the firmware
+	version and shunt configuration it reports (or take them from the
+	metadata file and check them later), and compile its poll and sample
+	plans.
+*/
+
+// reset a pentametric slot to closed with the port settings from config
+void pentametric_init(struct pentametric_t *pm, struct config_t *config, uint8_t index)
+{
+	memset(pm, 0, sizeof(struct pentametric_t));
+	pm->index = index;
+	pm->port.fd = -1;
+	pm->port.index = index;
+	pm->port.timeout_ms = config->serial_timeout_ms;
+	pm->port.retries = config->serial_retries;
+	pm->port.pipeline_depth = config->pipeline_depth;
+	strncpy(pm->port.device, config->device[index], sizeof(pm->port.device) - 1);
+}
+
+// (re)open the serial port only, returns 0 or a serial_open() error code
+int pentametric_reopen(struct pentametric_t *pm, struct config_t *config, char *myname)
+{
+	char message_buffer[FILENAME_MAX + 64];
+	int error_code;
+
+	if((error_code = serial_open(&pm->port, pm->port.device, myname, config->log_file_name, config->write_log)))
+	{
+		if(config->write_log)
+		{
+			if(error_code == -4)
+				sprintf(message_buffer, "could not open %s", pm->port.device);
+			else if(error_code == -5)
+				sprintf(message_buffer, "%s is not a tty", pm->port.device);
+			else
+				sprintf(message_buffer,"Error setting serial port: %d", error_code);
+			writelog_level(LOG_LEVEL_ERROR, config->log_file_name, myname, message_buffer);
+		}
+	}
+	return error_code;
+}
+
+/*
+	compile a device's poll and sample plans from config and the shunt
+	configuration it reported, and start its schedule over. Nothing is
+	read from the device, so this is also what a config reload runs.
+*/
+void pentametric_plan(struct pentametric_t *pm, struct config_t *config, char *myname)
+{
+	char message_buffer[FILENAME_MAX + 128];
+	uint32_t id_base[SENSOR_KIND_COUNT];
+	uint8_t i;
+
+	// each device gets its own range of meteohub sensor numbers
+	id_base[SENSOR_KIND_DATA] = pm->index * config->device_id_stride;
+	id_base[SENSOR_KIND_TEMP] = pm->index;
+
+	// decide once which registers to read, how to decode them and the fewest short reads that cover them
+	compile_poll_plan(&pm->poll, config->sensor_mask, pm->shunt_select, config->block_reads, id_base);
+	trace_record(TRACE_SHUNTS, pm->index, &pm->shunt_select, 1);
+	schedule_init(&pm->schedule, &pm->poll, config->sensor_period);
+	if(config->write_log)
+	{
+		sprintf(message_buffer, "Poll plan: %d sensors in %d short reads for sensor bitmask 0x%x, first sensor data%d",
+			pm->poll.count, pm->poll.read.span_count, config->sensor_mask, id_base[SENSOR_KIND_DATA]);
+		writelog(config->log_file_name, myname, message_buffer);
+
+		for(i = 0; i < pm->poll.count; i++)
+		{
+			if(config->sensor_period[pm->poll.item[i].bit] * 1000ULL <= poll_period_ms(config))
+				continue;
+			sprintf(message_buffer, "Reading %s every %u seconds", pm->poll.item[i].sensor->name, config->sensor_period[pm->poll.item[i].bit]);
+			writelog(config->log_file_name, myname, message_buffer);
+		}
+	}
+
+	// fast registers read continuously between polls, only possible while the port stays open
+	memset(&pm->sample, 0, sizeof(pm->sample));
+	memset(pm->report, 0, sizeof(pm->report));
+	if(config->sample_mask & PENTAMETRIC_FAST_SENSORS)
+	{
+		if(config->close_tty_file)
+		{
+			if(config->write_log)
+				writelog_level(LOG_LEVEL_WARNING, config->log_file_name, myname, "SAMPLE_MASK ignored, sampling needs CLOSE_DEVICE 0");
+		}
+		else
+		{
+			id_base[SENSOR_KIND_DATA] = 0; // aggregates are numbered from sample_id_base instead
+			compile_poll_plan(&pm->sample, config->sample_mask & PENTAMETRIC_FAST_SENSORS, pm->shunt_select, config->block_reads, id_base);
+			pm->sample_id_base = config->sample_id_base + pm->index * config->device_id_stride;
+			for(i = 0; i < pm->sample.count; i++)
+				sample_stat_reset(&pm->stat[i]);
+			if(config->write_log)
+			{
+				sprintf(message_buffer, "Sample plan: %d sensors in %d short reads, aggregates from data%d",
+					pm->sample.count, pm->sample.read.span_count, pm->sample_id_base);
+				writelog(config->log_file_name, myname, message_buffer);
+			}
+		}
+	}
+
+	// counters keep running through a reload, only their settings change
+	analytics_configure(&pm->analytics, config, pm->index);
+
+	memset(pm->report_state, 0, sizeof(pm->report_state));
+	memset(&pm->due, 0, sizeof(pm->due));
+}
+
+// log the firmware version a device reported and limit its pipeline depth to what that firmware handles
+void apply_firmware_version(struct pentametric_t *pm, struct config_t *config, char *myname, const char *source)
+{
+	char message_buffer[FILENAME_MAX + 128];
+
+	if(config->write_log)
+	{
+		sprintf(message_buffer,"Pentametric %s Firmware version: V%-.1f%s", pm->port.device, pm->firmware_version / 10.0, source);
+		writelog(config->log_file_name, myname, message_buffer);
+	}
+
+	// older firmware (or a failed version read) only gets one command at a time
+	pm->port.pipeline_depth = config->pipeline_depth;
+	if(pm->port.pipeline_depth > 1 && pm->firmware_version < PENTAMETRIC_PIPELINE_MIN_FIRMWARE)
+	{
+		pm->port.pipeline_depth = 1;
+		if(config->write_log)
+		{
+			sprintf(message_buffer,"Firmware below V%-.1f, pipeline depth set to 1", PENTAMETRIC_PIPELINE_MIN_FIRMWARE / 10.0);
+			writelog_level(LOG_LEVEL_WARNING, config->log_file_name, myname, message_buffer);
+		}
+	}
+}
+
+// log pentametric shunt configutation
+static void log_shunt_select(struct pentametric_t *pm, struct config_t *config, char *myname, const char *source)
+{
+	char message_buffer[FILENAME_MAX + 128];
+	const char a100[] = "100A"; // desc for 100A shunt
+	const char a500[] = "500A"; // desc for 500A shunt
+
+	if(config->write_log)
+	{
+		sprintf(message_buffer,"Pentametric %s Shunt Select: Shunt-1 %s, Shunt-2 %s, Shunt-3 %s%s", pm->port.device,
+			(pm->shunt_select & SHUNT1_500A? a500: a100),
+			(pm->shunt_select & SHUNT2_500A? a500: a100),
+			(pm->shunt_select & SHUNT3_500A? a500: a100), source);
+		writelog(config->log_file_name, myname, message_buffer);
+	}
+}
+
+// log pentametric shunt labels
+static void log_shunt_labels(struct pentametric_t *pm, struct config_t *config, char *myname, const char *source)
+{
+	char message_buffer[FILENAME_MAX + 128];
+	const char aBattery[] = "Battery"; // desc for Battery (dis-charge) shunt
+	const char aNonBattery[] = "Non-Battery"; // desc for Source (charge) shunt
+
+	if(config->write_log)
+	{
+		sprintf(message_buffer, "Pentametric %s Shunt Labels: Shunt-1 %s, Shunt-2 %s, Shunt-3 %s%s", pm->port.device,
+			(pm->shunt_labels & SHUNT1_BATTERY? aBattery: aNonBattery),
+			(pm->shunt_labels & SHUNT2_BATTERY? aBattery: aNonBattery),
+			(pm->shunt_labels & SHUNT3_BATTERY? aBattery: aNonBattery), source);
+		writelog(config->log_file_name, myname, message_buffer);
+	}
+}
+
+// keep a device's metadata for the next start, when all of it was read successfully
+static void save_metadata(struct pentametric_t *pm, struct config_t *config, char *myname)
+{
+	char message_buffer[FILENAME_MAX + 128];
+	int error_code;
+
+	if(strlen(config->metadata_file_name) == 0)
+		return;
+
+	error_code = metadata_save(config->metadata_file_name, pm->port.device, pm->firmware_version, pm->shunt_select, pm->shunt_labels);
+	if(error_code < -1 && config->write_log)
+	{
+		snprintf(message_buffer, sizeof(message_buffer), "could not write metadata file %s: %d", config->metadata_file_name, error_code);
+		writelog_level(LOG_LEVEL_WARNING, config->log_file_name, myname, message_buffer);
+	}
+}
+
+/*
+	open a pentametric and get it ready to poll. With a metadata file the
+	firmware version and shunt configuration cached by an earlier run are
+	used right away, and the event loop checks them against the device
+	between polls.
+
+	returns:	0 = OK
+				1 = device could not be opened or is not a tty
+				2 = serial port settings could not be made
+*/
+int pentametric_open(struct pentametric_t *pm, struct config_t *config, char *myname)
+{
+	const char cached[] = " (cached)";
+	int error_code;
+
+	if((error_code = pentametric_reopen(pm, config, myname)))
+		return (error_code == -4 || error_code == -5) ? 1 : 2;
+
+	if(metadata_load(config->metadata_file_name, pm->port.device, &pm->firmware_version, &pm->shunt_select, &pm->shunt_labels))
+	{
+		apply_firmware_version(pm, config, myname, cached);
+		log_shunt_select(pm, config, myname, cached);
+		pentametric_plan(pm, config, myname);
+		log_shunt_labels(pm, config, myname, cached);
+		pm->verify_tries = PENTAMETRIC_VERIFY_TRIES;
+	}
+	else
+	{
+		pm->firmware_version = get_firmware_version(&pm->port);
+		apply_firmware_version(pm, config, myname, "");
+
+		pm->shunt_select = get_shunt_select(&pm->port);
+		log_shunt_select(pm, config, myname, "");
+
+		pentametric_plan(pm, config, myname);
+
+		pm->shunt_labels = get_shunt_labels(&pm->port);
+		log_shunt_labels(pm, config, myname, "");
+
+		save_metadata(pm, config, myname);
+	}
+
+	if(config->close_tty_file)
+		serial_close(&pm->port);
+
+	return 0;
+}
+
+// start reading back a device's firmware version and shunt configuration to check what was cached
+void pentametric_verify_start(struct pentametric_t *pm)
+{
+	static const uint8_t address[PENTAMETRIC_VERIFY_READS] = {PENTAMETRIC_ADDRESS_FIRMWARE_VERSION, PENTAMETRIC_ADDRESS_SHUNT_SELECT, PENTAMETRIC_ADDRESS_SHUNT_LABELS};
+	static const uint8_t length[PENTAMETRIC_VERIFY_READS] = {1, 4, 3};
+	uint8_t i, offset = 0;
+
+	for(i = 0; i < PENTAMETRIC_VERIFY_READS; i++)
+	{
+		pm->verify[i].command = PENTAMETRIC_SHORT_READ_COMMAND;
+		pm->verify[i].address = address[i];
+		pm->verify[i].length = length[i];
+		pm->verify[i].msg = &pm->verify_msg[offset];
+		offset += length[i];
+	}
+	pipeline_start(&pm->pl, &pm->port, pm->verify, PENTAMETRIC_VERIFY_READS, pm->port.pipeline_depth);
+}
+
+/*
+	compare what the device reported with the cached metadata it was
+	started with. A read that failed never replaces a cached value, the
+	check is tried again at the next idle moment, up to
+	PENTAMETRIC_VERIFY_TRIES times. A device that reports something else
+	is replanned and the cache rewritten.
+*/
+void pentametric_verify_done(struct pentametric_t *pm, struct config_t *config, char *myname)
+{
+	char message_buffer[FILENAME_MAX + 128];
+	const char checked[] = " (checked)";
+	uint8_t firmware_version, shunt_select, shunt_labels;
+
+	firmware_version = pm->verify[0].ok ? pm->verify[0].msg[0] : 0;
+	shunt_select = pm->verify[1].ok ? decode_shunt_select(pm->verify[1].msg) : 0x80;
+	shunt_labels = pm->verify[2].ok ? decode_shunt_labels(pm->verify[2].msg) : 0x80;
+
+	if(!metadata_valid(firmware_version, shunt_select, shunt_labels))
+	{
+		if(--pm->verify_tries == 0 && config->write_log)
+		{
+			sprintf(message_buffer, "Could not read back Pentametric %s setup, using the cached values", pm->port.device);
+			writelog_level(LOG_LEVEL_WARNING, config->log_file_name, myname, message_buffer);
+		}
+		return;
+	}
+	pm->verify_tries = 0;
+
+	if(firmware_version == pm->firmware_version && shunt_select == pm->shunt_select && shunt_labels == pm->shunt_labels)
+	{
+		if(config->write_log)
+		{
+			sprintf(message_buffer, "Pentametric %s setup matches the cached values", pm->port.device);
+			writelog_level(LOG_LEVEL_DEBUG, config->log_file_name, myname, message_buffer);
+		}
+		return;
+	}
+
+	if(config->write_log)
+	{
+		sprintf(message_buffer, "Pentametric %s setup differs from the cached values, using what it reports", pm->port.device);
+		writelog_level(LOG_LEVEL_WARNING, config->log_file_name, myname, message_buffer);
+	}
+	if(firmware_version != pm->firmware_version)
+	{
+		pm->firmware_version = firmware_version;
+		apply_firmware_version(pm, config, myname, checked);
+	}
+	if(shunt_labels != pm->shunt_labels)
+	{
+		pm->shunt_labels = shunt_labels;
+		log_shunt_labels(pm, config, myname, checked);
+	}
+	if(shunt_select != pm->shunt_select) // the decoders of shunt dependent values change
+	{
+		pm->shunt_select = shunt_select;
+		log_shunt_select(pm, config, myname, checked);
+		pentametric_plan(pm, config, myname);
+	}
+	save_metadata(pm, config, myname);
+}
@@ -0,0 +1,678 @@
+#include "mhpmpi.h"
+#include <poll.h>
+#include <sys/epoll.h>
+#include <errno.h>
+#include <signal.h>
+
+/*
+	eventloop.c
+
+	single threaded epoll loop that polls every configured pentametric at
+	once, each time the poll job on the timer queue (timer.c) comes due.
+	Each device runs its own pipelined read of its poll plan, so the 2400
+	baud links overlap instead of being read one after another. When every
+	device has finished, the whole cycle is decoded once and published to
+	every output sink (sink.c), meteohub's stdout first, and handed to the
+	socket server, the prometheus endpoint and shared memory snapshot,
+	when they are turned on. Each sink's file is written whenever it has
+	room, so a reader that stops reading never holds up the polls or the
+	other sinks.
+
+	Between polls, idle devices get on with their other work in this
+	order: the midnight amp hour reset, written as one batch right after
+	their midnight poll so that poll still has the day's totals; a read
+	back of their firmware version and shunt configuration, when they were
+	started from the metadata file or the metadata refresh job came due;
+	and, with a sample plan, reads of their fast registers folded into
+	running aggregates. A poll that comes due while any of these is in
+	flight starts as soon as it finishes.
+*/
+
+static volatile sig_atomic_t stop_signal = 0; // set by SIGINT or SIGTERM
+static volatile sig_atomic_t stats_signal = 0; // set by SIGUSR1
+static volatile sig_atomic_t reload_signal = 0; // set by SIGHUP
+
+static void request_stop(int sig)
+{
+	stop_signal = sig;
+}
+
+static void request_stats(int sig)
+{
+	stats_signal = sig;
+}
+
+static void request_reload(int sig)
+{
+	reload_signal = sig;
+}
+
+// bring a device's epoll registration in line with what its pipeline is waiting for
+static void watch_device(int epfd, struct pentametric_t *pm)
+{
+	struct epoll_event ev;
+	uint32_t events = 0;
+	short want = pm->busy ? pipeline_events(&pm->pl) : 0;
+
+	if(want & POLLIN)
+		events |= EPOLLIN;
+	if(want & POLLOUT)
+		events |= EPOLLOUT;
+	if(events == pm->events)
+		return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = pm;
+
+	if(pm->events == 0)
+		epoll_ctl(epfd, EPOLL_CTL_ADD, pm->port.fd, &ev);
+	else if(events == 0)
+		epoll_ctl(epfd, EPOLL_CTL_DEL, pm->port.fd, &ev);
+	else
+		epoll_ctl(epfd, EPOLL_CTL_MOD, pm->port.fd, &ev);
+	pm->events = events;
+}
+
+// bring the epoll registration of a sink's file in line with whether anything is waiting for room in it
+static void watch_output(int epfd, struct output_queue_t *out)
+{
+	struct epoll_event ev;
+	uint32_t events = out->stalled && !out->gone ? EPOLLOUT : 0;
+
+	if(!out->pollable || events == out->events)
+		return;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = out;
+	epoll_ctl(epfd, EPOLL_CTL_MOD, out->fd, &ev);
+	out->events = events;
+}
+
+// write what a sink's file takes of its queue, logging when its reader stops and starts reading again
+static void drain_sink(int epfd, struct config_t *config, struct sink_t *sink, char *myname)
+{
+	char message_buffer[FILENAME_MAX + 128];
+	struct output_queue_t *out = &sink->queue;
+	boolean stalled = out->stalled;
+
+	if(out->gone)
+		return;
+	if(output_queue_flush(out) < 0)
+	{
+		sprintf(message_buffer, "could not write to %s, its output is only queued from now on", sink->path);
+		if(config->write_log)
+			writelog_level(LOG_LEVEL_ERROR, config->log_file_name, myname, message_buffer);
+	}
+	else if(out->stalled && !stalled)
+	{
+		sink->stall_dropped = out->dropped;
+		sprintf(message_buffer, "%s isn't being read, queueing its output", sink->path);
+		if(config->write_log)
+			writelog_level(LOG_LEVEL_WARNING, config->log_file_name, myname, message_buffer);
+	}
+	else if(!out->stalled && stalled)
+	{
+		sprintf(message_buffer, "%s is being read again, %u poll cycles dropped meanwhile, %llu bytes spilled so far", sink->path,
+			out->dropped - sink->stall_dropped, (unsigned long long)out->spilled);
+		if(config->write_log)
+			writelog(config->log_file_name, myname, message_buffer);
+	}
+	watch_output(epfd, out);
+}
+
+/*
+	open meteohub's stdout and every sink turned on in config, and watch
+	their files
+
+	returns how many are open, 0 if not even stdout could be
+*/
+static uint8_t open_sinks(int epfd, struct config_t *config, struct sink_t *sink, char *myname)
+{
+	static const char *const what[SINK_COUNT] = {"meteohub lines", "CSV rows", "JSON lines", "binary records"}; // indexed by SINK_*
+	const char *path[SINK_COUNT] = {"", config->csv_file, config->json_fifo, config->binary_file};
+	const char *spill[SINK_COUNT] = {config->output_spill_file, "", config->json_spill_file, config->binary_spill_file};
+	char message_buffer[FILENAME_MAX * 3 + 128];
+	struct epoll_event ev;
+	uint8_t k, sinks = 0;
+	int n;
+
+	for(k = 0; k < SINK_COUNT; k++)
+	{
+		if(k != SINK_METEOHUB && strlen(path[k]) == 0)
+			continue;
+		n = sink_open(&sink[sinks], k, path[k], k == SINK_METEOHUB ? config->output_queue_bytes : config->sink_queue_bytes,
+			spill[k], config->output_spill_max_bytes);
+		if(n == -1 || n == -2 || n == -4)
+		{
+			sprintf(message_buffer, n == -1 ? "could not open %s" : (n == -2 ? "could not allocate the output queue of %s" : "could not create FIFO %s"),
+				k == SINK_METEOHUB ? "stdout" : path[k]);
+			if(config->write_log)
+				writelog_level(LOG_LEVEL_ERROR, config->log_file_name, myname, message_buffer);
+			if(k == SINK_METEOHUB)
+				return 0;
+			continue;
+		}
+
+		if(n == -3)
+			sprintf(message_buffer, "could not open spill file %s, output of %s that doesn't fit in memory is dropped", spill[k], sink[sinks].path);
+		else if(sink[sinks].queue.spill_fd >= 0)
+			sprintf(message_buffer, "Writing %s to %s%s, %u byte queue, spilling to %s, %llu bytes kept from before", what[k], sink[sinks].path,
+				sink[sinks].fifo ? " (FIFO)" : "", sink[sinks].queue.size, spill[k], (unsigned long long)output_queue_bytes(&sink[sinks].queue));
+		else
+			sprintf(message_buffer, "Writing %s to %s%s, %u byte queue", what[k], sink[sinks].path, sink[sinks].fifo ? " (FIFO)" : "", sink[sinks].queue.size);
+		if(config->write_log)
+			writelog_level(n < 0 ? LOG_LEVEL_ERROR : LOG_LEVEL_INFO, config->log_file_name, myname, message_buffer);
+
+		memset(&ev, 0, sizeof(ev));
+		ev.data.ptr = &sink[sinks].queue;
+		if(epoll_ctl(epfd, EPOLL_CTL_ADD, sink[sinks].queue.fd, &ev) < 0)
+			sink[sinks].queue.pollable = false; // a regular file, writes to it never wait
+		drain_sink(epfd, config, &sink[sinks], myname); // whatever an earlier run left queued
+		sinks++;
+	}
+	return sinks;
+}
+
+// publish one poll cycle of every device to the sinks, the socket clients and shared memory
+static void write_poll_cycle(int epfd, struct config_t *config, struct pentametric_t *pentametric, uint8_t count, struct sink_t *sink, uint8_t sinks, struct server_t *server, struct http_t *http, struct shm_t *shm, const struct histogram_t *cycle, const struct timer_queue_t *timer, char *myname)
+{
+	static struct sink_cycle_t points;
+	static char text[SNAPSHOT_MAX_BYTES];
+	char message_buffer[FILENAME_MAX + 64];
+	uint32_t len;
+	uint8_t s;
+
+	sink_cycle_build(&points, pentametric, count, config->report_by_exception ? config : NULL);
+	for(s = 0; s < sinks; s++)
+	{
+		// what doesn't fit is logged once per stall, how much it was comes when the reader is back
+		if(!sink_publish(&sink[s], &points) && sink[s].queue.dropped - sink[s].stall_dropped == 1 && config->write_log)
+		{
+			sprintf(message_buffer, "Output queue of %s full, dropping poll cycles", sink[s].path);
+			writelog_level(LOG_LEVEL_WARNING, config->log_file_name, myname, message_buffer);
+		}
+		drain_sink(epfd, config, &sink[s], myname);
+	}
+
+	if(server != NULL)
+	{
+		len = sink_format_meteohub(&points, text, sizeof(text), true); // socket clients always get the whole cycle
+		server_publish(server, text, len);
+		server_publish_stats(server, text, stats_format(text, sizeof(text), pentametric, count, cycle, timer, sink, sinks));
+	}
+	if(http != NULL)
+		http_publish(http, pentametric, count);
+	if(shm != NULL)
+		shm_publish(shm, pentametric, count);
+}
+
+// start the poll of a device that has no read in flight, returns false if it could not be started
+static boolean start_device_poll(int epfd, struct config_t *config, struct pentametric_t *pm, char *myname)
+{
+	pm->poll_due = false;
+
+	if(pm->port.hangup || (config->close_tty_file && pentametric_reopen(pm, config, myname))) // open tty back up
+	{
+		pm->port.hangup = true;
+		memset(pm->poll.read.valid, 0, sizeof(pm->poll.read.valid)); // nothing cached is current any more
+		return false;
+	}
+
+	// only the sensors whose period is up, the rest keep their cached values
+	schedule_take_due(&pm->schedule, &pm->poll, &pm->due, config->block_reads, poll_period_ms(config) / 2);
+	start_read_plan(&pm->port, &pm->due, &pm->pl);
+	pm->busy = true;
+	pm->task = DEVICE_TASK_POLL;
+	watch_device(epfd, pm);
+	return true;
+}
+
+// start another read of a device's fast registers
+static void start_device_sample(int epfd, struct pentametric_t *pm)
+{
+	start_read_plan(&pm->port, &pm->sample.read, &pm->pl);
+	pm->busy = true;
+	pm->task = DEVICE_TASK_SAMPLE;
+	watch_device(epfd, pm);
+}
+
+// start reading back a device's firmware version and shunt configuration
+static void start_device_verify(int epfd, struct pentametric_t *pm)
+{
+	pentametric_verify_start(pm);
+	pm->busy = true;
+	pm->task = DEVICE_TASK_VERIFY;
+	watch_device(epfd, pm);
+}
+
+// start writing the amp hour reset of a device as one batch, returns false if there is nothing to reset
+static boolean start_device_reset(int epfd, struct pentametric_t *pm)
+{
+	uint8_t count;
+
+	pm->reset_due = false;
+	if((count = build_amp_hour_reset(pm->reset, pm->reset_msg, pm->shunt_labels)) == 0)
+		return false;
+
+	pipeline_start(&pm->pl, &pm->port, pm->reset, count, pm->port.pipeline_depth);
+	pm->busy = true;
+	pm->task = DEVICE_TASK_RESET;
+	watch_device(epfd, pm);
+	return true;
+}
+
+// log how the amp hour reset of a device went
+static void finish_device_reset(struct config_t *config, struct pentametric_t *pm, char *myname)
+{
+	char message_buffer[FILENAME_MAX + 128];
+	uint8_t i, ok = 0;
+
+	for(i = 0; i < pm->pl.count; i++)
+		ok += pm->pl.request[i].ok;
+
+	if(ok < pm->pl.count)
+	{
+		sprintf(message_buffer,"Error resetting Pentametric %s Amp Hour values for non-battery shunts, %u of %u writes failed", pm->port.device, pm->pl.count - ok, pm->pl.count);
+		if(config->write_log)
+			writelog_level(LOG_LEVEL_ERROR, config->log_file_name, myname, message_buffer);
+	}
+	else
+	{
+		sprintf(message_buffer,"Reset Pentametric %s Amp Hour values for non-battery shunts", pm->port.device);
+		if(config->write_log)
+			writelog(config->log_file_name, myname, message_buffer);
+	}
+}
+
+// hand this interval's aggregates to the output and start the next interval
+static void close_sample_interval(struct pentametric_t *pm)
+{
+	uint8_t i;
+
+	memcpy(pm->report, pm->stat, sizeof(pm->report));
+	for(i = 0; i < pm->sample.count; i++)
+		sample_stat_reset(&pm->stat[i]);
+}
+
+// keep every value a finished read got in the ring file and the archive, sample reads are flagged with RING_SAMPLE
+static void store_read(struct ring_t *ring, struct archive_t *archive, struct poll_plan_t *poll, struct read_plan_t *read, uint8_t device, uint8_t flags)
+{
+	struct poll_item_t *item;
+	struct timespec ts;
+	uint64_t time_ms;
+	uint8_t *msg;
+	int32_t value;
+	uint8_t i;
+
+	if(ring == NULL && archive == NULL)
+		return;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	time_ms = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	for(i = 0; i < poll->count; i++)
+	{
+		item = &poll->item[i];
+		if((msg = get_plan_msg(read, item->address)) == NULL)
+			continue;
+		value = item->decode(msg);
+		if(ring != NULL)
+			ring_append(ring, &ts, device, item->bit | flags, value);
+		if(archive != NULL)
+			archive_append(archive, time_ms, device, item->bit | flags, value);
+	}
+}
+
+// advance a busy device after I/O or a timeout, returns true once its read is finished
+static boolean service_device(int epfd, struct pentametric_t *pm)
+{
+	pipeline_check_timeout(&pm->pl);
+
+	if(pipeline_done(&pm->pl) && (pm->task == DEVICE_TASK_VERIFY || pm->task == DEVICE_TASK_RESET ||
+		continue_read_plan(pm->task == DEVICE_TASK_SAMPLE ? &pm->sample.read : &pm->due, &pm->pl)))
+	{
+		pm->busy = false;
+		watch_device(epfd, pm);
+		return true;
+	}
+	watch_device(epfd, pm);
+	return false;
+}
+
+// put the amp hour reset and the metadata refresh on the timer queue, or take them off, as config says
+static void schedule_jobs(struct config_t *config, struct timer_queue_t *timer)
+{
+	if(!config->reset_amp_hrs)
+		timer_queue_schedule(timer, JOB_AMP_HOUR_RESET, 0);
+	else if(!timer_queue_pending(timer, JOB_AMP_HOUR_RESET))
+		timer_queue_at_midnight(timer, JOB_AMP_HOUR_RESET);
+
+	if(config->metadata_refresh_seconds == 0)
+		timer_queue_schedule(timer, JOB_METADATA_REFRESH, 0);
+	else
+		timer_queue_after(timer, JOB_METADATA_REFRESH, config->metadata_refresh_seconds * 1000ULL);
+}
+
+/*
+	run the polling loop until every device has gone away
+
+	returns:	0 = all devices hung up, or stopped by SIGINT or SIGTERM
+				3 = epoll could not be set up
+*/
+int run_event_loop(struct config_t *config, struct pentametric_t *pentametric, uint8_t count, struct ring_t *ring, struct archive_t *archive, struct server_t *server, struct http_t *http, struct shm_t *shm, char *myname)
+{
+	struct archive_t *archive_samples = config->archive_samples ? archive : NULL;
+	struct epoll_event ev[PENTAMETRIC_MAX_DEVICES + SINK_COUNT + 4]; // every device, every sink, the timer queue, the socket server, the metrics endpoint and the .conf watch
+	struct pentametric_t *pm;
+	struct histogram_t cycle; // time from a poll coming due to its cycle being written
+	struct timer_queue_t timer;
+	struct sink_t sink[SINK_COUNT];
+	char message_buffer[FILENAME_MAX + 128];
+	uint64_t now, wake, deadline, overruns, cycle_us, cycle_start_us = 0, lost;
+	uint32_t fired = 0;
+	boolean reload_pending = false;
+	uint8_t d, s, sinks, polling = 0, alive, busy;
+	int epfd, watch_fd, n, i;
+
+	if((epfd = epoll_create(PENTAMETRIC_MAX_DEVICES)) < 0)
+	{
+		if(config->write_log)
+			writelog_level(LOG_LEVEL_ERROR, config->log_file_name, myname, "could not create epoll instance");
+		return 3;
+	}
+	if(timer_queue_open(&timer) < 0)
+	{
+		if(config->write_log)
+			writelog_level(LOG_LEVEL_ERROR, config->log_file_name, myname, "could not create timer");
+		close(epfd);
+		return 3;
+	}
+	memset(&ev[0], 0, sizeof(ev[0]));
+	ev[0].events = EPOLLIN;
+	ev[0].data.ptr = &timer;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, timer.fd, &ev[0]);
+
+	// each sink's file is watched for room only while something is waiting for it
+	if((sinks = open_sinks(epfd, config, sink, myname)) == 0)
+	{
+		timer_queue_close(&timer);
+		close(epfd);
+		return 3;
+	}
+
+	wake = timer_queue_next_poll(&timer, poll_period_ms(config)); // start polling on an even boundry of the specified polling interval
+	if(config->write_log)
+	{
+		sprintf(message_buffer,"Initial sleep: %llu ms", (unsigned long long)wake);
+		writelog(config->log_file_name, myname, message_buffer);
+	}
+	schedule_jobs(config, &timer); // the first reset is at the coming midnight, never on the first poll
+
+	if(server != NULL)
+	{
+		memset(&ev[0], 0, sizeof(ev[0]));
+		ev[0].events = EPOLLIN;
+		ev[0].data.ptr = server;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, server->epfd, &ev[0]);
+	}
+	if(http != NULL)
+	{
+		memset(&ev[0], 0, sizeof(ev[0]));
+		ev[0].events = EPOLLIN;
+		ev[0].data.ptr = http;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, http->epfd, &ev[0]);
+	}
+
+	if((watch_fd = config_watch_open(config)) >= 0)
+	{
+		memset(&ev[0], 0, sizeof(ev[0]));
+		ev[0].events = EPOLLIN;
+		ev[0].data.ptr = &watch_fd;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, watch_fd, &ev[0]);
+	}
+
+	// stop cleanly so the caller can write out what it buffers
+	signal(SIGINT, request_stop);
+	signal(SIGTERM, request_stop);
+	signal(SIGUSR1, request_stats);
+	signal(SIGHUP, request_reload);
+	// a reader that goes away, meteohub restarting or a socket client, shows up as EPIPE from write()
+	signal(SIGPIPE, SIG_IGN);
+	memset(&cycle, 0, sizeof(cycle));
+
+	for(;;)
+	{
+		// a new config goes in between cycles, once the sample reads in flight have finished
+		if(reload_pending && timer_queue_pending(&timer, JOB_POLL))
+		{
+			for(d = 0, busy = 0; d < count; d++)
+				busy += pentametric[d].busy;
+			if(busy == 0)
+			{
+				reload_pending = false;
+				if((n = reload_configuration(config, pentametric, count, myname)) == 1)
+					timer_queue_next_poll(&timer, poll_period_ms(config)); // stay on even boundaries of the new interval
+				if(n >= 0)
+				{
+					schedule_jobs(config, &timer);
+					for(s = 0; s < sinks; s++)
+						sink[s].queue.spill_max = config->output_spill_max_bytes;
+				}
+			}
+		}
+
+		// start whatever idle devices should be doing next: their poll if one is due, then an amp hour reset, a read back of their metadata or another sample
+		for(d = 0; d < count; d++)
+		{
+			pm = &pentametric[d];
+			if(pm->busy)
+				continue;
+			if(pm->poll_due)
+			{
+				if(!start_device_poll(epfd, config, pm, myname))
+				{
+					close_sample_interval(pm);
+					polling--;
+				}
+			}
+			else if(pm->port.hangup || reload_pending)
+				continue;
+			else if(pm->port.fd < 0) // with CLOSE_DEVICE only while the port is open for a poll
+				continue;
+			else if(pm->reset_due && start_device_reset(epfd, pm))
+				continue;
+			else if(pm->verify_tries > 0)
+				start_device_verify(epfd, pm);
+			else if(pm->sample.count > 0)
+				start_device_sample(epfd, pm);
+		}
+
+		if(polling == 0 && !timer_queue_pending(&timer, JOB_POLL)) // every device is done, write out the cycle
+		{
+			cycle_us = monotonic_us() - cycle_start_us;
+			histogram_add(&cycle, cycle_us);
+			write_poll_cycle(epfd, config, pentametric, count, sink, sinks, server, http, shm, &cycle, &timer, myname);
+			if(ring != NULL)
+				ring_sync(ring);
+			if(archive != NULL)
+				archive_sync(archive);
+			if(trace_flush() < 0 && config->write_log)
+				writelog_level(LOG_LEVEL_ERROR, config->log_file_name, myname, "could not write trace file, serial capture stopped");
+
+			if(config->close_tty_file) // close tty files, a reset or metadata check still in flight closes its own
+				for(d = 0; d < count; d++)
+					if(!pentametric[d].busy)
+						serial_close(&pentametric[d].port);
+
+			overruns = timer.overruns;
+			timer_queue_next_poll(&timer, poll_period_ms(config));
+			if(timer.overruns > overruns && config->write_log)
+			{
+				sprintf(message_buffer, "Poll cycle took %llu ms, %llu poll(s) skipped", (unsigned long long)(cycle_us / 1000),
+					(unsigned long long)(timer.overruns - overruns));
+				writelog_level(LOG_LEVEL_WARNING, config->log_file_name, myname, message_buffer);
+			}
+		}
+
+		for(d = 0, alive = 0; d < count; d++)
+			alive += !pentametric[d].port.hangup;
+		if(alive == 0 && polling == 0)
+			break;
+		if(stop_signal)
+		{
+			if(config->write_log)
+			{
+				sprintf(message_buffer, "Stopping on signal %d", (int)stop_signal);
+				writelog(config->log_file_name, myname, message_buffer);
+			}
+			break;
+		}
+		if(stats_signal)
+		{
+			stats_signal = 0;
+			stats_log(config, pentametric, count, &cycle, &timer, sink, sinks, myname);
+		}
+		if(reload_signal)
+		{
+			reload_signal = 0;
+			reload_pending = true;
+			continue; // don't sleep, it may be possible to reload right away
+		}
+
+		// sleep until the next timed job is due, or until the earliest response deadline of a read in flight
+		now = monotonic_ms();
+		wake = UINT64_MAX;
+		for(d = 0; d < count; d++)
+		{
+			if(!pentametric[d].busy)
+				continue;
+			if(pipeline_done(&pentametric[d].pl))
+				wake = now; // finished without needing I/O, e.g. an empty plan
+			else if(pentametric[d].pl.deadline < wake)
+				wake = pentametric[d].pl.deadline;
+		}
+		// or until a socket client that never sent its command, or an idle scraper, is due to be dropped
+		if(server != NULL && (deadline = server_expire(server)) < wake)
+			wake = deadline;
+		if(http != NULL && (deadline = http_expire(http)) < wake)
+			wake = deadline;
+
+		n = epoll_wait(epfd, ev, PENTAMETRIC_MAX_DEVICES + SINK_COUNT + 4, wake == UINT64_MAX ? -1 : wake > now ? (int)(wake - now > INT_MAX ? INT_MAX : wake - now) : 0);
+		if(n < 0 && errno != EINTR)
+			break;
+
+		for(i = 0; i < n; i++)
+		{
+			if(ev[i].data.ptr == &timer)
+			{
+				fired |= timer_queue_fired(&timer);
+				continue;
+			}
+			for(s = 0; s < sinks && ev[i].data.ptr != &sink[s].queue; s++)
+				;
+			if(s < sinks)
+			{
+				drain_sink(epfd, config, &sink[s], myname);
+				continue;
+			}
+			if(ev[i].data.ptr == server) // socket clients have their own epoll set, nested in this one
+			{
+				server_service(server);
+				continue;
+			}
+			if(ev[i].data.ptr == http) // so do scrapers
+			{
+				http_service(http);
+				continue;
+			}
+			if(ev[i].data.ptr == &watch_fd)
+			{
+				if(config_watch_changed(watch_fd, config))
+					reload_pending = true;
+				continue;
+			}
+			pm = (struct pentametric_t *)ev[i].data.ptr;
+			if(ev[i].events & EPOLLERR)
+				pm->port.hangup = true;
+			if(ev[i].events & EPOLLOUT)
+				pipeline_on_writable(&pm->pl);
+			if(ev[i].events & (EPOLLIN | EPOLLHUP))
+				pipeline_on_readable(&pm->pl);
+		}
+
+		for(d = 0; d < count; d++)
+		{
+			pm = &pentametric[d];
+			if(!pm->busy || !service_device(epfd, pm))
+				continue;
+
+			if(pm->task == DEVICE_TASK_VERIFY || pm->task == DEVICE_TASK_RESET)
+			{
+				if(pm->task == DEVICE_TASK_VERIFY)
+					pentametric_verify_done(pm, config, myname);
+				else
+					finish_device_reset(config, pm, myname);
+				if(config->close_tty_file)
+					serial_close(&pm->port);
+			}
+			else if(pm->task == DEVICE_TASK_SAMPLE)
+			{
+				add_samples(&pm->sample, pm->stat);
+				analytics_add(&pm->analytics, &pm->sample, &pm->sample.read, pm->shunt_labels, monotonic_us());
+				store_read(ring, archive_samples, &pm->sample, &pm->sample.read, pm->index, RING_SAMPLE);
+			}
+			else
+			{
+				analytics_add(&pm->analytics, &pm->poll, &pm->due, pm->shunt_labels, monotonic_us());
+				schedule_put_back(&pm->schedule, &pm->poll, &pm->due);
+				store_read(ring, archive, &pm->poll, &pm->due, pm->index, 0);
+				close_sample_interval(pm);
+				polling--;
+			}
+		}
+
+		if(fired & (1 << JOB_POLL))
+		{
+			cycle_start_us = monotonic_us();
+			for(d = 0; d < count; d++)
+			{
+				pentametric[d].poll_due = true;
+				polling++;
+			}
+		}
+
+		// each device writes the reset after its midnight poll, which came due at the same time and goes first
+		if(fired & (1 << JOB_AMP_HOUR_RESET))
+		{
+			if(config->write_log)
+				writelog(config->log_file_name, myname, "Resetting non-battery shunt Amp Hours after the midnight poll");
+			for(d = 0; d < count; d++)
+				pentametric[d].reset_due = true;
+			timer_queue_at_midnight(&timer, JOB_AMP_HOUR_RESET);
+		}
+
+		if(fired & (1 << JOB_METADATA_REFRESH))
+		{
+			for(d = 0; d < count; d++)
+				pentametric[d].verify_tries = PENTAMETRIC_VERIFY_TRIES;
+			timer_queue_after(&timer, JOB_METADATA_REFRESH, config->metadata_refresh_seconds * 1000ULL);
+		}
+		fired = 0;
+	}
+
+	stats_log(config, pentametric, count, &cycle, &timer, sink, sinks, myname);
+	for(d = 0; d < count; d++)
+		serial_close(&pentametric[d].port);
+	if(watch_fd >= 0)
+		close(watch_fd);
+	for(s = 0; s < sinks; s++)
+		if((lost = sink_close(&sink[s])) > 0 && config->write_log)
+		{
+			sprintf(message_buffer, "%llu bytes of output to %s could not be written or kept", (unsigned long long)lost, sink[s].path);
+			writelog_level(LOG_LEVEL_WARNING, config->log_file_name, myname, message_buffer);
+		}
+	timer_queue_close(&timer);
+	close(epfd);
+
+	return 0;
+}
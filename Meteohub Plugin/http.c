@@ -0,0 +1,396 @@
+#include "mhpmpi.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <errno.h>
+
+/*
+	http.c
+
+	minimal HTTP/1.1 listener for Prometheus. GET /metrics answers with
+	the latest poll in the Prometheus text exposition format. The
+	response is rendered once per poll cycle in http_publish(), so a
+	scrape is a copy of a ready made buffer and never touches the serial
+	port. Each connection gets one response and is closed, one that
+	hasn't had it within HTTP_CLIENT_TIMEOUT_MS is dropped.
+
+	Values are converted from meteohub units (1/100, or 1/10 for
+	temperature) back to volts, amps, amp hours and so on. Shunt values
+	carry the shunt number and the role get_shunt_labels() reported for
+	it, battery or non_battery (unknown when the read failed), as labels.
+*/
+
+#define HTTP_LABEL_NONE 0
+#define HTTP_LABEL_BATTERY 1 // battery="n", n from the sensor's position in the family
+#define HTTP_LABEL_SHUNT 2 // shunt="n",role="battery|non_battery|unknown"
+
+// a prometheus metric family and the registry sensors that feed it
+struct http_family_t
+{
+	const char *name;
+	const char *help;
+	uint32_t mask;			// PENTAMETRIC_* sensor bits, in label number order
+	uint8_t decimals;		// meteohub value / 10^decimals = metric value
+	uint8_t label;			// HTTP_LABEL_*
+};
+
+static const struct http_family_t http_family[] =
+{
+	{"pentametric_battery_volts", "Battery voltage.", PENTAMETRIC_BATTERY1_VOLTS | PENTAMETRIC_BATTERY2_VOLTS, 2, HTTP_LABEL_BATTERY},
+	{"pentametric_battery_average_volts", "Filtered battery voltage.", PENTAMETRIC_AVERAGE_BATTERY1_VOLTS | PENTAMETRIC_AVERAGE_BATTERY2_VOLTS, 2, HTTP_LABEL_BATTERY},
+	{"pentametric_battery_percent_full", "Battery state of charge.", PENTAMETRIC_BATTERY1_PERCENT_FULL | PENTAMETRIC_BATTERY2_PERCENT_FULL, 2, HTTP_LABEL_BATTERY},
+	{"pentametric_battery_days_since_charged", "Days since the battery was last fully charged.", PENTAMETRIC_DAYS_SINCE_BATTERY1_CHARGED | PENTAMETRIC_DAYS_SINCE_BATTERY2_CHARGED, 2, HTTP_LABEL_BATTERY},
+	{"pentametric_battery_days_since_equalized", "Days since the battery was last equalized.", PENTAMETRIC_DAYS_SINCE_BATTERY1_EQUALIZED | PENTAMETRIC_DAYS_SINCE_BATTERY2_EQUALIZED, 2, HTTP_LABEL_BATTERY},
+	{"pentametric_shunt_amps", "Current through the shunt, negative is discharge.", PENTAMETRIC_AMPS1 | PENTAMETRIC_AMPS2 | PENTAMETRIC_AMPS3, 2, HTTP_LABEL_SHUNT},
+	{"pentametric_shunt_average_amps", "Filtered current through the shunt.", PENTAMETRIC_AVERAGE_AMPS1 | PENTAMETRIC_AVERAGE_AMPS2 | PENTAMETRIC_AVERAGE_AMPS3, 2, HTTP_LABEL_SHUNT},
+	{"pentametric_shunt_amp_hours", "Amp hours through the shunt since it was last reset.", PENTAMETRIC_AMP_HOURS1 | PENTAMETRIC_AMP_HOURS2 | PENTAMETRIC_AMP_HOURS3, 2, HTTP_LABEL_SHUNT},
+	{"pentametric_shunt_cumulative_amp_hours", "Lifetime amp hours through the shunt.", PENTAMETRIC_CUM_AMP_HOURS1 | PENTAMETRIC_CUM_AMP_HOURS2, 2, HTTP_LABEL_SHUNT},
+	{"pentametric_shunt_watts", "Power through the shunt.", PENTAMETRIC_WATTS1 | PENTAMETRIC_WATTS2, 2, HTTP_LABEL_SHUNT},
+	{"pentametric_shunt_watt_hours", "Watt hours through the shunt since it was last reset.", PENTAMETRIC_WATT_HOURS1 | PENTAMETRIC_WATT_HOURS2, 2, HTTP_LABEL_SHUNT},
+	{"pentametric_temperature_celsius", "Battery temperature.", PENTAMETRIC_TEMPERATURE, 1, HTTP_LABEL_NONE}
+};
+
+// append a string, returns the new length; text that doesn't fit is cut off
+static uint32_t http_put(char *text, uint32_t size, uint32_t len, const char *s)
+{
+	uint32_t n = strlen(s);
+
+	if(len + n >= size)
+		n = len < size ? size - len - 1 : 0;
+	memcpy(text + len, s, n);
+	return len + n;
+}
+
+// stop watching a connection and free its slot
+static void http_drop(struct http_t *http, uint8_t slot)
+{
+	struct http_client_t *client = http->client[slot];
+
+	epoll_ctl(http->epfd, EPOLL_CTL_DEL, client->fd, NULL);
+	close(client->fd);
+	free(client->out);
+	free(client);
+	http->client[slot] = NULL;
+}
+
+// send what the socket takes, returns false once the response is out or the client is gone
+static boolean http_flush(struct http_t *http, struct http_client_t *client)
+{
+	struct epoll_event ev;
+	ssize_t n;
+
+	while(client->out_done < client->out_len)
+	{
+		n = send(client->fd, client->out + client->out_done, client->out_len - client->out_done, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if(n < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			if(errno != EAGAIN && errno != EWOULDBLOCK)
+				return false;
+			if(!(client->events & EPOLLOUT))
+			{
+				memset(&ev, 0, sizeof(ev));
+				ev.events = client->events = EPOLLOUT;
+				ev.data.ptr = client;
+				epoll_ctl(http->epfd, EPOLL_CTL_MOD, client->fd, &ev);
+			}
+			return true;
+		}
+		client->out_done += n;
+	}
+	return false;
+}
+
+// queue a copy of a response for a client
+static boolean http_respond(struct http_t *http, struct http_client_t *client, const char *response, uint32_t len)
+{
+	if((client->out = (char *)malloc(len)) == NULL)
+		return false;
+	memcpy(client->out, response, len);
+	client->out_len = len;
+	client->out_done = 0;
+	return http_flush(http, client);
+}
+
+// read the request, answering once its header is complete; returns false when the client is done with
+static boolean http_receive(struct http_t *http, struct http_client_t *client)
+{
+	static const char not_found[] =
+		"HTTP/1.1 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: 10\r\nConnection: close\r\n\r\nnot found\n";
+	static const char bad_method[] =
+		"HTTP/1.1 405 Method Not Allowed\r\nAllow: GET\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+	ssize_t n;
+
+	if(client->out != NULL)
+		return true; // already answering, ignore anything else
+
+	n = recv(client->fd, client->in + client->in_len, sizeof(client->in) - 1 - client->in_len, MSG_DONTWAIT);
+	if(n == 0)
+		return false;
+	if(n < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+	client->in_len += n;
+	client->in[client->in_len] = '\0';
+
+	if(strstr(client->in, "\r\n\r\n") == NULL && strstr(client->in, "\n\n") == NULL)
+		return client->in_len < sizeof(client->in) - 1; // header not complete yet, or too long
+
+	if(strncmp(client->in, "GET ", 4) != 0)
+		return http_respond(http, client, bad_method, sizeof(bad_method) - 1);
+	if(strncmp(client->in + 4, "/metrics ", 9) != 0 && strncmp(client->in + 4, "/metrics?", 9) != 0 && strncmp(client->in + 4, "/ ", 2) != 0)
+		return http_respond(http, client, not_found, sizeof(not_found) - 1);
+	return http_respond(http, client, http->response, http->response_len);
+}
+
+static void http_accept(struct http_t *http)
+{
+	struct http_client_t *client;
+	struct epoll_event ev;
+	uint8_t slot;
+	int fd;
+
+	while((fd = accept(http->listen_fd, NULL, NULL)) >= 0)
+	{
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+		for(slot = 0; slot < HTTP_MAX_CLIENTS && http->client[slot] != NULL; slot++)
+			;
+		if(slot == HTTP_MAX_CLIENTS || (client = (struct http_client_t *)calloc(1, sizeof(struct http_client_t))) == NULL)
+		{
+			close(fd);
+			continue;
+		}
+
+		client->fd = fd;
+		client->accepted_ms = monotonic_ms();
+		memset(&ev, 0, sizeof(ev));
+		ev.events = client->events = EPOLLIN;
+		ev.data.ptr = client;
+		if(epoll_ctl(http->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		{
+			close(fd);
+			free(client);
+			continue;
+		}
+		http->client[slot] = client;
+	}
+}
+
+/*
+	listen for scrapes on address:port
+
+	returns:	0 = OK
+				-1 = socket could not be created or bound
+				-2 = epoll set could not be created
+*/
+int http_open(struct http_t *http, char *address, uint16_t port)
+{
+	struct sockaddr_in addr;
+	struct epoll_event ev;
+	int on = 1;
+
+	memset(http, 0, sizeof(struct http_t));
+	http->listen_fd = -1;
+	http->epfd = -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if(inet_pton(AF_INET, address, &addr.sin_addr) != 1)
+		return -1;
+
+	if((http->listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+		setsockopt(http->listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+		bind(http->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		listen(http->listen_fd, HTTP_MAX_CLIENTS) < 0)
+	{
+		http_close(http);
+		return -1;
+	}
+	fcntl(http->listen_fd, F_SETFL, fcntl(http->listen_fd, F_GETFL) | O_NONBLOCK);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL; // the listening socket
+	if((http->epfd = epoll_create(HTTP_MAX_CLIENTS + 1)) < 0 || epoll_ctl(http->epfd, EPOLL_CTL_ADD, http->listen_fd, &ev) < 0)
+	{
+		http_close(http);
+		return -2;
+	}
+
+	// nothing polled yet
+	http->response_len = http_put(http->response, sizeof(http->response), 0,
+		"HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+	return 0;
+}
+
+void http_close(struct http_t *http)
+{
+	uint8_t slot;
+
+	for(slot = 0; slot < HTTP_MAX_CLIENTS; slot++)
+		if(http->client[slot] != NULL)
+			http_drop(http, slot);
+	if(http->epfd >= 0)
+		close(http->epfd);
+	if(http->listen_fd >= 0)
+		close(http->listen_fd);
+	http->epfd = -1;
+	http->listen_fd = -1;
+}
+
+/*
+	drop connections that have had HTTP_CLIENT_TIMEOUT_MS to send a
+	request and take the response. Called by the event loop every time
+	round, like server_expire(), so an idle connection goes on time.
+
+	returns:	monotonic ms when the next connection is due to be
+				dropped, UINT64_MAX for none
+*/
+uint64_t http_expire(struct http_t *http)
+{
+	uint64_t now = monotonic_ms();
+	uint64_t next = UINT64_MAX;
+	uint8_t slot;
+
+	for(slot = 0; slot < HTTP_MAX_CLIENTS; slot++)
+	{
+		if(http->client[slot] == NULL)
+			continue;
+		if(now - http->client[slot]->accepted_ms >= HTTP_CLIENT_TIMEOUT_MS)
+			http_drop(http, slot);
+		else if(http->client[slot]->accepted_ms + HTTP_CLIENT_TIMEOUT_MS < next)
+			next = http->client[slot]->accepted_ms + HTTP_CLIENT_TIMEOUT_MS;
+	}
+	return next;
+}
+
+/*
+	handle whatever is ready on the listening socket and the connections,
+	never blocks. Stale connections go first, so idle ones can't keep a
+	scrape from getting a slot.
+*/
+void http_service(struct http_t *http)
+{
+	struct epoll_event ev[HTTP_MAX_CLIENTS + 1];
+	struct http_client_t *client;
+	uint8_t slot;
+	int n, i;
+
+	http_expire(http);
+	n = epoll_wait(http->epfd, ev, HTTP_MAX_CLIENTS + 1, 0);
+	for(i = 0; i < n; i++)
+	{
+		if(ev[i].data.ptr == NULL)
+		{
+			http_accept(http);
+			continue;
+		}
+
+		client = (struct http_client_t *)ev[i].data.ptr;
+		if((ev[i].events & (EPOLLERR | EPOLLHUP)) ||
+			((ev[i].events & EPOLLIN) && !http_receive(http, client)) ||
+			((ev[i].events & EPOLLOUT) && !http_flush(http, client)))
+		{
+			for(slot = 0; slot < HTTP_MAX_CLIENTS; slot++)
+				if(http->client[slot] == client)
+				{
+					http_drop(http, slot);
+					break;
+				}
+		}
+	}
+}
+
+// render the latest poll of every device as the response to the next scrapes
+void http_publish(struct http_t *http, struct pentametric_t *pentametric, uint8_t count)
+{
+	static char body[HTTP_MAX_BODY_BYTES];
+	static const char *role[] = {"non_battery", "battery"};
+	const struct http_family_t *family;
+	struct poll_item_t *item;
+	char number[16];
+	uint32_t len = 0;
+	uint8_t *msg;
+	uint8_t f, d, i, bit, n;
+	int32_t value;
+
+	// per device status first
+	len = http_put(body, sizeof(body), len, "# HELP pentametric_up 1 while the device answers on its serial port.\n# TYPE pentametric_up gauge\n");
+	for(d = 0; d < count; d++)
+	{
+		len = http_put(body, sizeof(body), len, "pentametric_up{device=\"");
+		len = http_put(body, sizeof(body), len, pentametric[d].port.device);
+		len = http_put(body, sizeof(body), len, pentametric[d].port.hangup ? "\"} 0\n" : "\"} 1\n");
+	}
+	len = http_put(body, sizeof(body), len, "# HELP pentametric_firmware_version Firmware version the device reported at startup.\n# TYPE pentametric_firmware_version gauge\n");
+	for(d = 0; d < count; d++)
+	{
+		len = http_put(body, sizeof(body), len, "pentametric_firmware_version{device=\"");
+		len = http_put(body, sizeof(body), len, pentametric[d].port.device);
+		len = http_put(body, sizeof(body), len, "\"} ");
+		number[format_fixed(number, pentametric[d].firmware_version, 1)] = '\0';
+		len = http_put(body, sizeof(body), len, number);
+		len = http_put(body, sizeof(body), len, "\n");
+	}
+
+	for(f = 0; f < sizeof(http_family) / sizeof(http_family[0]); f++)
+	{
+		family = &http_family[f];
+		len = http_put(body, sizeof(body), len, "# HELP ");
+		len = http_put(body, sizeof(body), len, family->name);
+		len = http_put(body, sizeof(body), len, " ");
+		len = http_put(body, sizeof(body), len, family->help);
+		len = http_put(body, sizeof(body), len, "\n# TYPE ");
+		len = http_put(body, sizeof(body), len, family->name);
+		len = http_put(body, sizeof(body), len, " gauge\n");
+
+		for(d = 0; d < count; d++)
+		{
+			for(i = 0; i < pentametric[d].poll.count; i++)
+			{
+				item = &pentametric[d].poll.item[i];
+				if(!(family->mask & item->sensor->mask) || (msg = get_plan_msg(&pentametric[d].poll.read, item->address)) == NULL)
+					continue;
+				value = item->decode(msg);
+
+				// the sensor's number within its family (1, 2, 3) is its battery or shunt number
+				for(bit = 0, n = 0; bit < item->bit; bit++)
+					n += (family->mask >> bit) & 1;
+				number[format_uint(number, n + 1)] = '\0';
+
+				len = http_put(body, sizeof(body), len, family->name);
+				len = http_put(body, sizeof(body), len, "{device=\"");
+				len = http_put(body, sizeof(body), len, pentametric[d].port.device);
+				if(family->label == HTTP_LABEL_BATTERY)
+				{
+					len = http_put(body, sizeof(body), len, "\",battery=\"");
+					len = http_put(body, sizeof(body), len, number);
+				}
+				else if(family->label == HTTP_LABEL_SHUNT)
+				{
+					len = http_put(body, sizeof(body), len, "\",shunt=\"");
+					len = http_put(body, sizeof(body), len, number);
+					len = http_put(body, sizeof(body), len, "\",role=\"");
+					len = http_put(body, sizeof(body), len, (pentametric[d].shunt_labels & 0x80) ? "unknown" : role[(pentametric[d].shunt_labels >> n) & 1]); // the labels read failed
+				}
+				len = http_put(body, sizeof(body), len, "\"} ");
+				number[format_fixed(number, value, family->decimals)] = '\0';
+				len = http_put(body, sizeof(body), len, number);
+				len = http_put(body, sizeof(body), len, "\n");
+			}
+		}
+	}
+
+	http->response_len = http_put(http->response, sizeof(http->response), 0,
+		"HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\nConnection: close\r\nContent-Length: ");
+	number[format_uint(number, len)] = '\0';
+	http->response_len = http_put(http->response, sizeof(http->response), http->response_len, number);
+	http->response_len = http_put(http->response, sizeof(http->response), http->response_len, "\r\n\r\n");
+	if(http->response_len + len > sizeof(http->response))
+		len = sizeof(http->response) - http->response_len;
+	memcpy(http->response + http->response_len, body, len);
+	http->response_len += len;
+}
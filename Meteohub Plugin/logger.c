@@ -0,0 +1,298 @@
+#include "mhpmpi.h"
+#include <pthread.h>
+#include <semaphore.h>
+#include <errno.h>
+
+/*
+	logger.c
+
+	log messages are queued in memory and written out by a background
+	thread, so a slow SD card or flash log never stalls a poll. The queue
+	is a fixed ring of preallocated entries with one producer (the polling
+	thread) and one consumer (the writer thread), so queueing a message is
+	a copy and a sem_post(), never a wait. When the queue is full the
+	message is dropped and counted, and the writer notes the count in the
+	log once it catches up.
+
+	The writer takes everything queued at once and writes it with a single
+	write() to the log file and one to stderr. It reopens the log when
+	someone else has rotated or removed it, and rotates it itself by size
+	or age when LOG_ROTATE_BYTES or LOG_ROTATE_SECONDS are set.
+
+	Until logger_start() is called, writelog() writes synchronously the
+	way it always has.
+*/
+
+struct log_entry_t
+{
+	time_t time;
+	uint8_t level;
+	char text[LOG_MESSAGE_BYTES];
+};
+
+static struct
+{
+	boolean running;
+	char file_name[FILENAME_MAX];
+	char process_name[FILENAME_MAX];
+	uint8_t level;
+	uint32_t rotate_bytes;
+	uint32_t rotate_seconds;
+	uint8_t rotate_keep;
+
+	struct log_entry_t queue[LOG_QUEUE_ENTRIES];
+	uint32_t head;			// next entry the producer fills
+	uint32_t tail;			// next entry the writer takes
+	uint32_t dropped;		// messages lost to a full queue
+	uint32_t dropped_noted;	// dropped count last written to the log
+	sem_t wake;
+	pthread_t thread;
+	int stop;				// set by logger_stop(), the writer drains the queue and exits
+
+	int fd;
+	off_t size;
+	time_t opened;
+	dev_t dev;
+	ino_t ino;
+} logger;
+
+static const char *level_prefix[] = {"ERROR: ", "WARNING: ", "", "DEBUG: "}; // indexed by LOG_LEVEL_*
+
+// open the log for appending, noting its identity so an outside rotation can be spotted
+static void logger_open(void)
+{
+	struct stat st;
+
+	if((logger.fd = open(logger.file_name, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0)
+		return;
+	fstat(logger.fd, &st);
+	logger.size = st.st_size;
+	logger.dev = st.st_dev;
+	logger.ino = st.st_ino;
+	logger.opened = time(NULL);
+}
+
+// move name -> name.1 -> name.2 ... keeping rotate_keep old logs, and start a new one
+static void logger_rotate(void)
+{
+	char from[FILENAME_MAX + 8], to[FILENAME_MAX + 8];
+	int k;
+
+	close(logger.fd);
+	logger.fd = -1;
+
+	for(k = logger.rotate_keep - 1; k >= 1; k--)
+	{
+		snprintf(from, sizeof(from), "%s.%d", logger.file_name, k);
+		snprintf(to, sizeof(to), "%s.%d", logger.file_name, k + 1);
+		rename(from, to);
+	}
+	if(logger.rotate_keep > 0)
+	{
+		snprintf(to, sizeof(to), "%s.1", logger.file_name);
+		rename(logger.file_name, to);
+	}
+	else
+		unlink(logger.file_name);
+
+	logger_open();
+}
+
+// make sure the log is open and not due for rotation before len more bytes go in
+static void logger_prepare(size_t len)
+{
+	struct stat st;
+
+	if(logger.fd >= 0 && (stat(logger.file_name, &st) < 0 || st.st_dev != logger.dev || st.st_ino != logger.ino))
+	{
+		close(logger.fd); // moved or removed behind our back
+		logger.fd = -1;
+	}
+	if(logger.fd < 0)
+		logger_open();
+	if(logger.fd < 0 || logger.size == 0)
+		return;
+
+	if((logger.rotate_bytes > 0 && logger.size + len > logger.rotate_bytes) ||
+		(logger.rotate_seconds > 0 && time(NULL) - logger.opened >= (time_t)logger.rotate_seconds))
+		logger_rotate();
+}
+
+// write a batch to the log and stderr
+static void logger_flush(char *batch, size_t len)
+{
+	ssize_t n;
+	size_t done;
+
+	if(len == 0)
+		return;
+	logger_prepare(len);
+	for(done = 0; logger.fd >= 0 && done < len; done += n)
+		if((n = write(logger.fd, batch + done, len - done)) <= 0 && errno != EINTR)
+			break;
+		else if(n < 0)
+			n = 0;
+	logger.size += len;
+	for(done = 0; done < len; done += n)
+		if((n = write(STDERR_FILENO, batch + done, len - done)) <= 0 && errno != EINTR)
+			break;
+		else if(n < 0)
+			n = 0;
+}
+
+// format one line the way writelog() always has
+static size_t logger_format(char *out, size_t size, time_t t, uint8_t level, const char *text)
+{
+	char timestamp[25];
+	struct tm localtm;
+	int n;
+
+	localtime_r(&t, &localtm);
+	strftime(timestamp, sizeof(timestamp), "%d.%m.%Y %T", &localtm);
+	n = snprintf(out, size, "%s (%s): %s%s.\n", logger.process_name, timestamp, level_prefix[level], text);
+	return n < 0 ? 0 : ((size_t)n < size ? (size_t)n : size - 1);
+}
+
+static void *logger_thread(void *arg)
+{
+	static char batch[LOG_BATCH_BYTES];
+	char note[64];
+	struct log_entry_t *entry;
+	uint32_t head, dropped;
+	size_t len;
+
+	for(;;)
+	{
+		sem_wait(&logger.wake);
+		head = __atomic_load_n(&logger.head, __ATOMIC_ACQUIRE);
+
+		len = 0;
+		while(logger.tail != head)
+		{
+			if(len + LOG_MESSAGE_BYTES + 128 > sizeof(batch))
+			{
+				logger_flush(batch, len);
+				len = 0;
+			}
+			entry = &logger.queue[logger.tail % LOG_QUEUE_ENTRIES];
+			len += logger_format(batch + len, sizeof(batch) - len, entry->time, entry->level, entry->text);
+			__atomic_store_n(&logger.tail, logger.tail + 1, __ATOMIC_RELEASE); // slot can be reused
+		}
+
+		dropped = __atomic_load_n(&logger.dropped, __ATOMIC_RELAXED);
+		if(dropped != logger.dropped_noted)
+		{
+			snprintf(note, sizeof(note), "%u log messages dropped, queue full", dropped - logger.dropped_noted);
+			len += logger_format(batch + len, sizeof(batch) - len, time(NULL), LOG_LEVEL_WARNING, note);
+			logger.dropped_noted = dropped;
+		}
+		logger_flush(batch, len);
+
+		if(__atomic_load_n(&logger.stop, __ATOMIC_ACQUIRE) && logger.tail == __atomic_load_n(&logger.head, __ATOMIC_ACQUIRE))
+			break;
+	}
+	return arg;
+}
+
+/*
+	start the background writer for the log named in config
+
+	returns:	0 = OK
+				-1 = thread could not be started, writelog() stays synchronous
+*/
+int logger_start(struct config_t *config, char *myname)
+{
+	snprintf(logger.file_name, sizeof(logger.file_name), "%s", config->log_file_name);
+	snprintf(logger.process_name, sizeof(logger.process_name), "%s", myname);
+	logger.level = config->log_level;
+	logger.rotate_bytes = config->log_rotate_bytes;
+	logger.rotate_seconds = config->log_rotate_seconds;
+	logger.rotate_keep = config->log_rotate_keep;
+	logger.head = logger.tail = 0;
+	logger.stop = 0;
+	logger.fd = -1;
+
+	if(sem_init(&logger.wake, 0, 0) < 0)
+		return -1;
+	if(pthread_create(&logger.thread, NULL, logger_thread, NULL) != 0)
+	{
+		sem_destroy(&logger.wake);
+		return -1;
+	}
+	logger.running = true;
+	return 0;
+}
+
+// change which messages are logged, for a config reload
+void logger_set_level(uint8_t level)
+{
+	logger.level = level;
+}
+
+// write out everything still queued and stop the writer
+void logger_stop(void)
+{
+	if(!logger.running)
+		return;
+	__atomic_store_n(&logger.stop, 1, __ATOMIC_RELEASE);
+	sem_post(&logger.wake);
+	pthread_join(logger.thread, NULL);
+	sem_destroy(&logger.wake);
+	if(logger.fd >= 0)
+		close(logger.fd);
+	logger.fd = -1;
+	logger.running = false;
+}
+
+// log a message at a LOG_LEVEL_*, queued for the writer thread once it is running
+void writelog_level(uint8_t level, char *logfilename, char *process_name, char *message)
+{
+	struct log_entry_t *entry;
+	char timestamp[25];
+	time_t t;
+	struct tm *localtm;
+	FILE *stream;
+	uint32_t head;
+
+	if(level > LOG_LEVEL_DEBUG)
+		level = LOG_LEVEL_DEBUG;
+
+	if(!logger.running)
+	{
+		t = time(NULL);
+		localtm = localtime(&t);
+
+		strftime(timestamp, sizeof(timestamp), "%d.%m.%Y %T", localtm);
+
+		if((stream = fopen(logfilename, "a")) != NULL)
+		{
+			fprintf(stream, "%s (%s): %s%s.\n", process_name, timestamp, level_prefix[level], message);
+			fclose(stream);
+		}
+		fprintf(stderr, "%s (%s): %s%s.\n", process_name, timestamp, level_prefix[level], message);
+		return;
+	}
+
+	if(level > logger.level)
+		return;
+
+	head = logger.head;
+	if(head - __atomic_load_n(&logger.tail, __ATOMIC_ACQUIRE) >= LOG_QUEUE_ENTRIES)
+	{
+		__atomic_add_fetch(&logger.dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	entry = &logger.queue[head % LOG_QUEUE_ENTRIES];
+	entry->time = time(NULL);
+	entry->level = level;
+	strncpy(entry->text, message, sizeof(entry->text) - 1);
+	entry->text[sizeof(entry->text) - 1] = '\0';
+	__atomic_store_n(&logger.head, head + 1, __ATOMIC_RELEASE);
+	sem_post(&logger.wake);
+}
+
+void writelog (char *logfilename, char *process_name, char *message)
+{
+	writelog_level(LOG_LEVEL_INFO, logfilename, process_name, message);
+}
@@ -0,0 +1,106 @@
+#include "mhpmpi.h"
+
+/*
+	metadata.c
+
+	cache of what each pentametric reported about itself at startup, its
+	firmware version, shunt select and shunt labels, so a restart can skip
+	reading them and start polling right away. The file is plain text, one
+	line per device path:
+
+		<device> <firmware version> <shunt select> <shunt labels>
+
+	with the version in decimal and the packed bitmasks in hex. Only
+	values that were all read successfully are ever written, a failed read
+	(firmware version 0, or the 0x80 bit of a bitmask set) never replaces
+	a good line. The file is replaced by writing a new one and renaming it
+	over the old one, so a crash never leaves it half written.
+*/
+
+// false when any of the values is what a failed read returns
+boolean metadata_valid(uint8_t firmware_version, uint8_t shunt_select, uint8_t shunt_labels)
+{
+	return firmware_version != 0 && !(shunt_select & 0x80) && !(shunt_labels & 0x80);
+}
+
+/*
+	look up the cached metadata of a device
+
+	returns:	true = found, the values are valid
+				false = no cache file, no line for the device or a line that doesn't parse
+*/
+boolean metadata_load(const char *file_name, const char *device, uint8_t *firmware_version, uint8_t *shunt_select, uint8_t *shunt_labels)
+{
+	char line[FILENAME_MAX + 64];
+	char name[FILENAME_MAX];
+	unsigned int version, select, labels;
+	boolean found = false;
+	FILE *fp;
+
+	if(strlen(file_name) == 0 || (fp = fopen(file_name, "r")) == NULL)
+		return false;
+
+	while(!found && fgets(line, sizeof(line), fp) != NULL)
+	{
+		if(line[0] == '#')
+			continue;
+		if(sscanf(line, "%4095s %u %x %x", name, &version, &select, &labels) != 4 || strcmp(name, device) != 0)
+			continue;
+		if(version > 0xff || select > 0xff || labels > 0xff || !metadata_valid(version, select, labels))
+			continue;
+
+		*firmware_version = version;
+		*shunt_select = select;
+		*shunt_labels = labels;
+		found = true;
+	}
+	fclose(fp);
+	return found;
+}
+
+/*
+	write the metadata of a device to the cache, keeping the lines of every other device
+
+	returns:	0 = OK
+				-1 = the values aren't valid, nothing written
+				-2 = temporary file could not be written
+				-3 = temporary file could not be renamed over the cache file
+*/
+int metadata_save(const char *file_name, const char *device, uint8_t firmware_version, uint8_t shunt_select, uint8_t shunt_labels)
+{
+	char tmp_name[FILENAME_MAX + 8];
+	char line[FILENAME_MAX + 64];
+	char name[FILENAME_MAX];
+	FILE *in, *out;
+	int error_code = 0;
+
+	if(!metadata_valid(firmware_version, shunt_select, shunt_labels))
+		return -1;
+
+	snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", file_name);
+	if((out = fopen(tmp_name, "w")) == NULL)
+		return -2;
+
+	fprintf(out, "# mhpmpi device metadata: device, firmware version, shunt select, shunt labels\n");
+	if((in = fopen(file_name, "r")) != NULL)
+	{
+		while(fgets(line, sizeof(line), in) != NULL)
+		{
+			if(line[0] == '#' || sscanf(line, "%4095s", name) != 1 || strcmp(name, device) == 0)
+				continue;
+			fputs(line, out);
+		}
+		fclose(in);
+	}
+	fprintf(out, "%s %u 0x%02x 0x%02x\n", device, firmware_version, shunt_select, shunt_labels);
+
+	if(fflush(out) != 0 || fsync(fileno(out)) != 0)
+		error_code = -2;
+	if(fclose(out) != 0)
+		error_code = -2;
+	if(error_code == 0 && rename(tmp_name, file_name) != 0)
+		error_code = -3;
+	if(error_code != 0)
+		unlink(tmp_name);
+	return error_code;
+}
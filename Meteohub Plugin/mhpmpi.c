@@ -45,22 +45,99 @@ http://linux.die.net/man/3/termios
 #include "mhpmpi.h"
 #define VERSION "1.43"
 
+// what load_configuration() needs to build the config again on a reload
+static struct config_t default_config; // built in defaults, before the .conf file and command line
+static char config_file_name[FILENAME_MAX] = "";
+static int saved_argc;
+static char **saved_argv;
+
+// command line options, override values read from .conf file
+static void get_command_line(struct config_t *config, int argc, char *argv[])
+{
+	static const char *optString = "BCd:h?LP:Rs:t:W";
+	boolean cmdline_device = false;
+	int opt = 0;
+
+	optind = 1; // scan from the start again on a reload
+	while ((opt = getopt(argc, argv ,optString)) != -1)
+	{
+		switch(opt)
+		{
+		case 'B':
+			config->block_reads = false;
+			break;
+		case 'C':
+			config->close_tty_file = true;
+			break;
+		case 'd':
+			if(!cmdline_device) // -d replaces the .conf devices, repeat it for more than one
+				config->device_count = 0;
+			cmdline_device = true;
+			if(config->device_count < PENTAMETRIC_MAX_DEVICES)
+				strcpy(config->device[config->device_count++], optarg);
+			break;
+		case 'h':
+		case '?':
+			display_usage(argv[0]);
+			break;
+		case 'L':
+			config->write_log = true;
+			break;
+		case 'P':
+			snprintf(config->replay_file_name, sizeof(config->replay_file_name), "%s", optarg);
+			break;
+		case 'R':
+			config->reset_amp_hrs = true;
+			break;
+		case 's':
+			config->sensor_mask = (uint32_t)strtol(optarg, (char **)NULL, 0);
+			break;
+		case 't':
+			config->sleep_seconds = (uint16_t)atoi(optarg);
+			config->sleep_ms = 0; // whole seconds from the command line win over SLEEP_MS
+			break;
+		case 'W':
+			config->replay_realtime = true;
+			break;
+
+		}
+	}
+}
+
+/*
+	build the config from the defaults, the .conf file and the command
+	line, in that order. Used at startup and again for every reload.
+
+	returns:	true = a .conf file was read
+				false = no readable .conf file, defaults and command line only
+*/
+boolean load_configuration(struct config_t *config)
+{
+	boolean found;
+
+	*config = default_config;
+	found = get_configuration(config, config_file_name);
+	get_command_line(config, saved_argc, saved_argv);
+	return found;
+}
+
 /*
 main program
 */
 int main (int argc, char *argv[])
 {
 	char log_file_name[FILENAME_MAX] = "";
-	char config_file_name[FILENAME_MAX] = "";
 	strcpy(config_file_name, argv[0]);
 	strcat(config_file_name, ".conf");
-	static const char *optString = "Cd:h?LRs:t:";
+	saved_argc = argc;
+	saved_argv = argv;
 
 	struct config_t config;
 
 	// set default values for command line/config options
 	config.close_tty_file = false;
-	strcpy(config.device,"");
+	config.device_count = 0;
+	config.device_id_stride = 32; // room for every sensor of one pentametric
 	config.write_log = false;
 	strcpy(log_file_name, argv[0]);
 	strcat(log_file_name,".log");
@@ -103,63 +180,68 @@ int main (int argc, char *argv[])
 		PENTAMETRIC_TEMPERATURE
 		;
 	config.sleep_seconds = 60; // 1 min is default sleep time;
-
-
-	FILE *ttyfile;
-
-	uint32_t mh_data_id = 0;
-	const char mh_data_fmt[] = "data%d %d\n";
-	uint32_t mh_temp_id = 0;
-	const char mh_temp_fmt[] = "t%d %d\n";
-
-	uint8_t shunt_select = 0;
-	const char a100[] = "100A"; // desc for 100A shunt
-	const char a500[] = "500A"; // desc for 500A shunt
-	uint8_t shunt_labels = 0;
-	const char aBattery[] = "Battery"; // desc for Battery (dis-charge) shunt
-	const char aNonBattery[] = "Non-Battery"; // desc for Source (charge) shunt
+	config.sleep_ms = 0; // whole seconds from sleep_seconds
+	config.block_reads = true; // merge adjacent registers into one short read
+	config.serial_timeout_ms = 500; // device turnaround allowance per transaction
+	config.serial_retries = 2; // extra attempts after a timeout or checksum error
+	config.pipeline_depth = 1; // commands in flight at once
+	config.sample_mask = 0; // no sampling between polls
+	config.sample_id_base = 256; // sample aggregates numbered above every device's own range
+	config.analytics = false; // pass through what the pentametric computes only
+	config.analytics_id_base = 512; // above every device's sample aggregates
+	config.battery_capacity_ah = 0; // no state of charge
+	strcpy(config.ring_file_name,""); // no ring file
+	config.ring_records = 262144; // 4MB of 16 byte records
+	strcpy(config.archive_file_name,""); // no archive
+	config.archive_samples = false; // archive polls only
+	strcpy(config.socket_path,""); // no socket server
+	strcpy(config.shm_name,""); // no shared memory snapshot
+	strcpy(config.http_address,"127.0.0.1"); // scrapes from this host only
+	config.http_port = 0; // no prometheus endpoint
+	config.log_level = LOG_LEVEL_INFO; // everything but debug messages
+	config.log_rotate_bytes = 0; // meteohub rotates its own log
+	config.log_rotate_seconds = 0;
+	config.log_rotate_keep = 3;
+	memset(config.sensor_period, 0, sizeof(config.sensor_period)); // every sensor read every poll
+	memset(config.deadband, 0xff, sizeof(config.deadband)); // -1, every sensor written every poll
+	memset(config.deadband_relative, 0, sizeof(config.deadband_relative));
+	config.report_by_exception = false;
+	config.heartbeat_seconds = 3600; // deadbanded sensors still written once an hour
+	strcpy(config.config_path,""); // set by get_configuration()
+	config.watch_config = true; // reload when the .conf file is saved
+	strcpy(config.metadata_file_name,""); // read every device's setup at startup
+	config.metadata_refresh_seconds = 86400; // notice setup changes made on the pentametric once a day
+	config.output_queue_bytes = 262144; // a few hours of 5 minute polls while meteohub isn't reading
+	strcpy(config.output_spill_file,""); // output that doesn't fit in memory is dropped
+	config.output_spill_max_bytes = 16777216;
+	strcpy(config.csv_file,""); // no CSV sink
+	strcpy(config.json_fifo,""); // no JSON lines sink
+	strcpy(config.json_spill_file,""); // JSON lines that don't fit in memory are dropped
+	strcpy(config.binary_file,""); // no binary sink
+	strcpy(config.binary_spill_file,"");
+	config.sink_queue_bytes = 262144;
+	strcpy(config.trace_file_name,""); // no serial capture
+	strcpy(config.replay_file_name,""); // poll the devices
+	config.replay_realtime = false;
+
+
+	struct pentametric_t *pentametric;
+	struct ring_t ring, *ring_ptr = NULL;
+	struct archive_t archive, *archive_ptr = NULL;
+	struct server_t *server = NULL;
+	struct http_t *http = NULL;
+	struct shm_t shm, *shm_ptr = NULL;
 	char *message_buffer;
-	int set_tty_error_code = 0;
-	time_t seconds_since_midnight = 0;
+	int error_code = 0;
+	uint8_t d;
 
-	// get cofig options
-	if(!get_configuration(&config, config_file_name))
+	// get cofig options, command line options override values read from .conf file
+	default_config = config;
+	if(!load_configuration(&config))
 	{
 		fprintf(stderr,"\nno readable .conf file found, using values from command line arguments");
 	}
 
-	// get command line options, will override values read from .conf file
-	int opt = 0;	
-	while ((opt = getopt(argc, argv ,optString)) != -1)
-	{
-		switch(opt)
-		{
-		case 'C':
-			config.close_tty_file = true;
-			break;
-		case 'd':
-			strcpy(config.device, optarg);
-			break;
-		case 'h':
-		case '?':
-			display_usage(argv[0]);
-			break;
-		case 'L':
-			config.write_log = true;
-			break;
-		case 'R':
-			config.reset_amp_hrs = true;
-			break;
-		case 's':
-			config.sensor_mask = (uint32_t)strtol(optarg, (char **)NULL, 0);
-			break;
-		case 't':
-			config.sleep_seconds = (uint16_t)atoi(optarg);
-			break;
-
-		}
-	}
-
 	message_buffer = (char *)malloc(sizeof(char) * 256);
 	if (message_buffer == NULL)
 	{
@@ -167,508 +249,264 @@ int main (int argc, char *argv[])
 		return -2;
 	}
 
-	if(strlen(config.device) == 0) // can't run when no device is specified
+	// play a TRACE_FILE capture back through the decoders instead of polling
+	if(strlen(config.replay_file_name) != 0)
+	{
+		if((error_code = trace_replay(config.replay_file_name, config.replay_realtime)) < 0)
+			fprintf(stderr, "could not play back %s: %d\n", config.replay_file_name, error_code);
+		free(message_buffer);
+		return error_code;
+	}
+
+	if(config.device_count == 0 || poll_period_ms(&config) == 0) // can't run when no device or no poll interval is specified
 	{
 		display_usage(argv[0]);
 		return -1;
 	}
 
+	// from here on log messages are written by a background thread
+	if(config.write_log && logger_start(&config, argv[0]) < 0)
+		writelog_level(LOG_LEVEL_WARNING, config.log_file_name, argv[0], "could not start log writer thread, logging synchronously");
+
+	pentametric = (struct pentametric_t *)calloc(config.device_count, sizeof(struct pentametric_t));
+	if (pentametric == NULL)
+	{
+		fprintf(stderr, "can't allocate dynamic memory for buffers\n");
+		return -2;
+	}
 
 #ifdef DEBUG
 	sprintf(message_buffer, "sensor bitmask = 0x%x", config.sensor_mask);
-	writelog(config.log_file_name, argv[0], message_buffer);
+	writelog_level(LOG_LEVEL_DEBUG, config.log_file_name, argv[0], message_buffer);
 #endif
 
-	ttyfile = fopen(config.device, "ab+");
-
-	if (!isatty(fileno(ttyfile)))
+	// serial capture starts first so the startup reads are in it too
+	if(strlen(config.trace_file_name) != 0)
 	{
+		if((error_code = trace_start(config.trace_file_name)) < 0)
+			sprintf(message_buffer, "could not open trace file %s: %d", config.trace_file_name, error_code);
+		else
+			sprintf(message_buffer, "Capturing serial traffic to %s", config.trace_file_name);
 		if(config.write_log)
-		{
-			sprintf(message_buffer, "%s is not a tty", config.device);
-			writelog(config.log_file_name, argv[0], message_buffer);
-		}
-		return 1;
+			writelog_level(error_code < 0 ? LOG_LEVEL_ERROR : LOG_LEVEL_INFO, config.log_file_name, argv[0], message_buffer);
 	}
 
-	// set tty port
-	if((set_tty_error_code = set_tty_port(ttyfile, config.device, argv[0], config.log_file_name, config.write_log)))
+	// open every pentametric and read its configuration
+	for(d = 0; d < config.device_count; d++)
 	{
-		if(config.write_log)
+		pentametric_init(&pentametric[d], &config, d);
+		if((error_code = pentametric_open(&pentametric[d], &config, argv[0])))
 		{
-			sprintf(message_buffer,"Error setting serial port: %d", set_tty_error_code);
-			writelog(config.log_file_name, argv[0], message_buffer);
+			trace_stop(); // keep the traffic that led up to it
+			logger_stop(); // get the reason into the log
+			return error_code;
 		}
-		return 2;
 	}
 
-	// log pentametric firmware version
-	if(config.write_log)
+	// keep recent values in a ring file that outlives this process, carry on without it if it can't be mapped
+	if(strlen(config.ring_file_name) != 0)
 	{
-		sprintf(message_buffer,"Pentametric Firmware version: V%-.1f", get_firmware_version(ttyfile) / 10.0); 
-		writelog(config.log_file_name, argv[0], message_buffer);
-	}
-
-	// log pentametric shunt configutation
-	shunt_select = get_shunt_select(ttyfile);
-	if(config.write_log)
-	{	
-		sprintf(message_buffer,"Pentametric Shunt Select: Shunt-1 %s, Shunt-2 %s, Shunt-3 %s", 
-			(shunt_select & SHUNT1_500A? a500: a100),
-			(shunt_select & SHUNT2_500A? a500: a100),
-			(shunt_select & SHUNT3_500A? a500: a100)); 
-		writelog(config.log_file_name, argv[0], message_buffer);
+		if((error_code = ring_open(&ring, config.ring_file_name, config.ring_records)) < 0)
+			sprintf(message_buffer, "could not map ring file %s: %d", config.ring_file_name, error_code);
+		else
+		{
+			ring_ptr = &ring;
+			sprintf(message_buffer, "Ring file %s: %u records, %llu kept from before", config.ring_file_name,
+				config.ring_records, (unsigned long long)(ring.header->head - ring_tail(&ring)));
+		}
+		if(config.write_log)
+			writelog_level(ring_ptr == NULL ? LOG_LEVEL_ERROR : LOG_LEVEL_INFO, config.log_file_name, argv[0], message_buffer);
 	}
 
-	// log pentametric shunt labels
-	shunt_labels = get_shunt_labels(ttyfile);
-	if(config.write_log)
-	{	
-		sprintf(message_buffer, "Pentametric Shunt Labels: Shunt-1 %s, Shunt-2 %s, Shunt-3 %s",
-			(shunt_labels & SHUNT1_BATTERY? aBattery: aNonBattery),
-			(shunt_labels & SHUNT2_BATTERY? aBattery: aNonBattery),
-			(shunt_labels & SHUNT3_BATTERY? aBattery: aNonBattery));
-		writelog(config.log_file_name, argv[0], message_buffer);
-
-		sprintf(message_buffer, "Started Pentametric data logging main loop. Polling at %d sec intervals.", config.sleep_seconds);
-		writelog(config.log_file_name, argv[0], message_buffer);
-	}
-	
-	seconds_since_midnight = get_seconds_since_midnight();
-	if(config.sleep_seconds - (seconds_since_midnight % config.sleep_seconds) > 0)
-	{
-		sprintf(message_buffer,"Initial sleep: %ld", config.sleep_seconds - (seconds_since_midnight % config.sleep_seconds));
-		writelog(config.log_file_name, argv[0], message_buffer);
-		sleep(config.sleep_seconds - (seconds_since_midnight % config.sleep_seconds)); // start polling on an even boundry of the specified polling interval
-	}
-	do
+	// long term archive, also optional
+	if(strlen(config.archive_file_name) != 0)
 	{
-		// 0 - battery 1 volts
-		if (config.sensor_mask & PENTAMETRIC_BATTERY1_VOLTS)
-			fprintf(stdout, mh_data_fmt, mh_data_id++, get_format1_value(ttyfile, PENTAMETRIC_ADDRESS_BATTERY1_VOLTS));
-		// 1 - battery 2 volts
-		if (config.sensor_mask & PENTAMETRIC_BATTERY2_VOLTS)
-			fprintf(stdout, mh_data_fmt, mh_data_id++, get_format1_value(ttyfile, PENTAMETRIC_ADDRESS_BATTERY2_VOLTS));
-		// 2 - average battery 1 volts 
-		if (config.sensor_mask & PENTAMETRIC_AVERAGE_BATTERY1_VOLTS)
-			fprintf(stdout, mh_data_fmt, mh_data_id++, get_format1_value(ttyfile, PENTAMETRIC_ADDRESS_AVERAGE_BATTERY1_VOLTS));
-		// 3 - average battery 2 volts
-		if (config.sensor_mask & PENTAMETRIC_AVERAGE_BATTERY2_VOLTS)
-			fprintf(stdout, mh_data_fmt, mh_data_id++, get_format1_value(ttyfile, PENTAMETRIC_ADDRESS_AVERAGE_BATTERY2_VOLTS));
-		// 4 - amps 1
-		if (config.sensor_mask & PENTAMETRIC_AMPS1)
-		{
-			if(shunt_select & SHUNT1_500A) // 500A shunt?
-				fprintf(stdout, mh_data_fmt, mh_data_id++, get_format2_value(ttyfile, PENTAMETRIC_ADDRESS_AMPS1));
-			else
-				fprintf(stdout, mh_data_fmt, mh_data_id++, get_format3_value(ttyfile, PENTAMETRIC_ADDRESS_AMPS1)); //500A shunt is only good  to 1/10 amp
-		}
-		// 5 - amps 2
-		if (config.sensor_mask & PENTAMETRIC_AMPS2)
-		{
-			if(shunt_select & SHUNT2_500A) // 500A shunt?
-				fprintf(stdout, mh_data_fmt, mh_data_id++, get_format2_value(ttyfile, PENTAMETRIC_ADDRESS_AMPS2));
-			else
-				fprintf(stdout, mh_data_fmt, mh_data_id++, get_format3_value(ttyfile, PENTAMETRIC_ADDRESS_AMPS2)); //500A shunt is only good  to 1/10 amp
-		}
-		// 6 - amps 3
-		if (config.sensor_mask & PENTAMETRIC_AMPS3)
-		{
-			if(shunt_select & SHUNT3_500A) // 500A shunt?
-				fprintf(stdout, mh_data_fmt, mh_data_id++, get_format2_value(ttyfile, PENTAMETRIC_ADDRESS_AMPS3));
-			else
-				fprintf(stdout, mh_data_fmt, mh_data_id++, get_format3_value(ttyfile, PENTAMETRIC_ADDRESS_AMPS3)); //500A shunt is only good  to 1/10 amp
-		}
-		// 7 - average amps 1
-		if (config.sensor_mask & PENTAMETRIC_AVERAGE_AMPS1)
-		{
-			if(shunt_select & SHUNT1_500A) // 500A shunt?
-				fprintf(stdout, mh_data_fmt, mh_data_id++, get_format2_value(ttyfile, PENTAMETRIC_ADDRESS_AVERAGE_AMPS1));
-			else
-				fprintf(stdout, mh_data_fmt, mh_data_id++, get_format3_value(ttyfile, PENTAMETRIC_ADDRESS_AVERAGE_AMPS1));
-		}
-		// 8 - average amps 2
-		if (config.sensor_mask & PENTAMETRIC_AVERAGE_AMPS2)
-		{
-			if(shunt_select & SHUNT2_500A) // 500A shunt?
-				fprintf(stdout, mh_data_fmt, mh_data_id++, get_format2_value(ttyfile, PENTAMETRIC_ADDRESS_AVERAGE_AMPS2));
-			else
-				fprintf(stdout, mh_data_fmt, mh_data_id++, get_format3_value(ttyfile, PENTAMETRIC_ADDRESS_AVERAGE_AMPS2));
-		}
-		// 9 - average amps 3
-		if (config.sensor_mask & PENTAMETRIC_AVERAGE_AMPS3)
-		{
-			if(shunt_select & SHUNT3_500A) // 500A shunt?
-				fprintf(stdout, mh_data_fmt, mh_data_id++, get_format2_value(ttyfile, PENTAMETRIC_ADDRESS_AVERAGE_AMPS3));
-			else
-				fprintf(stdout, mh_data_fmt, mh_data_id++, get_format3_value(ttyfile, PENTAMETRIC_ADDRESS_AVERAGE_AMPS3));
-		}
-		// 10 - amp hours 1
-		if (config.sensor_mask & PENTAMETRIC_AMP_HOURS1)
-			fprintf(stdout, mh_data_fmt, mh_data_id++, get_format3_value(ttyfile, PENTAMETRIC_ADDRESS_AMP_HOURS1));
-		// 11 - amp hours 2
-		if (config.sensor_mask & PENTAMETRIC_AMP_HOURS2)
-			fprintf(stdout, mh_data_fmt, mh_data_id++, get_format3_value(ttyfile, PENTAMETRIC_ADDRESS_AMP_HOURS2));
-		// 12 - amp hours 3
-		if (config.sensor_mask & PENTAMETRIC_AMP_HOURS3)
-			fprintf(stdout, mh_data_fmt, mh_data_id++, get_format4_value(ttyfile, PENTAMETRIC_ADDRESS_AMP_HOURS3));
-		// 13 - cum amp hours 1
-		if (config.sensor_mask & PENTAMETRIC_CUM_AMP_HOURS1)
-		{
-			if(shunt_select & SHUNT1_500A) // 500A shunt?			
-				fprintf(stdout, mh_data_fmt, mh_data_id++, get_format2b_value(ttyfile, PENTAMETRIC_ADDRESS_CUM_AMP_HOURS1));
-			else
-				fprintf(stdout, mh_data_fmt, mh_data_id++, get_format3b_value(ttyfile, PENTAMETRIC_ADDRESS_CUM_AMP_HOURS1));
-		}
-		// 14 - cum amp hours 2
-		if (config.sensor_mask & PENTAMETRIC_CUM_AMP_HOURS2)
-		{
-			if(shunt_select & SHUNT2_500A) // 500A shunt?			
-				fprintf(stdout, mh_data_fmt, mh_data_id++, get_format2b_value(ttyfile, PENTAMETRIC_ADDRESS_CUM_AMP_HOURS2));
-			else
-				fprintf(stdout, mh_data_fmt, mh_data_id++, get_format3b_value(ttyfile, PENTAMETRIC_ADDRESS_CUM_AMP_HOURS2));
-		}
-		// 15 - watts 1
-		if (config.sensor_mask & PENTAMETRIC_WATTS1)
-		{
-			if(shunt_select & SHUNT1_500A) // 500A shunt?
-				fprintf(stdout, mh_data_fmt, mh_data_id++, get_format2_value(ttyfile, PENTAMETRIC_ADDRESS_WATTS1));
-			else
-				fprintf(stdout, mh_data_fmt, mh_data_id++, get_format3_value(ttyfile, PENTAMETRIC_ADDRESS_WATTS1));
-		}
-		// 16 - watts 2
-		if (config.sensor_mask & PENTAMETRIC_WATTS2)
+		if(archive_open(&archive, config.archive_file_name) < 0)
+			sprintf(message_buffer, "could not open archive %s", config.archive_file_name);
+		else
 		{
-			if(shunt_select & SHUNT2_500A) // 500A shunt?
-				fprintf(stdout, mh_data_fmt, mh_data_id++, get_format2_value(ttyfile, PENTAMETRIC_ADDRESS_WATTS2));
-			else
-				fprintf(stdout, mh_data_fmt, mh_data_id++, get_format3_value(ttyfile, PENTAMETRIC_ADDRESS_WATTS2));
+			archive_ptr = &archive;
+			sprintf(message_buffer, "Archiving %s to %s", config.archive_samples ? "polls and samples" : "polls", config.archive_file_name);
 		}
-		// 17 - watts hours 1
-		if (config.sensor_mask & PENTAMETRIC_WATT_HOURS1)
-			fprintf(stdout, mh_data_fmt, mh_data_id++, get_format5_value(ttyfile, PENTAMETRIC_ADDRESS_WATT_HOURS1));
-		// 18 - watts hours 2
-		if (config.sensor_mask & PENTAMETRIC_WATT_HOURS2)
-			fprintf(stdout, mh_data_fmt, mh_data_id++, get_format5_value(ttyfile, PENTAMETRIC_ADDRESS_WATT_HOURS2));
-		// 19 - battery 1 percent full
-		if (config.sensor_mask & PENTAMETRIC_BATTERY1_PERCENT_FULL)
-			fprintf(stdout, mh_data_fmt, mh_data_id++, get_format6_value(ttyfile, PENTAMETRIC_ADDRESS_BATTERY1_PERCENT_FULL));		
-		// 20 - battery 2 percent full
-		if (config.sensor_mask & PENTAMETRIC_BATTERY2_PERCENT_FULL)
-			fprintf(stdout, mh_data_fmt, mh_data_id++, get_format6_value(ttyfile, PENTAMETRIC_ADDRESS_BATTERY2_PERCENT_FULL));		
-		// 21 - days since battery 1 charged
-		if (config.sensor_mask & PENTAMETRIC_DAYS_SINCE_BATTERY1_CHARGED)
-			fprintf(stdout, mh_data_fmt, mh_data_id++, get_format7_value(ttyfile, PENTAMETRIC_ADDRESS_DAYS_SINCE_BATTERY1_CHARGED));		
-		// 22 - days since battery 2 charged
-		if (config.sensor_mask & PENTAMETRIC_DAYS_SINCE_BATTERY2_CHARGED)
-			fprintf(stdout, mh_data_fmt, mh_data_id++, get_format7_value(ttyfile, PENTAMETRIC_ADDRESS_DAYS_SINCE_BATTERY2_CHARGED));		
-		// 23 - days since battery 1 equalized
-		if (config.sensor_mask & PENTAMETRIC_DAYS_SINCE_BATTERY1_EQUALIZED)
-			fprintf(stdout, mh_data_fmt, mh_data_id++, get_format7_value(ttyfile, PENTAMETRIC_ADDRESS_DAYS_SINCE_BATTERY1_EQUALIZED));		
-		// 24 - days since battery 2 equalized
-		if (config.sensor_mask & PENTAMETRIC_DAYS_SINCE_BATTERY2_EQUALIZED)
-			fprintf(stdout, mh_data_fmt, mh_data_id++, get_format7_value(ttyfile, PENTAMETRIC_ADDRESS_DAYS_SINCE_BATTERY2_EQUALIZED));		
-		// 25 - temperature
-		if (config.sensor_mask & PENTAMETRIC_TEMPERATURE)
-			fprintf(stdout, mh_temp_fmt, mh_temp_id++, get_format8_value(ttyfile, PENTAMETRIC_ADDRESS_TEMPERATURE));
-
-		mh_data_id = 0;
-		mh_temp_id = 0;
-		fflush(stdout);
-
-		if(config.close_tty_file) // close tty file
-			fclose(ttyfile);
-
-		seconds_since_midnight = get_seconds_since_midnight();
-
-		if((86400 - seconds_since_midnight) >= config.sleep_seconds)
+		if(config.write_log)
+			writelog_level(archive_ptr == NULL ? LOG_LEVEL_ERROR : LOG_LEVEL_INFO, config.log_file_name, argv[0], message_buffer);
+	}
+
+	// socket for local readers, optional too
+	if(strlen(config.socket_path) != 0)
+	{
+		if((server = (struct server_t *)malloc(sizeof(struct server_t))) == NULL || (error_code = server_open(server, config.socket_path)) < 0)
 		{
-			sleep(config.sleep_seconds - (seconds_since_midnight % config.sleep_seconds)); // sleep just the right amount to keep on boundry
-			//sleep(config.sleep_seconds); // sleep
+			sprintf(message_buffer, "could not listen on %s", config.socket_path);
+			free(server);
+			server = NULL;
 		}
 		else
+			sprintf(message_buffer, "Serving snapshots on %s", config.socket_path);
+		if(config.write_log)
+			writelog_level(server == NULL ? LOG_LEVEL_ERROR : LOG_LEVEL_INFO, config.log_file_name, argv[0], message_buffer);
+	}
+
+	// prometheus endpoint, optional as well
+	if(config.http_port != 0)
+	{
+		if((http = (struct http_t *)malloc(sizeof(struct http_t))) == NULL || (error_code = http_open(http, config.http_address, config.http_port)) < 0)
 		{
-			if((86400 - seconds_since_midnight) <= config.sleep_seconds)
-			{
-				sleep(86400 - seconds_since_midnight); // sleep just right amount until midnight
-			}
-
-			if(config.reset_amp_hrs)
-			{
-				if(config.write_log)
-				{
-					sprintf(message_buffer, "Resetting non-battery shunt Amp Hours at %lld seconds after 00:00:00", (int64_t)seconds_since_midnight);
-					writelog(config.log_file_name, argv[0], message_buffer);
-				}
-
-				if(config.close_tty_file) // open tty back up
-				{
-					ttyfile = fopen(config.device, "ab+");
-					// set tty port
-					if((set_tty_error_code = set_tty_port(ttyfile, config.device, argv[0], config.log_file_name, config.write_log)))
-					{
-						if(config.write_log)
-						{
-							sprintf(message_buffer,"Error setting serial port: %d", set_tty_error_code);
-							writelog(config.log_file_name, argv[0], message_buffer);
-						}
-						return 2;
-					}
-				}
-
-				// send command to pentametric to reset all non-battery amp hour values to zero just after midnight local time
-				if(!reset_amp_hours(ttyfile, shunt_labels))
-				{
-					if(config.write_log)
-					{
-						sprintf(message_buffer,"Error resetting Pentametric Amp Hour values for non-battery shunts");
-						writelog(config.log_file_name, argv[0], message_buffer);
-					}
-				}	
-				else
-				{
-					sprintf(message_buffer,"Reset Pentametric Amp Hour values for non-battery shunts");
-					writelog(config.log_file_name, argv[0], message_buffer);
-				}
-
-				if(config.close_tty_file) // close tty file
-					fclose(ttyfile);
-			}
+			sprintf(message_buffer, "could not listen on %s:%d", config.http_address, config.http_port);
+			free(http);
+			http = NULL;
 		}
+		else
+			sprintf(message_buffer, "Serving metrics on http://%s:%d/metrics", config.http_address, config.http_port);
+		if(config.write_log)
+			writelog_level(http == NULL ? LOG_LEVEL_ERROR : LOG_LEVEL_INFO, config.log_file_name, argv[0], message_buffer);
+	}
 
-		if(config.close_tty_file) // open tty back up
+	// shared memory snapshot, starts out with each device's configuration
+	if(strlen(config.shm_name) != 0)
+	{
+		if((error_code = shm_open_segment(&shm, config.shm_name)) < 0)
+			sprintf(message_buffer, "could not map shared memory %s: %d", config.shm_name, error_code);
+		else
 		{
-			ttyfile = fopen(config.device, "ab+");
-			// set tty port
-			if((set_tty_error_code = set_tty_port(ttyfile, config.device, argv[0], config.log_file_name, config.write_log)))
-			{
-				if(config.write_log)
-				{
-					sprintf(message_buffer,"Error setting serial port: %d", set_tty_error_code);
-					writelog(config.log_file_name, argv[0], message_buffer);
-				}
-				return 2;
-			}
+			shm_ptr = &shm;
+			shm_publish(shm_ptr, pentametric, config.device_count);
+			sprintf(message_buffer, "Publishing snapshots to shared memory %s", config.shm_name);
 		}
+		if(config.write_log)
+			writelog_level(shm_ptr == NULL ? LOG_LEVEL_ERROR : LOG_LEVEL_INFO, config.log_file_name, argv[0], message_buffer);
 	}
-	while(!feof(ttyfile));
 
-	fclose(ttyfile);
+	if(config.write_log)
+	{
+		sprintf(message_buffer, "Started Pentametric data logging main loop for %d device(s). Polling at %g sec intervals", config.device_count, poll_period_ms(&config) / 1000.0);
+		writelog(config.log_file_name, argv[0], message_buffer);
+	}
+
+	error_code = run_event_loop(&config, pentametric, config.device_count, ring_ptr, archive_ptr, server, http, shm_ptr, argv[0]);
+
+	if(shm_ptr != NULL)
+		shm_close_segment(shm_ptr);
+	if(http != NULL)
+	{
+		http_close(http);
+		free(http);
+	}
+	if(server != NULL)
+	{
+		server_close(server);
+		free(server);
+	}
+	if(archive_ptr != NULL)
+		archive_close(archive_ptr);
+	trace_stop();
+	if(ring_ptr != NULL)
+		ring_close(ring_ptr);
+	free (pentametric);
 	free (message_buffer);
+	logger_stop();
 
-	return 0;
+	return error_code;
 }
 
 /*
 function bodies
 */
 
-boolean pentametric_short_read(FILE *stream, uint8_t a, uint8_t n, uint8_t *msg)
+// send a short read command and collect the n data bytes it returns
+boolean pentametric_short_read(struct serial_port_t *port, uint8_t a, uint8_t n, uint8_t *msg)
 {
-	uint8_t cs, i;
+	struct pm_request_t request;
+	struct pipeline_t pl;
 
 #ifdef DEBUG
 	fprintf(stderr,"short_read command = 0x%hx\n", a);
 	fprintf(stderr,"short_read byte count = 0x%hx\n", n);
 #endif
 
-	fputc(PENTAMETRIC_SHORT_READ_COMMAND, stream);
-	fputc(a, stream);
-	fputc(n, stream);
-
-	cs = PENTAMETRIC_SHORT_READ_COMMAND + a + n;
-
-#ifdef DEBUG
-	fprintf(stderr,"short_read command checksum = 0x%hx\n", (uint8_t)(cs + ~cs)); // should be 0xff
-#endif
-
-	fputc(~cs, stream); // remainder needed to add up to PENTAMETRIC_CHECKSUM
-	cs = 0;
-
-	for(i=0;i<n;i++)
-	{
-		msg[i] = fgetc(stream);
-#ifdef DEBUG
-		fprintf(stderr, "short_read data byte %d = 0x%hx\n", i, msg[i]);
-#endif
-		cs += (uint8_t)msg[i];
-	}
-
-	cs += (uint8_t)fgetc(stream); // get packet cheksum
+	request.command = PENTAMETRIC_SHORT_READ_COMMAND;
+	request.address = a;
+	request.length = n;
+	request.msg = msg;
 
-#ifdef DEBUG
-	fprintf(stderr,"short_read data checksum = 0x%hx\n", cs);
-	if (cs != PENTAMETRIC_CHECKSUM)
-		fprintf(stderr, "short_read chacksum error for command 0x%x\n", a);
-#endif
-
-	return (cs == PENTAMETRIC_CHECKSUM);
+	pipeline_start(&pl, port, &request, 1, 1);
+	return (pipeline_run(&pl) == 1);
 }
 
-boolean pentametric_short_write(FILE *stream, uint8_t a, uint8_t n, uint8_t *msg)
+// send a short write command, the pentametric answers with the checksum of what it received
+boolean pentametric_short_write(struct serial_port_t *port, uint8_t a, uint8_t n, uint8_t *msg)
 {
-	uint8_t cs, pm_cs, i;
-
-	fputc(PENTAMETRIC_SHORT_WRITE_COMMAND, stream);
-	fputc(a, stream);
-	fputc(n, stream);
-	cs = PENTAMETRIC_SHORT_WRITE_COMMAND + a + n;
+	struct pm_request_t request;
+	struct pipeline_t pl;
 
-	for(i=0;i<n;i++)
-	{
-		fputc(msg[i], stream);
-		cs += (uint8_t)msg[i];
-#ifdef DEBUG
-		fprintf(stderr, "short_write byte: 0x%hx\n", msg[i]);
-#endif
-	}
+	request.command = PENTAMETRIC_SHORT_WRITE_COMMAND;
+	request.address = a;
+	request.length = n;
+	request.msg = msg;
 
-	fputc(~(cs & PENTAMETRIC_CHECKSUM), stream); // loworder byte remainder needed to add up to PENTAMETRIC_CHECKSUM
-#ifdef DEBUG
-	fprintf(stderr, "short_write data checksum = 0x%x\n", (~(cs & PENTAMETRIC_CHECKSUM)) & PENTAMETRIC_CHECKSUM);
-#endif
-	pm_cs = (uint8_t)fgetc(stream);
-#ifdef DEBUG
-	fprintf(stderr, "short_write pentametric checksum: 0x%x\n", pm_cs);
-#endif
-	return(((~(uint8_t)(cs & PENTAMETRIC_CHECKSUM)) & PENTAMETRIC_CHECKSUM) == pm_cs);
-}
-
-int32_t get_format1_value(FILE *stream, uint8_t pentametric_address)
-{
-	uint8_t msg[2];
-	if(pentametric_short_read(stream, pentametric_address, sizeof(msg), msg))
-		return decode_format1(msg);
-	else
-		return -SHRT_MAX;
+	pipeline_start(&pl, port, &request, 1, 1);
+	return (pipeline_run(&pl) == 1);
 }
 
-int32_t get_format2_value(FILE *stream, uint8_t pentametric_address)
+// pack the 3 byte 1 bit bitmasks of a shunt select read into 1 byte 3 bit bitmask for all three shunts
+uint8_t decode_shunt_select(uint8_t *msg)
 {
-	uint8_t msg[3];
-	if(pentametric_short_read(stream, pentametric_address, sizeof(msg), msg))
-		return decode_format2(msg);
-	else
-		return -SHRT_MAX;
-}
+	uint8_t tmp8u = 0;
 
-int32_t get_format2b_value(FILE *stream, uint8_t pentametric_address)
-{
-	uint8_t msg[3];
-	if(pentametric_short_read(stream, pentametric_address, sizeof(msg), msg))
-		return decode_format2b(msg);
-	else
-		return -SHRT_MAX;
-}
+	if(msg[0] & 0x10) // is shunt 1 500 Amp?
+		tmp8u = SHUNT1_500A;
 
-int32_t get_format3_value(FILE *stream, uint8_t pentametric_address)
-{
-	uint8_t msg[3];
-	if(pentametric_short_read(stream, pentametric_address, sizeof(msg), msg))
-		return decode_format3(msg);
-	else
-		return -SHRT_MAX;
-}
+	if(msg[1] & 0x10) // is shunt 2 500 Amp?
+		tmp8u |= SHUNT2_500A;
 
-int32_t get_format3b_value(FILE *stream, uint8_t pentametric_address)
-{
-	uint8_t msg[3];
-	if(pentametric_short_read(stream, pentametric_address, sizeof(msg), msg))
-		return decode_format3b(msg);
-	else
-		return -SHRT_MAX;
-}
+	if(msg[2] & 0x10) // is shunt 3 500 Amp?
+		tmp8u |= SHUNT3_500A;
 
-int32_t get_format4_value(FILE *stream, uint8_t pentametric_address)
-{
-	uint8_t msg[4];
-	if(pentametric_short_read(stream, pentametric_address, sizeof(msg), msg))
-		return decode_format4(msg);
-	else
-		return -SHRT_MAX;
+	return tmp8u;
 }
 
-int32_t get_format5_value(FILE *stream, uint8_t pentametric_address)
+// read pentametric shunt configuration
+uint8_t get_shunt_select(struct serial_port_t *port)
 {
 	uint8_t msg[4];
-	if(pentametric_short_read(stream, pentametric_address, sizeof(msg), msg))
-		return decode_format5(msg);
-	else
-		return -SHRT_MAX;
-}
-
-int32_t get_format6_value(FILE *stream, uint8_t pentametric_address)
-{
-	uint8_t msg[1];
-	if(pentametric_short_read(stream, pentametric_address, sizeof(msg), msg))
-		return decode_format6(msg);
-	else
-		return -SHRT_MAX;
-}
+	uint8_t tmp8u = 0;
 
-int32_t get_format7_value(FILE *stream, uint8_t pentametric_address)
-{
-	uint8_t msg[2];
-	if(pentametric_short_read(stream, pentametric_address, sizeof(msg), msg))
-		return decode_format7(msg);
+	if(pentametric_short_read(port, PENTAMETRIC_ADDRESS_SHUNT_SELECT, sizeof(msg), msg))
+		tmp8u = decode_shunt_select(msg);
 	else
-		return -SHRT_MAX;
-}
+		tmp8u = 0x80; // set high bit if read failed
 
-int32_t get_format8_value(FILE *stream, uint8_t pentametric_address)
-{
-	uint8_t msg[1];
-	if(pentametric_short_read(stream, pentametric_address, sizeof(msg), msg))
-		return decode_format8(msg);
-	else
-		return -SHRT_MAX;
+	return tmp8u;
 }
 
-// read pentametric shunt configuration
-uint8_t get_shunt_select(FILE *stream)
+// pack the 3 byte 4 bit bitmasks of a shunt labels read into 1 byte 3 bit bitmask for all three shunts
+uint8_t decode_shunt_labels(uint8_t *msg)
 {
-	uint8_t msg[4];
 	uint8_t tmp8u = 0;
 
-	if(pentametric_short_read(stream, PENTAMETRIC_ADDRESS_SHUNT_SELECT, sizeof(msg), msg))
-	{
-		// pack 3 byte 1 bit bitmasks into 1 byte 3 bit bitmask for all three shunts
-		if(msg[0] & 0x10) // is shunt 1 500 Amp?
-			tmp8u = SHUNT1_500A;
+#ifdef DEBUG
+	fprintf(stderr, "Shunt Labels raw value, byte 0: 0x%hx byte 1: 0x%hx byte 2: 0x%hx\n", msg[0], msg[1], msg[2]);
+#endif
+	if(((msg[0] & 0x05) == 0x05) || ((msg[0] & 0x06) == 0x06)) // amps1 shunt is for battery or battery1?
+		tmp8u = SHUNT1_BATTERY;
 
-		if(msg[1] & 0x10) // is shunt 2 500 Amp?
-			tmp8u |= SHUNT2_500A;
+	if(((msg[1] & 0x05) == 0x05) || ((msg[1] & 0x06) == 0x06)) // amps2 shunt is for battery or battery1?
+		tmp8u |= SHUNT2_BATTERY;
 
-		if(msg[2] & 0x10) // is shunt 3 500 Amp?
-			tmp8u |= SHUNT3_500A;
-	}
-	else
-		tmp8u = 0x80; // set high bit if read failed
+	if(((msg[2] & 0x05) == 0x05) || ((msg[2] & 0x06) == 0x06)) // amps3 shunt is for battery or battery1?
+		tmp8u |= SHUNT3_BATTERY;
 
 	return tmp8u;
 }
 
 // read pentametric shunt labels
-uint8_t get_shunt_labels(FILE *stream)
+uint8_t get_shunt_labels(struct serial_port_t *port)
 {
 	uint8_t msg[3]; // 3 bytes
 	uint8_t tmp8u = 0;
 
-	if(pentametric_short_read(stream, PENTAMETRIC_ADDRESS_SHUNT_LABELS, sizeof(msg), msg))
-	{
-#ifdef DEBUG
-		fprintf(stderr, "Shunt Labels raw value, byte 0: 0x%hx byte 1: 0x%hx byte 2: 0x%hx\n", msg[0], msg[1], msg[2]);
-#endif
-		// pack 3 byte 4 bit bitmasks into 1 byte 3 bit bitmask for all three shunts
-		if(((msg[0] & 0x05) == 0x05) || ((msg[0] & 0x06) == 0x06)) // amps1 shunt is for battery or battery1?
-			tmp8u = SHUNT1_BATTERY;
-
-		if(((msg[1] & 0x05) == 0x05) || ((msg[1] & 0x06) == 0x06)) // amps2 shunt is for battery or battery1?
-			tmp8u |= SHUNT2_BATTERY;
-
-		if(((msg[2] & 0x05) == 0x05) || ((msg[2] & 0x06) == 0x06)) // amps3 shunt is for battery or battery1?
-			tmp8u |= SHUNT3_BATTERY;
-	}
+	if(pentametric_short_read(port, PENTAMETRIC_ADDRESS_SHUNT_LABELS, sizeof(msg), msg))
+		tmp8u = decode_shunt_labels(msg);
 	else
 		tmp8u = 0x80; // set high bit if read failed
 #ifdef DEBUG
@@ -677,41 +515,60 @@ uint8_t get_shunt_labels(FILE *stream)
 	return tmp8u;
 }
 
-// reset pentametric amp hours for non-battery shunts
-boolean reset_amp_hours(FILE *stream, uint8_t shunt_labels)
+/*
+	queue the short writes that reset the amp hours (and watt hours) of
+	every non-battery shunt into request[], their data bytes go in msg[].
+	Both need room for AMP_HOUR_RESET_WRITES. Nothing is reset while the
+	shunt labels are unknown.
+
+	returns the number of requests queued
+*/
+uint8_t build_amp_hour_reset(struct pm_request_t *request, uint8_t *msg, uint8_t shunt_labels)
 {
-	boolean return_value = false;
-	uint8_t msg[1];
+	static const uint8_t clear[AMP_HOUR_RESET_WRITES] = {PENTAMETRIC_CLEAR_AMP_HOURS_1, PENTAMETRIC_CLEAR_WATT_HOURS1,
+		PENTAMETRIC_CLEAR_AMP_HOURS_2, PENTAMETRIC_CLEAR_WATT_HOURS2, PENTAMETRIC_CLEAR_AMP_HOURS_3}; // shunt3 has no watt hours
+	static const uint8_t shunt[AMP_HOUR_RESET_WRITES] = {SHUNT1_BATTERY, SHUNT1_BATTERY, SHUNT2_BATTERY, SHUNT2_BATTERY, SHUNT3_BATTERY};
+	uint8_t i, count = 0;
 
-	if(!(shunt_labels & SHUNT1_BATTERY)) // reset shunt1 amps and watt hrs
-	{
-		msg[0] = PENTAMETRIC_CLEAR_AMP_HOURS_1;
-		return_value = pentametric_short_write(stream, PENTAMETRIC_ADDRESS_RESET, sizeof(msg), msg);
-		msg[0] = PENTAMETRIC_CLEAR_WATT_HOURS1;
-		return_value |= pentametric_short_write(stream, PENTAMETRIC_ADDRESS_RESET, sizeof(msg), msg);
-	}
-	if(!(shunt_labels & SHUNT2_BATTERY)) // reset shunt2 amps and watt hrs
-	{
-		msg[0] = PENTAMETRIC_CLEAR_AMP_HOURS_2;
-		return_value = pentametric_short_write(stream, PENTAMETRIC_ADDRESS_RESET, sizeof(msg), msg);
-		msg[0] = PENTAMETRIC_CLEAR_WATT_HOURS2;
-		return_value |= pentametric_short_write(stream, PENTAMETRIC_ADDRESS_RESET, sizeof(msg), msg);
-	}
-	if(!(shunt_labels & SHUNT3_BATTERY)) // reset shunt3 amps hrs
+	if(shunt_labels & 0x80) // labels read failed
+		return 0;
+
+	for(i = 0; i < AMP_HOUR_RESET_WRITES; i++)
 	{
-		msg[0] = PENTAMETRIC_CLEAR_AMP_HOURS_3;
-		return_value |= pentametric_short_write(stream, PENTAMETRIC_ADDRESS_RESET, sizeof(msg), msg);
+		if(shunt_labels & shunt[i])
+			continue;
+		msg[count] = clear[i];
+		request[count].command = PENTAMETRIC_SHORT_WRITE_COMMAND;
+		request[count].address = PENTAMETRIC_ADDRESS_RESET;
+		request[count].length = 1;
+		request[count].msg = &msg[count];
+		count++;
 	}
-	return return_value;
+	return count;
+}
+
+// reset pentametric amp hours for non-battery shunts, the writes go out as one batch
+boolean reset_amp_hours(struct serial_port_t *port, uint8_t shunt_labels)
+{
+	struct pm_request_t request[AMP_HOUR_RESET_WRITES];
+	uint8_t msg[AMP_HOUR_RESET_WRITES];
+	struct pipeline_t pl;
+	uint8_t count;
+
+	if((count = build_amp_hour_reset(request, msg, shunt_labels)) == 0)
+		return false;
+
+	pipeline_start(&pl, port, request, count, port->pipeline_depth);
+	return (pipeline_run(&pl) == count);
 }
 
 // read pentametric firmware version
-uint8_t get_firmware_version(FILE *stream)
+uint8_t get_firmware_version(struct serial_port_t *port)
 {
 	uint8_t msg[1];
 	uint8_t tmp8u = 0;
 
-	if(pentametric_short_read(stream, PENTAMETRIC_ADDRESS_FIRMWARE_VERSION, sizeof(msg), msg))
+	if(pentametric_short_read(port, PENTAMETRIC_ADDRESS_FIRMWARE_VERSION, sizeof(msg), msg))
 	{
 		tmp8u = msg[0];
 	}
@@ -871,7 +728,7 @@ int32_t decode_format7(uint8_t *msg)
 }
 
 // decode Temp in deg C
-int16_t decode_format8(uint8_t *msg)
+int32_t decode_format8(uint8_t *msg)
 {
 
 #ifdef DEBUG
@@ -884,7 +741,7 @@ int16_t decode_format8(uint8_t *msg)
 
 
 // set serial port to communicate with pentametric
-int set_tty_port(FILE *ttyfile, char *device, char* myname, char *log_file_name, boolean writetolog)
+int set_tty_port(int fd, char *device, char* myname, char *log_file_name, boolean writetolog)
 {
 	struct termios config;
 	char *message_buffer;
@@ -896,12 +753,12 @@ int set_tty_port(FILE *ttyfile, char *device, char* myname, char *log_file_name,
 		return -1;
 	}
 
-	if (tcgetattr(fileno(ttyfile), &config) < 0)
+	if (tcgetattr(fd, &config) < 0)
 	{
 		if(writetolog)
 		{
 			sprintf(message_buffer,"could not get termios attributes for %s", device);
-			writelog(log_file_name, myname, message_buffer);
+			writelog_level(LOG_LEVEL_ERROR, log_file_name, myname, message_buffer);
 		}
 		return -2;
 	}
@@ -914,16 +771,16 @@ int set_tty_port(FILE *ttyfile, char *device, char* myname, char *log_file_name,
 	cfmakeraw(&config);
 	cfsetispeed(&config,B2400);
 	cfsetospeed(&config,B2400);
-	config.c_cc[VMIN] = 1;
+	config.c_cc[VMIN] = 1; // with O_NONBLOCK an empty read gives EAGAIN, a read of 0 means hangup
 	config.c_cc[VTIME] = 0;
 
 
-	if(tcsetattr(fileno(ttyfile), TCSANOW, &config) < 0)
+	if(tcsetattr(fd, TCSANOW, &config) < 0)
 	{
 		if(writetolog)
 		{
 			sprintf(message_buffer, "could not set termios attributes for %s", device);
-			writelog(log_file_name, myname, message_buffer);
+			writelog_level(LOG_LEVEL_ERROR, log_file_name, myname, message_buffer);
 		}
 		return -3;
 	}
@@ -950,35 +807,22 @@ uint32_t get_seconds_since_midnight (void)
 	return localtm->tm_sec + localtm->tm_min * 60 + localtm->tm_hour * 3600;
 }
 
-// wrire formatted messages to a log file named in logfilename
-void writelog (char *logfilename, char *process_name, char *message)
-{
-	char timestamp[25];
-	time_t t;
-	struct tm *localtm;
-	FILE *stream;
-
-	t = time(NULL);
-	localtm = localtime(&t);
-
-	strftime(timestamp, sizeof(timestamp), "%d.%m.%Y %T", localtm);
-
-	stream = fopen(logfilename, "a");
-	fprintf(stream, "%s (%s): %s.\n", process_name, timestamp, message);
-	fprintf(stderr, "%s (%s): %s.\n", process_name, timestamp, message);
-	fclose(stream);
-}
-
 void display_usage(char *myname)
 {
 	fprintf(stderr, "mhpmpi Version %s - Meteohub Plug-In for Bogart Engineering Pentametric PM-100-C RS-232 computer interface.\n", VERSION);
-	fprintf(stderr, "Usage: %s -d tty_device [-C] [-L] [-R] [-s sensor_mask] [-t sleep_time]\n", myname);
+	fprintf(stderr, "Usage: %s -d tty_device [-B] [-C] [-L] [-R] [-s sensor_mask] [-t sleep_time]\n", myname);
+	fprintf(stderr, "       %s -P trace_file [-W]\n", myname);
 	fprintf(stderr, "  -d tty_device  /dev/tty[x] device name where USB to Serial adapeter is connected.\n");
+	fprintf(stderr, "                 Repeat to poll more than one Pentametric.\n");
+	fprintf(stderr, "  -B             Read each sensor with its own short read instead of block reads.\n");
 	fprintf(stderr, "  -C             Close/reopen tty device between polls.\n");
 	fprintf(stderr, "  -L             Write messages to log file.\n");
+	fprintf(stderr, "  -P trace_file  Play back serial traffic captured with TRACE_FILE and print the values\n");
+	fprintf(stderr, "                 decoded from it, as fast as possible.\n");
 	fprintf(stderr, "  -R             Reset Amp Hours at midnight for Shunts labeled as non-Battery.\n");
 	fprintf(stderr, "  -s sensor_mask Bitmask value in hex (0x00) or decimal format to identify\n");
 	fprintf(stderr, "                 which Pentametric data values to log as Meteohub sensors.\n");
 	fprintf(stderr, "  -t sleep_time  Number of seconds to sleep between polling the Pentametric.\n");
+	fprintf(stderr, "  -W             With -P, play back at the pace the traffic was captured.\n");
 	exit(EXIT_FAILURE);
 }
@@ -27,6 +27,31 @@
 
 #define PENTAMETRIC_CHECKSUM 0xff
 
+// read planner limits
+#define PENTAMETRIC_MAX_DATA_ADDRESS 0x1f // highest data value address
+#define PENTAMETRIC_SENSOR_COUNT 26 // number of bits used in the sensor bitmask
+#define PENTAMETRIC_MAX_SPAN_BYTES 32 // most data bytes asked for in one short read
+#define PENTAMETRIC_READ_OVERHEAD_BYTES 5 // bytes on the wire for each short read besides the data (4 command + 1 checksum)
+#define PENTAMETRIC_MAX_IMAGE_BYTES 128 // room for every data register
+
+// multiple pentametrics polled from one process
+#define PENTAMETRIC_MAX_DEVICES 8
+
+// serial transport timing
+#define SERIAL_BYTE_USEC 4167 // one byte (start + 8 data + stop bits) at 2400 baud
+#define SERIAL_QUIET_MS 20 // line must be idle this long before a resync is complete
+
+// pipelined command engine
+#define PIPELINE_MAX_DEPTH 8 // most commands in flight at once
+#define PENTAMETRIC_PIPELINE_MIN_FIRMWARE 16 // oldest firmware version (x10) trusted with more than one command in flight
+#define PENTAMETRIC_VERIFY_READS 3 // firmware version, shunt select and shunt labels
+#define PENTAMETRIC_VERIFY_TRIES 3 // attempts to read back cached metadata before it is kept unchecked
+
+// protocol statistics
+#define STATS_LATENCY_BUCKETS 16 // bucket 0 is under 1ms, bucket n from 2^(n-1) up to 2^n ms, the last one open ended
+#define STATS_ADDRESS_SLOTS (PENTAMETRIC_MAX_DATA_ADDRESS + 2) // one per data address, the last for config and reset addresses
+#define STATS_TEXT_BYTES SNAPSHOT_MAX_BYTES
+
 // pentametric data value addresses
 #define PENTAMETRIC_ADDRESS_BATTERY1_VOLTS 0x01
 #define PENTAMETRIC_ADDRESS_BATTERY2_VOLTS 0x02
@@ -69,6 +94,7 @@
 #define PENTAMETRIC_CLEAR_WATT_HOURS1 0x11
 #define PENTAMETRIC_CLEAR_WATT_HOURS2 0x12
 #define PENTAMETRIC_CLEAR_WATT_HOURS 0x13
+#define AMP_HOUR_RESET_WRITES 5 // amp and watt hours of shunts 1 and 2, amp hours of shunt 3
 
 #define SHUNT1_500A 0x01
 #define SHUNT2_500A 0x02
@@ -106,6 +132,98 @@
 #define	PENTAMETRIC_DAYS_SINCE_BATTERY2_EQUALIZED	0x1000000
 #define	PENTAMETRIC_TEMPERATURE						0x2000000
 
+// sensors that change fast enough to be worth sampling between polls
+#define PENTAMETRIC_FAST_SENSORS	(PENTAMETRIC_BATTERY1_VOLTS | PENTAMETRIC_BATTERY2_VOLTS | \
+									PENTAMETRIC_AMPS1 | PENTAMETRIC_AMPS2 | PENTAMETRIC_AMPS3 | \
+									PENTAMETRIC_WATTS1 | PENTAMETRIC_WATTS2)
+#define SAMPLE_STAT_COUNT 4 // min, max, mean and stddev dataN lines per sampled sensor
+
+// timed jobs of the event loop
+#define JOB_POLL 0 // poll every device
+#define JOB_AMP_HOUR_RESET 1 // reset non-battery amp hours, after the midnight poll
+#define JOB_METADATA_REFRESH 2 // read back every device's firmware version and shunt configuration
+#define JOB_COUNT 3
+
+// what a busy device's read in flight is for
+#define DEVICE_TASK_POLL 0
+#define DEVICE_TASK_SAMPLE 1
+#define DEVICE_TASK_VERIFY 2 // reading back firmware version and shunt configuration
+#define DEVICE_TASK_RESET 3 // writing the amp hour reset
+
+// host side battery analytics
+#define ANALYTICS_COUNT 7 // dataN lines per device, see analytics_values()
+#define ANALYTICS_MAX_GAP_PERIODS 3 // readings further apart than this many poll intervals aren't integrated across
+#define ANALYTICS_MAX_HOURS 9999 // time to empty or full is written as this when it is longer
+
+// ring file of recent values
+#define RING_MAGIC 0x42524d50 // "PMRB"
+#define RING_VERSION 1
+#define RING_SAMPLE 0x80 // ring record sensor flag, value came from a sample read rather than a poll
+
+// long term archive
+#define ARCHIVE_MAGIC 0x42414d50 // "PMAB"
+#define ARCHIVE_BLOCK_BYTES 4096 // archive file is a sequence of blocks of this size
+#define ARCHIVE_MAX_RECORD_BYTES 20 // two 10 byte varints
+#define ARCHIVE_MAX_BLOCK_VALUES ((ARCHIVE_BLOCK_BYTES - sizeof(struct archive_block_header_t)) / 2 + 1) // every value after the first takes at least 2 bytes
+
+// socket server for local readers
+#define SNAPSHOT_MAX_BYTES (SINK_MAX_POINTS * OUTPUT_MAX_LINE_BYTES) // one poll cycle of every device as text, with every line as long as it gets
+#define SERVER_MAX_CLIENTS 16
+#define SERVER_COMMAND_BYTES 64 // longest command line a client may send
+#define SERVER_COMMAND_TIMEOUT_MS 5000 // a client that hasn't sent its command by then is dropped
+
+// prometheus scrape endpoint
+#define HTTP_MAX_CLIENTS 8
+#define HTTP_REQUEST_BYTES 1024 // longest request header a scraper may send
+#define HTTP_CLIENT_TIMEOUT_MS 5000 // a connection still open this long after it was accepted is dropped
+#define HTTP_MAX_BODY_BYTES 32768 // metrics text of every device
+
+// shared memory snapshot
+#define SHM_MAGIC 0x534d4d50 // "PMMS"
+#define SHM_VERSION 1
+
+// log levels, LOG_LEVEL in mhpmpi.conf logs everything up to and including its level
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARNING 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+
+// background log writer
+#define LOG_QUEUE_ENTRIES 256 // messages waiting for the writer thread
+#define LOG_MESSAGE_BYTES 256 // longest message kept, longer ones are cut off
+#define LOG_BATCH_BYTES 16384 // most bytes written to the log with one write()
+
+// meteohub output
+#define OUTPUT_MAX_LINE_NUMBERS 24 // room for the sensor number, the value and the separators of one line
+#define OUTPUT_MAX_LINE_BYTES (4 + OUTPUT_MAX_LINE_NUMBERS) // "data" and the numbers
+#define OUTPUT_QUEUE_MIN_BYTES SNAPSHOT_MAX_BYTES // the memory queue always holds a whole poll cycle
+
+// meteohub output kinds
+#define SENSOR_KIND_DATA 0 // dataN lines
+#define SENSOR_KIND_TEMP 1 // tN lines
+#define SENSOR_KIND_COUNT 2
+
+// output sinks, each poll cycle is decoded once and every sink renders it its own way
+#define SINK_METEOHUB 0 // dataN/tN lines on stdout
+#define SINK_CSV 1 // a row per value
+#define SINK_JSON 2 // a JSON object per device per cycle
+#define SINK_BINARY 3 // a struct sink_record_t per value
+#define SINK_COUNT 4
+#define SINK_TEXT_BYTES 65536 // one poll cycle rendered by any sink
+#define SINK_MAX_POINTS (PENTAMETRIC_MAX_DEVICES * (PENTAMETRIC_SENSOR_COUNT * (1 + SAMPLE_STAT_COUNT) + ANALYTICS_COUNT))
+#define SINK_RECORD_FAILED 0x80 // binary record kind flag, the value couldn't be read
+
+// raw serial traffic capture, record kinds in the high nibble of each record's tag
+#define TRACE_MAGIC 0x52544d50 // "PMTR"
+#define TRACE_VERSION 1
+#define TRACE_BUFFER_BYTES 65536 // records collected before they are written out
+#define TRACE_TX 0 // bytes written to the port
+#define TRACE_RX 1 // bytes read from the port
+#define TRACE_OPEN 2 // port (re)opened, payload is the device path
+#define TRACE_RESYNC 3 // port flushed after a timeout or bad checksum
+#define TRACE_SHUNTS 4 // shunt select the device's decoders are picked with
+#define TRACE_START 5 // a run of mhpmpi starts, payload is its unix time in us
+
 /*
 	constants
 */
@@ -114,6 +232,7 @@
 	typedefs
 */
 typedef unsigned char boolean;
+typedef int32_t (*decode_fn)(uint8_t *msg); // decode_format*() raw bytes to meteohub units
 
 /*
 	structs
@@ -131,35 +250,546 @@ struct args_t
 struct config_t
 {
 	boolean close_tty_file;
-	char device[FILENAME_MAX];
+	char device[PENTAMETRIC_MAX_DEVICES][FILENAME_MAX];
+	uint8_t device_count;
+	uint16_t device_id_stride;	// dataN numbers for device k start at k * device_id_stride
 	boolean write_log;
 	char log_file_name[FILENAME_MAX];
 	boolean reset_amp_hrs;
 	uint32_t sensor_mask;
 	uint16_t sleep_seconds;
+	uint32_t sleep_ms;		// poll period in ms, 0 = sleep_seconds
+	boolean block_reads;
+	uint16_t serial_timeout_ms;
+	uint8_t serial_retries;
+	uint8_t pipeline_depth;
+	uint32_t sample_mask;		// fast sensors read continuously between polls, 0 = off
+	uint16_t sample_id_base;	// first dataN number of the sample aggregates
+	char ring_file_name[FILENAME_MAX];	// memory mapped ring of recent values, empty = off
+	uint32_t ring_records;		// values the ring holds before it wraps
+	char archive_file_name[FILENAME_MAX];	// long term archive, empty = off
+	boolean archive_samples;	// archive sample reads too, not just polls
+	char socket_path[FILENAME_MAX];	// unix socket serving the latest cycle, empty = off
+	char shm_name[NAME_MAX];	// POSIX shared memory snapshot, empty = off
+	char http_address[64];	// address the prometheus endpoint listens on
+	uint16_t http_port;		// prometheus endpoint port, 0 = off
+	uint8_t log_level;			// LOG_LEVEL_*
+	uint32_t log_rotate_bytes;	// rotate the log when it would grow past this, 0 = never
+	uint32_t log_rotate_seconds;	// rotate the log when it gets this old, 0 = never
+	uint8_t log_rotate_keep;	// rotated logs kept as name.1 .. name.n
+	uint32_t sensor_period[PENTAMETRIC_SENSOR_COUNT];	// seconds between reads of each sensor bitmask bit, 0 = every poll
+	int32_t deadband[PENTAMETRIC_SENSOR_COUNT];	// change needed before a sensor is written again, meteohub units, -1 = every poll
+	boolean deadband_relative[PENTAMETRIC_SENSOR_COUNT];	// deadband is in 1/100 % of the last value written
+	boolean report_by_exception;	// any sensor has a deadband
+	uint32_t heartbeat_seconds;	// longest a deadbanded sensor goes unwritten
+	char config_path[FILENAME_MAX];	// .conf file that was read, empty = none
+	boolean watch_config;	// reload when the .conf file changes, SIGHUP always reloads
+	boolean analytics;		// write host side battery analytics
+	uint16_t analytics_id_base;	// first dataN number of the analytics
+	uint32_t battery_capacity_ah;	// for state of charge, 0 = unknown
+	char metadata_file_name[FILENAME_MAX];	// firmware version and shunt configuration of each device from earlier runs, empty = off
+	uint32_t metadata_refresh_seconds;	// read back every device's firmware version and shunt configuration this often, 0 = never
+	uint32_t output_queue_bytes;	// meteohub output held in memory while stdout is full
+	char output_spill_file[FILENAME_MAX];	// meteohub output that doesn't fit in memory, empty = dropped
+	uint32_t output_spill_max_bytes;	// most the spill file grows to
+	char csv_file[FILENAME_MAX];	// CSV sink, empty = off
+	char json_fifo[FILENAME_MAX];	// JSON lines sink, empty = off
+	char json_spill_file[FILENAME_MAX];	// JSON lines that don't fit in memory, empty = dropped
+	char binary_file[FILENAME_MAX];	// fixed record sink, empty = off
+	char binary_spill_file[FILENAME_MAX];	// records that don't fit in memory, empty = dropped
+	uint32_t sink_queue_bytes;	// memory queue of each sink other than meteohub
+	char trace_file_name[FILENAME_MAX];	// raw serial traffic capture, empty = off
+	char replay_file_name[FILENAME_MAX];	// -P value, play this capture back instead of polling
+	boolean replay_realtime;	// -W switch, play back at the pace of the capture
+};
+
+// registry entry describing one loggable pentametric value
+struct sensor_t
+{
+	uint32_t mask;			// PENTAMETRIC_* sensor bitmask bit
+	uint8_t address;		// PENTAMETRIC_ADDRESS_* register
+	uint8_t length;			// data bytes
+	uint8_t shunt;			// SHUNTn_500A bit that selects decode_500a, 0 = not shunt dependent
+	decode_fn decode;		// decoder for a 100A shunt, or the only decoder
+	decode_fn decode_500a;	// decoder for a 500A shunt
+	uint8_t kind;			// SENSOR_KIND_*
+	const char *name;
+};
+
+// next time a poll item is due
+struct schedule_entry_t
+{
+	uint64_t due_ms;		// monotonic ms
+	uint8_t item;			// index in the poll plan
+};
+
+// min-heap of when each item of a poll plan is next due
+struct schedule_t
+{
+	uint8_t count;
+	struct schedule_entry_t heap[PENTAMETRIC_SENSOR_COUNT];
+	uint64_t period_ms[PENTAMETRIC_SENSOR_COUNT];	// by poll plan item, 0 = every poll
+	uint8_t taken;			// items off the heap for the poll in progress
+	struct schedule_entry_t taken_entry[PENTAMETRIC_SENSOR_COUNT];
+	uint32_t due_mask;		// sensors the due plan was built for
+};
+
+// one sensor as compiled for the poll loop
+struct poll_item_t
+{
+	const struct sensor_t *sensor;
+	uint8_t bit;			// sensor bitmask bit number
+	uint8_t address;
+	decode_fn decode;
+	uint8_t kind;
+	uint32_t id;			// meteohub sensor number for dataN or tN
+};
+
+// timed jobs of the event loop, see timer.c
+struct timer_queue_t
+{
+	int fd;					// timerfd on CLOCK_REALTIME, armed for the earliest job
+	uint64_t due_ms[JOB_COUNT];	// realtime ms each job is due, 0 = not scheduled
+	boolean started;		// midnight and index belong to the last poll scheduled
+	uint32_t period_ms;		// poll period
+	uint64_t midnight;		// realtime ms of the local midnight poll boundaries are counted from
+	uint64_t index;			// boundary number of the next poll since that midnight
+	uint64_t polls;			// poll jobs that came due
+	uint64_t overruns;		// boundaries passed while a poll cycle was still running
+	uint32_t clock_changes;	// times the realtime clock was set
+};
+
+// output waiting for a sink's file to take it, see output.c
+struct output_queue_t
+{
+	int fd;					// stdout or the sink's path, non-blocking
+	int fd_flags;			// file status flags fd had before, put back by output_queue_close()
+	boolean pollable;		// fd works with epoll, a regular file doesn't and is never full
+	uint32_t events;		// epoll events fd is registered for
+	boolean stalled;		// the last flush left bytes behind
+	boolean gone;			// the reader went away, nothing more is written
+	char *buf;				// oldest bytes, from head
+	uint32_t size;
+	uint32_t head;
+	uint32_t len;
+	int spill_fd;			// newer bytes that didn't fit in buf, -1 = no spill file
+	char spill_name[FILENAME_MAX];
+	uint32_t spill_max;		// most bytes the spill file holds
+	uint64_t spill_read;	// offset of the oldest spilled byte not yet moved to buf
+	uint64_t spill_write;	// end of the spilled bytes
+	uint64_t spilled;		// bytes that went through the spill file
+	uint32_t dropped;		// poll cycles there was no room for
+	uint32_t stalls;		// times the reader stopped taking bytes
+};
+
+// one value of a poll cycle as every sink gets it
+struct sink_point_t
+{
+	const char *name;		// sensor registry name, or analytics_name[]
+	const char *suffix;		// "", or the sample statistic, "_min" ...
+	uint32_t id;			// meteohub dataN/tN number
+	int32_t value;			// meteohub units, -SHRT_MAX when it couldn't be read
+	uint8_t device;			// index in the device list
+	uint8_t kind;			// SENSOR_KIND_*
+	boolean ok;				// value was read or worked out
+	boolean report;			// goes to meteohub this cycle, report by exception leaves unchanged values out
+};
+
+// a poll cycle of every device, decoded once for all the sinks
+struct sink_cycle_t
+{
+	struct timespec time;	// realtime the cycle finished
+	const char *device[PENTAMETRIC_MAX_DEVICES];	// device paths
+	uint16_t count;
+	struct sink_point_t point[SINK_MAX_POINTS];
+};
+
+// binary sink record, host byte order like the ring file
+struct sink_record_t
+{
+	uint32_t time;			// unix time of the cycle
+	uint16_t msec;
+	uint8_t device;			// index in the device list
+	uint8_t kind;			// SENSOR_KIND_*, | SINK_RECORD_FAILED
+	uint32_t id;			// meteohub dataN/tN number
+	int32_t value;			// meteohub units
+};
+
+// an output a poll cycle is published to, with its own queue so a slow one holds up nothing else
+struct sink_t
+{
+	uint8_t kind;			// SINK_*
+	char path[FILENAME_MAX];	// "stdout" for meteohub
+	boolean fifo;			// path is a FIFO, opened read-write so readers can come and go
+	struct output_queue_t queue;
+	uint32_t stall_dropped;	// queue.dropped when the reader last stopped reading
+};
+
+// log2 bucketed durations
+struct histogram_t
+{
+	uint32_t bucket[STATS_LATENCY_BUCKETS];
+	uint32_t count;
+	uint32_t max_us;
+	uint64_t sum_us;
+};
+
+// protocol counters of one register address
+struct address_stats_t
+{
+	uint32_t requests;		// command frames sent, retries included
+	uint32_t checksum_errors;
+	uint32_t timeouts;
+	uint32_t retries;
+	uint32_t failed;		// requests given up on after every retry
+	struct histogram_t latency;	// round trip of each good response
+};
+
+// raw tty connection to a pentametric and its error counters
+struct serial_port_t
+{
+	int fd;
+	uint8_t index;			// device list position, tags the port's records in the trace file
+	char device[FILENAME_MAX];
+	boolean hangup;			// device went away, reads and writes will never succeed
+	uint16_t timeout_ms;	// turnaround allowance on top of the wire time of each transaction
+	uint8_t retries;		// extra attempts after a timeout or checksum error
+	uint8_t pipeline_depth;	// commands sent ahead of their responses, 1 = no pipelining
+	uint32_t timeouts;
+	uint32_t checksum_errors;
+	uint32_t retried;
+	uint32_t resyncs;
+	struct address_stats_t stats[STATS_ADDRESS_SLOTS];	// see address_stats()
+};
+
+// one short read or short write command and its outcome
+struct pm_request_t
+{
+	uint8_t command;	// PENTAMETRIC_SHORT_READ_COMMAND or PENTAMETRIC_SHORT_WRITE_COMMAND
+	uint8_t address;
+	uint8_t length;		// data bytes to read or write
+	uint8_t *msg;		// data read goes here, data written comes from here
+	uint8_t checksum;	// checksum byte of the command frame
+	uint8_t attempts;
+	boolean ok;
+	uint64_t queued_us;	// when its command frame was queued for sending
+};
+
+// state of a run of requests through the pipelined command engine
+struct pipeline_t
+{
+	struct serial_port_t *port;
+	struct pm_request_t *request;
+	uint8_t count;
+	uint8_t depth;
+	uint8_t next_send;	// next request to encode into tx
+	uint8_t next_recv;	// oldest request still waiting for its response
+	uint8_t tx[PIPELINE_MAX_DEPTH * (UINT8_MAX + 5)];
+	uint16_t tx_len;
+	uint16_t tx_done;
+	uint8_t rx[UINT8_MAX + 1];
+	uint16_t rx_len;
+	uint64_t deadline;	// when the oldest response is overdue
+	uint64_t last_us;	// when the previous response finished, a pipelined response's round trip starts there
+};
+
+// one short read transaction covering one or more adjacent registers
+struct read_span_t
+{
+	uint8_t address;	// first register address in the span
+	uint8_t count;		// number of registers in the span
+	uint8_t length;		// total data bytes
+	uint8_t offset;		// start of the span's data in the plan image
+};
+
+// the short reads needed for a sensor bitmask and the data they returned
+struct read_plan_t
+{
+	uint8_t span_count;
+	struct read_span_t span[PENTAMETRIC_MAX_DATA_ADDRESS + 1];
+	uint8_t offset[PENTAMETRIC_MAX_DATA_ADDRESS + 1];	// image offset of each register
+	uint8_t span_of[PENTAMETRIC_MAX_DATA_ADDRESS + 1];	// span index of each register
+	boolean selected[PENTAMETRIC_MAX_DATA_ADDRESS + 1];	// register is wanted by the sensor mask
+	boolean valid[PENTAMETRIC_MAX_DATA_ADDRESS + 1];	// register data had a good checksum on the last read
+	uint8_t image[PENTAMETRIC_MAX_IMAGE_BYTES];
+	uint8_t good;			// selected registers read so far
+	boolean fallback;		// single register reads of failed spans are in progress
+	struct pm_request_t request[PENTAMETRIC_MAX_DATA_ADDRESS + 1];	// one per span
+	struct pm_request_t single[PENTAMETRIC_MAX_DATA_ADDRESS + 1];	// fallback reads
+};
+
+// everything the poll loop needs, compiled once from the sensor mask and shunt configuration
+struct poll_plan_t
+{
+	uint8_t count;
+	struct poll_item_t item[PENTAMETRIC_SENSOR_COUNT];
+	struct read_plan_t read;
+};
+
+// running aggregate of one sampled sensor over a poll interval
+struct sample_stat_t
+{
+	uint32_t count;
+	int32_t min;
+	int32_t max;
+	double mean;
+	double m2;				// sum of squared differences from the mean
+};
+
+// coulomb counter and energy totals of one pentametric's battery shunts, see analytics.c
+struct analytics_t
+{
+	boolean enabled;
+	uint32_t id_base;		// dataN number of the first analytics line
+	double capacity_ah;		// 0 = unknown, no state of charge
+	uint64_t max_gap_us;	// readings further apart than this aren't integrated across
+	boolean seed_from_device;	// battery1 percent full is polled, start charge_ah from it
+	boolean seeded;			// charge_ah has a starting point
+	double charge_ah;		// charge in the battery
+	boolean have_amps;		// last_amps is a reading to integrate from
+	double last_amps;		// battery current, positive while charging
+	uint64_t amps_us;		// monotonic time of last_amps
+	boolean have_watts;
+	double last_watts;
+	uint64_t watts_us;
+	int32_t day;			// local day the energy totals are for
+	double charged_wh;		// energy into the battery today
+	double discharged_wh;	// energy out of it today
+};
+
+// the last value of a deadbanded sensor written to meteohub
+struct report_state_t
+{
+	boolean reported;		// anything written yet
+	int32_t value;
+	uint64_t time_ms;		// monotonic ms it was written
+};
+
+// one pentametric unit and everything needed to poll it
+struct pentametric_t
+{
+	uint8_t index;			// position in the device list, sets its meteohub sensor number range
+	struct serial_port_t port;
+	uint8_t firmware_version;
+	uint8_t shunt_select;
+	uint8_t shunt_labels;
+	struct poll_plan_t poll;	// its read plan image caches the latest good value of every sensor
+	struct report_state_t report_state[PENTAMETRIC_SENSOR_COUNT];	// by poll item, for sensors with a deadband
+	struct schedule_t schedule;	// when each poll item is next due
+	struct read_plan_t due;		// registers of the items due this poll
+	struct poll_plan_t sample;	// fast registers read over and over between polls
+	struct sample_stat_t stat[PENTAMETRIC_SENSOR_COUNT];	// aggregates of each sample item so far this interval
+	struct sample_stat_t report[PENTAMETRIC_SENSOR_COUNT];	// aggregates of the interval being written out
+	uint32_t sample_id_base;	// dataN number of the first aggregate line
+	struct analytics_t analytics;
+	struct pipeline_t pl;
+	boolean busy;			// a read of this device is in progress
+	uint8_t task;			// what the read in progress is for, DEVICE_TASK_*
+	uint8_t verify_tries;	// read backs of the metadata left, 0 = nothing to check
+	struct pm_request_t verify[PENTAMETRIC_VERIFY_READS];
+	uint8_t verify_msg[8];	// data of the verify reads
+	boolean reset_due;		// amp hour reset still to be written after this device's midnight poll
+	struct pm_request_t reset[AMP_HOUR_RESET_WRITES];
+	uint8_t reset_msg[AMP_HOUR_RESET_WRITES];
+	boolean poll_due;		// device still has to be polled for the current cycle
+	uint32_t events;		// epoll events the port is registered for, 0 = not registered
+};
+
+// start of a trace file
+struct trace_header_t
+{
+	uint32_t magic;			// TRACE_MAGIC
+	uint16_t version;		// TRACE_VERSION
+	uint16_t reserved;
+};
+
+// first page of the ring file
+struct ring_header_t
+{
+	uint32_t magic;			// RING_MAGIC
+	uint16_t version;		// RING_VERSION
+	uint16_t record_size;	// sizeof(struct ring_record_t)
+	uint32_t capacity;		// records in the ring
+	uint32_t reserved;
+	uint64_t head;			// records ever written, the next one goes in slot head % capacity
+};
+
+// one decoded value in the ring file
+struct ring_record_t
+{
+	uint32_t seq;			// low 32 bits of the record's sequence number, proves the slot was completely written
+	uint32_t time;			// unix time of the read
+	uint16_t msec;
+	uint8_t device;			// index in the device list
+	uint8_t sensor;			// sensor bitmask bit number, | RING_SAMPLE for sample reads
+	int32_t value;			// decode_format*() result
+};
+
+// an open, mapped ring file
+struct ring_t
+{
+	int fd;
+	size_t map_len;
+	struct ring_header_t *header;
+	struct ring_record_t *record;
+	uint64_t synced;		// head as of the last ring_sync()
+};
+
+// start of every archive block
+struct archive_block_header_t
+{
+	uint32_t magic;			// ARCHIVE_MAGIC
+	uint8_t device;			// index in the device list
+	uint8_t sensor;			// sensor bitmask bit number, | RING_SAMPLE for sample reads
+	uint16_t count;			// values in the block
+	uint16_t used;			// payload bytes used
+	uint16_t reserved;
+	int32_t first_value;
+	uint64_t first_ms;		// unix time in ms of the first value
+	uint64_t last_ms;		// unix time in ms of the last value
+};
+
+// one fixed size archive block: header, then delta-of-delta times and value deltas as zigzag varints
+struct archive_block_t
+{
+	struct archive_block_header_t header;
+	uint8_t payload[ARCHIVE_BLOCK_BYTES - sizeof(struct archive_block_header_t)];
+};
+
+// one entry of the .idx file per archive block written
+struct archive_index_t
+{
+	uint32_t block;			// block number in the archive
+	uint8_t device;
+	uint8_t sensor;
+	uint16_t count;
+	uint64_t first_ms;
+	uint64_t last_ms;
+};
+
+// block being filled for one series
+struct archive_series_t
+{
+	struct archive_block_t block;
+	int64_t last_delta;		// ms between the last two values
+	int32_t last_value;
+	uint32_t slot;			// block number reserved for the block in the archive
+	uint16_t synced_count;	// values already written to the slot by archive_sync()
+	uint16_t synced_used;	// payload bytes already written to the slot
+};
+
+// an open archive
+struct archive_t
+{
+	int fd;
+	int index_fd;
+	uint32_t blocks;		// blocks written since open
+	uint32_t next_slot;		// first block number no series has reserved yet
+	uint32_t errors;		// blocks or index entries that could not be written
+	struct archive_series_t *series[PENTAMETRIC_MAX_DEVICES * PENTAMETRIC_SENSOR_COUNT * 2];	// poll and sample series of each sensor of each device
+};
+
+// one connection to the socket server
+struct server_client_t
+{
+	int fd;
+	uint32_t events;		// epoll events the client is registered for
+	boolean answered;		// command seen, anything else the client sends is ignored
+	boolean subscribed;		// gets every new cycle
+	uint64_t accepted_ms;	// monotonic ms the connection was accepted
+	char in[SERVER_COMMAND_BYTES];
+	uint8_t in_len;
+	char out[SNAPSHOT_MAX_BYTES + 32];
+	uint32_t out_len;
+	uint32_t out_done;
+};
+
+// unix socket serving the latest poll cycle
+struct server_t
+{
+	int listen_fd;
+	int epfd;				// epoll set of the listening socket and the clients
+	char path[FILENAME_MAX];
+	struct server_client_t *client[SERVER_MAX_CLIENTS];
+	uint8_t clients;
+	uint32_t refused;		// connections turned away, too many clients
+	uint32_t skipped;		// cycles a subscriber missed while still taking the previous one
+	char snapshot[SNAPSHOT_MAX_BYTES + 32];	// latest cycle with its time line
+	uint32_t snapshot_len;
+	char stats[STATS_TEXT_BYTES];	// protocol statistics as of the latest cycle
+	uint32_t stats_len;
+};
+
+// one connection to the prometheus endpoint
+struct http_client_t
+{
+	int fd;
+	uint32_t events;		// epoll events the client is registered for
+	uint64_t accepted_ms;	// monotonic ms the connection was accepted
+	char in[HTTP_REQUEST_BYTES];
+	uint32_t in_len;
+	char *out;				// copy of the response, NULL until the request is complete
+	uint32_t out_len;
+	uint32_t out_done;
+};
+
+// tcp listener answering scrapes from the latest poll
+struct http_t
+{
+	int listen_fd;
+	int epfd;				// epoll set of the listening socket and the clients
+	struct http_client_t *client[HTTP_MAX_CLIENTS];
+	char response[HTTP_MAX_BODY_BYTES + 256];	// status line, headers and metrics of the latest poll
+	uint32_t response_len;
+};
+
+// one device in the shared memory snapshot
+struct shm_device_t
+{
+	char device[64];		// tty name
+	uint8_t firmware_version;	// x10, 16 = V1.6
+	uint8_t shunt_select;	// SHUNTn_500A bits
+	uint8_t shunt_labels;	// SHUNTn_BATTERY bits
+	uint8_t hangup;			// device went away
+	uint32_t valid;			// bit n set when value[n] was read in the latest poll
+	int32_t value[PENTAMETRIC_SENSOR_COUNT];	// indexed by sensor bitmask bit number, meteohub units
+};
+
+// the shared memory segment, readers must follow the seq protocol in shm.c
+struct shm_segment_t
+{
+	uint32_t seq;			// odd while being written
+	uint32_t magic;			// SHM_MAGIC
+	uint16_t version;		// SHM_VERSION
+	uint16_t device_count;
+	uint32_t size;			// sizeof(struct shm_segment_t)
+	uint64_t time_ms;		// unix time in ms of the latest publish
+	uint32_t cycles;		// polls published since mhpmpi started
+	uint32_t reserved;
+	struct shm_device_t device[PENTAMETRIC_MAX_DEVICES];
+};
+
+// the writer's handle on the segment
+struct shm_t
+{
+	int fd;
+	char name[NAME_MAX];
+	struct shm_segment_t *segment;
 };
 
 /*
 	function prototypes
 */
-boolean pentametric_short_read (FILE *stream, uint8_t a, uint8_t n, uint8_t *msg);
-boolean pentametric_short_write(FILE *stream, uint8_t a, uint8_t n, uint8_t *msg);
-
-int32_t get_format1_value(FILE *stream, uint8_t pentametric_address);
-int32_t get_format2_value(FILE *stream, uint8_t pentametric_address);
-int32_t get_format2b_value(FILE *stream, uint8_t pentametric_address);
-int32_t get_format3_value(FILE *stream, uint8_t pentametric_address);
-int32_t get_format3b_value(FILE *stream, uint8_t pentametric_address);
-int32_t get_format4_value(FILE *stream, uint8_t pentametric_address);
-int32_t get_format5_value(FILE *stream, uint8_t pentametric_address);
-int32_t get_format6_value(FILE *stream, uint8_t pentametric_address);
-int32_t get_format7_value(FILE *stream, uint8_t pentametric_address);
-int32_t get_format8_value(FILE *stream, uint8_t pentametric_address);
-
-uint8_t get_shunt_select(FILE *stream);
-uint8_t get_shunt_labels(FILE *stream);
-boolean reset_amp_hours(FILE *stream, uint8_t shunt_labels);
-uint8_t get_firmware_version(FILE *stream);
+boolean pentametric_short_read (struct serial_port_t *port, uint8_t a, uint8_t n, uint8_t *msg);
+boolean pentametric_short_write(struct serial_port_t *port, uint8_t a, uint8_t n, uint8_t *msg);
+
+uint8_t decode_shunt_select(uint8_t *msg);
+uint8_t get_shunt_select(struct serial_port_t *port);
+uint8_t decode_shunt_labels(uint8_t *msg);
+uint8_t get_shunt_labels(struct serial_port_t *port);
+uint8_t build_amp_hour_reset(struct pm_request_t *request, uint8_t *msg, uint8_t shunt_labels);
+boolean reset_amp_hours(struct serial_port_t *port, uint8_t shunt_labels);
+uint8_t get_firmware_version(struct serial_port_t *port);
 
 int32_t decode_format1(uint8_t *msg);
 int32_t decode_format2(uint8_t *msg);
@@ -170,10 +800,135 @@ int32_t decode_format4(uint8_t *msg);
 int32_t decode_format5(uint8_t *msg);
 int32_t decode_format6(uint8_t *msg);
 int32_t decode_format7(uint8_t *msg);
-int16_t  decode_format8(uint8_t *msg);
+int32_t decode_format8(uint8_t *msg);
+
+void build_read_plan(struct read_plan_t *plan, uint32_t sensor_mask, boolean block_reads);
+void start_read_plan(struct serial_port_t *port, struct read_plan_t *plan, struct pipeline_t *pl);
+boolean continue_read_plan(struct read_plan_t *plan, struct pipeline_t *pl);
+uint8_t execute_read_plan(struct serial_port_t *port, struct read_plan_t *plan);
+uint8_t *get_plan_msg(struct read_plan_t *plan, uint8_t address);
+
+const struct sensor_t *get_sensor(uint8_t sensor_bit);
+uint8_t get_register_length(uint8_t address);
+int config_watch_open(struct config_t *config);
+boolean config_watch_changed(int fd, struct config_t *config);
+int reload_configuration(struct config_t *config, struct pentametric_t *pentametric, uint8_t count, char *myname);
+
+void schedule_init(struct schedule_t *s, struct poll_plan_t *poll, uint32_t *period);
+uint8_t schedule_take_due(struct schedule_t *s, struct poll_plan_t *poll, struct read_plan_t *due, boolean block_reads, uint64_t slack_ms);
+void schedule_put_back(struct schedule_t *s, struct poll_plan_t *poll, struct read_plan_t *due);
+
+void compile_poll_plan(struct poll_plan_t *poll, uint32_t sensor_mask, uint8_t shunt_select, boolean block_reads, uint32_t *id_base);
+
+void pentametric_init(struct pentametric_t *pm, struct config_t *config, uint8_t index);
+int pentametric_reopen(struct pentametric_t *pm, struct config_t *config, char *myname);
+void pentametric_plan(struct pentametric_t *pm, struct config_t *config, char *myname);
+void apply_firmware_version(struct pentametric_t *pm, struct config_t *config, char *myname, const char *source);
+int pentametric_open(struct pentametric_t *pm, struct config_t *config, char *myname);
+void pentametric_verify_start(struct pentametric_t *pm);
+void pentametric_verify_done(struct pentametric_t *pm, struct config_t *config, char *myname);
+void analytics_configure(struct analytics_t *a, struct config_t *config, uint8_t index);
+void analytics_add(struct analytics_t *a, struct poll_plan_t *plan, struct read_plan_t *read, uint8_t shunt_labels, uint64_t now_us);
+void analytics_values(struct analytics_t *a, int32_t value[ANALYTICS_COUNT]);
+extern const char *const analytics_name[ANALYTICS_COUNT];
+boolean metadata_valid(uint8_t firmware_version, uint8_t shunt_select, uint8_t shunt_labels);
+boolean metadata_load(const char *file_name, const char *device, uint8_t *firmware_version, uint8_t *shunt_select, uint8_t *shunt_labels);
+int metadata_save(const char *file_name, const char *device, uint8_t firmware_version, uint8_t shunt_select, uint8_t shunt_labels);
+void sample_stat_reset(struct sample_stat_t *stat);
+void sample_stat_add(struct sample_stat_t *stat, int32_t value);
+double sample_stat_stddev(struct sample_stat_t *stat);
+void add_samples(struct poll_plan_t *sample, struct sample_stat_t *stat);
+
+int ring_open(struct ring_t *ring, char *path, uint32_t capacity);
+void ring_close(struct ring_t *ring);
+void ring_append(struct ring_t *ring, struct timespec *ts, uint8_t device, uint8_t sensor, int32_t value);
+void ring_sync(struct ring_t *ring);
+boolean ring_get(struct ring_t *ring, uint64_t seq, struct ring_record_t *rec);
+uint64_t ring_tail(struct ring_t *ring);
+
+int archive_open(struct archive_t *archive, char *path);
+void archive_close(struct archive_t *archive);
+void archive_append(struct archive_t *archive, uint64_t time_ms, uint8_t device, uint8_t sensor, int32_t value);
+void archive_sync(struct archive_t *archive);
+int archive_decode_block(const struct archive_block_t *block, uint64_t *time_ms, int32_t *value);
+
+int server_open(struct server_t *server, char *path);
+void server_close(struct server_t *server);
+void server_service(struct server_t *server);
+uint64_t server_expire(struct server_t *server);
+void server_publish(struct server_t *server, char *text, uint32_t len);
+void server_publish_stats(struct server_t *server, char *text, uint32_t len);
+
+int http_open(struct http_t *http, char *address, uint16_t port);
+void http_close(struct http_t *http);
+void http_service(struct http_t *http);
+uint64_t http_expire(struct http_t *http);
+void http_publish(struct http_t *http, struct pentametric_t *pentametric, uint8_t count);
+
+int shm_open_segment(struct shm_t *shm, char *name);
+void shm_close_segment(struct shm_t *shm);
+void shm_publish(struct shm_t *shm, struct pentametric_t *pentametric, uint8_t count);
+boolean shm_snapshot_copy(const struct shm_segment_t *seg, struct shm_segment_t *copy);
+
+uint8_t format_uint(char *p, uint32_t v);
+uint8_t format_int(char *p, int32_t v);
+uint8_t format_fixed(char *p, int32_t value, uint8_t decimals);
+uint32_t format_line(char *text, uint32_t size, uint32_t len, const char *prefix, uint32_t id, int32_t value);
+int output_queue_open(struct output_queue_t *q, int fd, uint32_t size, const char *spill_name, uint32_t spill_max);
+uint64_t output_queue_close(struct output_queue_t *q);
+boolean output_queue_put(struct output_queue_t *q, const char *text, uint32_t len);
+int output_queue_flush(struct output_queue_t *q);
+uint64_t output_queue_bytes(const struct output_queue_t *q);
+boolean report_changed(struct report_state_t *state, int32_t value, int32_t band, boolean relative, uint64_t heartbeat_ms, uint64_t now_ms);
+
+int sink_open(struct sink_t *sink, uint8_t kind, const char *path, uint32_t queue_bytes, const char *spill_name, uint32_t spill_max);
+uint64_t sink_close(struct sink_t *sink);
+void sink_cycle_build(struct sink_cycle_t *cycle, struct pentametric_t *pentametric, uint8_t count, struct config_t *exceptions);
+uint32_t sink_format_meteohub(const struct sink_cycle_t *cycle, char *text, uint32_t size, boolean all);
+boolean sink_publish(struct sink_t *sink, const struct sink_cycle_t *cycle);
+
+int run_event_loop(struct config_t *config, struct pentametric_t *pentametric, uint8_t count, struct ring_t *ring, struct archive_t *archive, struct server_t *server, struct http_t *http, struct shm_t *shm, char *myname);
+
+uint64_t monotonic_ms(void);
+uint64_t monotonic_us(void);
+struct address_stats_t *address_stats(struct serial_port_t *port, uint8_t address);
+void histogram_add(struct histogram_t *h, uint64_t us);
+uint32_t stats_format(char *text, uint32_t size, struct pentametric_t *pentametric, uint8_t count, const struct histogram_t *cycle, const struct timer_queue_t *timer, const struct sink_t *sink, uint8_t sinks);
+void stats_log(struct config_t *config, struct pentametric_t *pentametric, uint8_t count, const struct histogram_t *cycle, const struct timer_queue_t *timer, const struct sink_t *sink, uint8_t sinks, char *myname);
+uint32_t poll_period_ms(const struct config_t *config);
+int trace_start(char *path);
+int trace_flush(void);
+void trace_stop(void);
+void trace_record(uint8_t kind, uint8_t device, const uint8_t *data, uint32_t n);
+int trace_replay(char *path, boolean realtime);
+int timer_queue_open(struct timer_queue_t *q);
+void timer_queue_close(struct timer_queue_t *q);
+void timer_queue_schedule(struct timer_queue_t *q, uint8_t job, uint64_t due_ms);
+void timer_queue_after(struct timer_queue_t *q, uint8_t job, uint64_t ms);
+void timer_queue_at_midnight(struct timer_queue_t *q, uint8_t job);
+boolean timer_queue_pending(const struct timer_queue_t *q, uint8_t job);
+uint64_t timer_queue_next_poll(struct timer_queue_t *q, uint32_t period_ms);
+uint32_t timer_queue_fired(struct timer_queue_t *q);
+uint64_t serial_deadline(struct serial_port_t *port, uint16_t n);
+int serial_open(struct serial_port_t *port, char *device, char *myname, char *log_file_name, boolean writetolog);
+void serial_close(struct serial_port_t *port);
+void serial_resync(struct serial_port_t *port);
+
+void pipeline_start(struct pipeline_t *pl, struct serial_port_t *port, struct pm_request_t *request, uint8_t count, uint8_t depth);
+boolean pipeline_done(struct pipeline_t *pl);
+short pipeline_events(struct pipeline_t *pl);
+void pipeline_on_writable(struct pipeline_t *pl);
+void pipeline_on_readable(struct pipeline_t *pl);
+void pipeline_check_timeout(struct pipeline_t *pl);
+uint8_t pipeline_run(struct pipeline_t *pl);
 
-int set_tty_port(FILE *ttyfile, char *device, char* myname, char *log_file_name, boolean writetolog);
+int set_tty_port(int fd, char *device, char* myname, char *log_file_name, boolean writetolog);
 uint32_t get_seconds_since_midnight (void);
 void writelog (char *logfilename, char *process_name, char *message);
+void writelog_level(uint8_t level, char *logfilename, char *process_name, char *message);
+int logger_start(struct config_t *config, char *myname);
+void logger_stop(void);
 void display_usage(char *myname);
-int get_configuration(struct config_t *config, char *path);
\ No newline at end of file
+int get_configuration(struct config_t *config, char *path);
+boolean load_configuration(struct config_t *config);
+void logger_set_level(uint8_t level);
\ No newline at end of file
@@ -0,0 +1,346 @@
+#include "mhpmpi.h"
+#include <errno.h>
+
+/*
+	output.c
+
+	meteohub protocol output: a whole poll cycle is rendered into one
+	preallocated buffer without going through printf, then handed to
+	stdout with as few write() calls as the pipe allows. On the MIPS
+	meteoplug the printf format parser was a noticeable share of the CPU
+	spent on each poll.
+
+	stdout, like the file of every other sink (sink.c), is non-blocking
+	with a queue in front of it, so meteohub not reading the pipe, while
+	it restarts for example, never holds up the polls. Cycles queue up in
+	OUTPUT_QUEUE_BYTES of memory, then in OUTPUT_SPILL_FILE, and the event
+	loop writes them out oldest first whenever the pipe has room. Once
+	anything is in the spill file new cycles go there too, and memory is
+	refilled from it as it empties, so the order never changes. Whatever
+	is still queued at exit is kept in the spill file and goes out first
+	on the next run. A cycle that finds both full is dropped whole, never
+	cut off part way.
+
+	Sensors with a DEADBAND_* setting are reported by exception: their
+	line is only written when the value moved by more than the deadband
+	since it was last written, or when HEARTBEAT_SECONDS have passed
+	without one, so meteohub doesn't store the same value every poll.
+*/
+
+// "00" .. "99", two digits per table lookup
+static const char digit_pairs[201] =
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+// decimal digits of v written at p, returns how many
+uint8_t format_uint(char *p, uint32_t v)
+{
+	char tmp[10];
+	uint8_t n = 0;
+
+	// fill tmp from the end, two digits at a time
+	while(v >= 100)
+	{
+		n += 2;
+		memcpy(&tmp[sizeof(tmp) - n], &digit_pairs[(v % 100) * 2], 2);
+		v /= 100;
+	}
+	if(v >= 10)
+	{
+		n += 2;
+		memcpy(&tmp[sizeof(tmp) - n], &digit_pairs[v * 2], 2);
+	}
+	else
+		tmp[sizeof(tmp) - ++n] = '0' + v;
+
+	memcpy(p, &tmp[sizeof(tmp) - n], n);
+	return n;
+}
+
+uint8_t format_int(char *p, int32_t v)
+{
+	if(v < 0)
+	{
+		*p = '-';
+		return 1 + format_uint(p + 1, (uint32_t)0 - (uint32_t)v);
+	}
+	return format_uint(p, (uint32_t)v);
+}
+
+// value / 10^decimals written at p as a decimal fraction, returns how many characters
+uint8_t format_fixed(char *p, int32_t value, uint8_t decimals)
+{
+	uint32_t scale = 1, v;
+	uint8_t n = 0, i;
+
+	for(i = 0; i < decimals; i++)
+		scale *= 10;
+
+	if(value < 0)
+	{
+		p[n++] = '-';
+		v = (uint32_t)0 - (uint32_t)value;
+	}
+	else
+		v = (uint32_t)value;
+
+	n += format_uint(p + n, v / scale);
+	if(decimals > 0)
+	{
+		p[n++] = '.';
+		v %= scale;
+		for(i = decimals; i > 0; i--, scale /= 10)
+			p[n++] = '0' + (v * 10 / scale) % 10;
+	}
+	return n;
+}
+
+// append "<prefix><id> <value>\n" to text, returns the new length; a line that doesn't fit is left out
+uint32_t format_line(char *text, uint32_t size, uint32_t len, const char *prefix, uint32_t id, int32_t value)
+{
+	uint8_t prefix_len = strlen(prefix);
+	char *p;
+
+	if(len + prefix_len + OUTPUT_MAX_LINE_NUMBERS > size)
+		return len;
+
+	p = text + len;
+	memcpy(p, prefix, prefix_len);
+	p += prefix_len;
+	p += format_uint(p, id);
+	*p++ = ' ';
+	p += format_int(p, value);
+	*p++ = '\n';
+	return p - text;
+}
+
+/*
+	put a queue in front of fd and make fd non-blocking. Bytes an earlier
+	run left in the spill file are queued first.
+
+	returns:	0 = OK
+				-1 = no memory for the queue
+				-2 = the spill file could not be opened, the queue works without it
+*/
+int output_queue_open(struct output_queue_t *q, int fd, uint32_t size, const char *spill_name, uint32_t spill_max)
+{
+	struct stat st;
+
+	memset(q, 0, sizeof(struct output_queue_t));
+	q->fd = fd;
+	q->pollable = true;
+	q->spill_fd = -1;
+	q->spill_max = spill_max;
+	q->size = size < OUTPUT_QUEUE_MIN_BYTES ? OUTPUT_QUEUE_MIN_BYTES : size;
+	if((q->buf = (char *)malloc(q->size)) == NULL)
+		return -1;
+	// O_NONBLOCK is shared with whoever else has the pipe open, meteohub included, so it is only ours until close
+	q->fd_flags = fcntl(fd, F_GETFL);
+	if(q->fd_flags >= 0)
+		fcntl(fd, F_SETFL, q->fd_flags | O_NONBLOCK);
+
+	if(strlen(spill_name) == 0)
+		return 0;
+	snprintf(q->spill_name, sizeof(q->spill_name), "%s", spill_name);
+	if((q->spill_fd = open(spill_name, O_RDWR | O_CREAT | O_CLOEXEC, 0644)) < 0)
+		return -2;
+	if(fstat(q->spill_fd, &st) == 0)
+		q->spill_write = st.st_size;
+	return 0;
+}
+
+// bytes queued in memory and in the spill file
+uint64_t output_queue_bytes(const struct output_queue_t *q)
+{
+	return q->len + (q->spill_write - q->spill_read);
+}
+
+// move the oldest spilled bytes into the empty memory queue, returns how many
+static uint32_t spill_refill(struct output_queue_t *q)
+{
+	uint64_t want = q->spill_write - q->spill_read;
+	ssize_t n;
+
+	if(want == 0)
+		return 0;
+	if(want > q->size)
+		want = q->size;
+
+	if((n = pread(q->spill_fd, q->buf, want, q->spill_read)) <= 0)
+		n = 0; // unreadable, give up on the rest rather than trying it forever
+	q->head = 0;
+	q->len = n;
+	q->spill_read = n > 0 ? q->spill_read + n : q->spill_write;
+
+	if(q->spill_read == q->spill_write) // all of it is in memory now, start the file over
+	{
+		if(ftruncate(q->spill_fd, 0) == 0)
+			q->spill_read = q->spill_write = 0;
+	}
+	return n;
+}
+
+/*
+	queue text behind everything meteohub hasn't read yet, in memory
+	unless something is already waiting in the spill file
+
+	returns:	true = queued
+				false = no room in memory or in the spill file, text was dropped
+*/
+boolean output_queue_put(struct output_queue_t *q, const char *text, uint32_t len)
+{
+	if(q->spill_read == q->spill_write)
+	{
+		if(q->head + q->len + len > q->size && q->head > 0) // slide what's left to the front to make room
+		{
+			memmove(q->buf, q->buf + q->head, q->len);
+			q->head = 0;
+		}
+		if(q->len + len <= q->size)
+		{
+			memcpy(q->buf + q->head + q->len, text, len);
+			q->len += len;
+			return true;
+		}
+	}
+
+	if(q->spill_fd >= 0 && q->spill_write + len <= q->spill_max &&
+		pwrite(q->spill_fd, text, len, q->spill_write) == (ssize_t)len)
+	{
+		q->spill_write += len;
+		q->spilled += len;
+		return true;
+	}
+	q->dropped++;
+	return false;
+}
+
+/*
+	write as much of the queue as the reader takes without blocking,
+	refilling memory from the spill file as it empties
+
+	returns:	0 = everything was written
+				1 = the reader is full, try again when fd is writable
+				-1 = the reader is gone
+*/
+int output_queue_flush(struct output_queue_t *q)
+{
+	ssize_t n;
+
+	if(q->gone)
+		return -1;
+
+	for(;;)
+	{
+		if(q->len == 0 && (q->spill_fd < 0 || spill_refill(q) == 0))
+			break;
+		if((n = write(q->fd, q->buf + q->head, q->len)) > 0)
+		{
+			q->head += n;
+			q->len -= n;
+			continue;
+		}
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			if(!q->stalled)
+				q->stalls++;
+			q->stalled = true;
+			return 1;
+		}
+		q->gone = true;
+		return -1;
+	}
+	q->head = 0;
+	q->stalled = false;
+	return 0;
+}
+
+// write buf and then the unread part of the spill file to a new spill file, returns false if it could not be written
+static boolean spill_keep(struct output_queue_t *q)
+{
+	char tmp_name[FILENAME_MAX + 8];
+	boolean ok = true;
+	uint64_t offset;
+	ssize_t n;
+	int fd;
+
+	snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", q->spill_name);
+	if((fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+		return false;
+
+	if(write(fd, q->buf + q->head, q->len) != (ssize_t)q->len)
+		ok = false;
+	for(offset = q->spill_read; ok && offset < q->spill_write; offset += n) // buf is free to copy through now
+	{
+		n = q->spill_write - offset > q->size ? q->size : q->spill_write - offset;
+		if((n = pread(q->spill_fd, q->buf, n, offset)) <= 0 || write(fd, q->buf, n) != n)
+			ok = false;
+	}
+
+	if(fsync(fd) != 0)
+		ok = false;
+	if(close(fd) != 0)
+		ok = false;
+	if(ok && rename(tmp_name, q->spill_name) != 0)
+		ok = false;
+	if(!ok)
+		unlink(tmp_name);
+	return ok;
+}
+
+/*
+	write what the reader still takes, keep the rest in the spill file for
+	the next run, free the queue and make fd blocking again if it was
+
+	returns bytes that were neither written nor kept
+*/
+uint64_t output_queue_close(struct output_queue_t *q)
+{
+	uint64_t lost = 0;
+
+	output_queue_flush(q);
+	if(q->spill_fd >= 0)
+	{
+		if(output_queue_bytes(q) == 0)
+			ftruncate(q->spill_fd, 0);
+		else if((q->len > 0 || q->spill_read > 0) && !spill_keep(q)) // what's in memory goes in front of what's left spilled
+			lost = output_queue_bytes(q);
+		close(q->spill_fd);
+	}
+	else
+		lost = q->len;
+
+	if(q->fd_flags >= 0 && !(q->fd_flags & O_NONBLOCK))
+		fcntl(q->fd, F_SETFL, q->fd_flags);
+	free(q->buf);
+	q->buf = NULL;
+	return lost;
+}
+
+/*
+	decide whether a deadbanded value goes out this cycle. band is in
+	meteohub units, or in hundredths of a percent of the last value
+	written when relative is set. The state is updated when it does.
+*/
+boolean report_changed(struct report_state_t *state, int32_t value, int32_t band, boolean relative, uint64_t heartbeat_ms, uint64_t now_ms)
+{
+	int64_t delta, limit;
+
+	if(state->reported)
+	{
+		delta = (int64_t)value - state->value;
+		if(delta < 0)
+			delta = -delta;
+		limit = relative ? llabs((int64_t)state->value) * band / 10000 : band;
+		if(delta <= limit && now_ms - state->time_ms < heartbeat_ms)
+			return false;
+	}
+
+	state->reported = true;
+	state->value = value;
+	state->time_ms = now_ms;
+	return true;
+}
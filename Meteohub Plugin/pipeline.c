@@ -0,0 +1,299 @@
+#include "mhpmpi.h"
+#include <poll.h>
+#include <errno.h>
+
+/*
+	pipeline.c
+
+	request/response engine for the Pentametric serial protocol. Up to
+	depth command frames are kept in flight so the next command is already
+	on the wire while the device turns the previous one around. The device
+	answers strictly in order and every response has a known length, so
+	responses are matched to requests by position in the queue.
+
+	Every frame sent, checksum error, timeout and retry is counted against
+	the request's address, and the round trip of each good response goes
+	into that address's latency histogram (see stats.c).
+
+	The engine is a state machine driven by pipeline_on_writable(),
+	pipeline_on_readable() and pipeline_check_timeout(); pipeline_run()
+	drives it with poll() for callers that just want to block.
+*/
+
+// bytes the device sends back for a request
+static uint16_t response_length(struct pm_request_t *request)
+{
+	if(request->command == PENTAMETRIC_SHORT_READ_COMMAND)
+		return request->length + 1; // data + checksum
+	else
+		return 1; // short write answers with the checksum it received
+}
+
+// encode a request into its command frame, returns the frame length
+static uint16_t encode_frame(struct pm_request_t *request, uint8_t *frame)
+{
+	uint8_t cs;
+	uint16_t i, n = 3;
+
+	frame[0] = request->command;
+	frame[1] = request->address;
+	frame[2] = request->length;
+	cs = request->command + request->address + request->length;
+
+	if(request->command == PENTAMETRIC_SHORT_WRITE_COMMAND)
+	{
+		for(i = 0; i < request->length; i++)
+		{
+			frame[n++] = request->msg[i];
+			cs += request->msg[i];
+		}
+	}
+
+	frame[n++] = ~cs; // remainder needed to add up to PENTAMETRIC_CHECKSUM
+	request->checksum = ~cs;
+
+#ifdef DEBUG
+	fprintf(stderr, "pipeline frame command 0x%x address 0x%x length %d checksum 0x%x\n",
+		request->command, request->address, request->length, request->checksum);
+#endif
+	return n;
+}
+
+// restart the response timer for the oldest request in flight
+static void pipeline_arm(struct pipeline_t *pl)
+{
+	if(pl->next_recv < pl->next_send)
+		pl->deadline = serial_deadline(pl->port, (pl->tx_len - pl->tx_done) +
+			response_length(&pl->request[pl->next_recv]) - pl->rx_len);
+}
+
+// queue command frames until depth requests are in flight
+static void pipeline_fill(struct pipeline_t *pl)
+{
+	struct pm_request_t *request;
+	uint64_t now = monotonic_us();
+
+	if(pl->tx_done > 0) // drop frames that are already on the wire
+	{
+		memmove(pl->tx, pl->tx + pl->tx_done, pl->tx_len - pl->tx_done);
+		pl->tx_len -= pl->tx_done;
+		pl->tx_done = 0;
+	}
+
+	while(pl->next_send < pl->count && pl->next_send - pl->next_recv < pl->depth)
+	{
+		request = &pl->request[pl->next_send++];
+		request->queued_us = now;
+		address_stats(pl->port, request->address)->requests++;
+		pl->tx_len += encode_frame(request, pl->tx + pl->tx_len);
+	}
+}
+
+/*
+	the oldest request timed out or came back corrupt. Everything queued
+	behind it is suspect too, so the port is resynchronised and all
+	outstanding requests are sent again. A failure with several frames in
+	flight drops the rest of the run to depth 1 in case the device could
+	not keep up.
+*/
+static void pipeline_fail(struct pipeline_t *pl)
+{
+	struct pm_request_t *head = &pl->request[pl->next_recv];
+
+	if(pl->next_send - pl->next_recv > 1)
+		pl->depth = 1;
+
+	serial_resync(pl->port);
+	pl->tx_len = pl->tx_done = pl->rx_len = 0;
+	pl->last_us = 0;
+
+	if(++head->attempts > pl->port->retries)
+	{
+		address_stats(pl->port, head->address)->failed++;
+#ifdef DEBUG
+		fprintf(stderr, "pipeline giving up on command 0x%x address 0x%x\n", head->command, head->address);
+#endif
+		pl->next_recv++;
+	}
+	else
+	{
+		pl->port->retried++;
+		address_stats(pl->port, head->address)->retries++;
+	}
+
+	pl->next_send = pl->next_recv;
+	pipeline_fill(pl);
+	pipeline_arm(pl);
+}
+
+// a whole response for the oldest request is in rx
+static void pipeline_complete(struct pipeline_t *pl)
+{
+	struct pm_request_t *head = &pl->request[pl->next_recv];
+	uint64_t now = monotonic_us();
+	uint8_t cs = 0;
+	uint16_t i;
+
+	if(head->command == PENTAMETRIC_SHORT_READ_COMMAND)
+	{
+		for(i = 0; i <= head->length; i++)
+			cs += pl->rx[i];
+		head->ok = (cs == PENTAMETRIC_CHECKSUM);
+		if(head->ok)
+			memcpy(head->msg, pl->rx, head->length);
+	}
+	else
+		head->ok = (pl->rx[0] == head->checksum);
+
+	pl->rx_len = 0;
+
+	if(!head->ok)
+	{
+#ifdef DEBUG
+		fprintf(stderr, "pipeline checksum error for command 0x%x address 0x%x\n", head->command, head->address);
+#endif
+		pl->port->checksum_errors++;
+		address_stats(pl->port, head->address)->checksum_errors++;
+		pipeline_fail(pl);
+		return;
+	}
+
+	// with several frames in flight a response can't start before the one ahead of it has finished
+	histogram_add(&address_stats(pl->port, head->address)->latency, now - (pl->last_us > head->queued_us ? pl->last_us : head->queued_us));
+	pl->last_us = now;
+
+	pl->next_recv++;
+	pipeline_fill(pl);
+	pipeline_arm(pl);
+}
+
+// set up a run of count requests with at most depth of them in flight
+void pipeline_start(struct pipeline_t *pl, struct serial_port_t *port, struct pm_request_t *request, uint8_t count, uint8_t depth)
+{
+	uint8_t i;
+
+	pl->port = port;
+	pl->request = request;
+	pl->count = count;
+	pl->depth = depth < 1 ? 1 : (depth > PIPELINE_MAX_DEPTH ? PIPELINE_MAX_DEPTH : depth);
+	pl->next_send = pl->next_recv = 0;
+	pl->tx_len = pl->tx_done = pl->rx_len = 0;
+	pl->last_us = 0;
+
+	for(i = 0; i < count; i++)
+	{
+		request[i].attempts = 0;
+		request[i].ok = false;
+	}
+
+	pipeline_fill(pl);
+	pipeline_arm(pl);
+}
+
+boolean pipeline_done(struct pipeline_t *pl)
+{
+	return pl->next_recv >= pl->count || pl->port->hangup;
+}
+
+// poll() events the engine is waiting for
+short pipeline_events(struct pipeline_t *pl)
+{
+	short events = 0;
+
+	if(pl->tx_done < pl->tx_len)
+		events |= POLLOUT;
+	if(pl->next_recv < pl->next_send)
+		events |= POLLIN;
+	return events;
+}
+
+void pipeline_on_writable(struct pipeline_t *pl)
+{
+	ssize_t rc;
+
+	rc = write(pl->port->fd, pl->tx + pl->tx_done, pl->tx_len - pl->tx_done);
+	if(rc > 0)
+	{
+		trace_record(TRACE_TX, pl->port->index, pl->tx + pl->tx_done, rc);
+		pl->tx_done += rc;
+	}
+	else if(rc < 0 && errno != EAGAIN && errno != EINTR)
+		pl->port->hangup = true;
+}
+
+void pipeline_on_readable(struct pipeline_t *pl)
+{
+	ssize_t rc;
+	uint16_t want;
+
+	while(pl->next_recv < pl->next_send && !pl->port->hangup)
+	{
+		// never read past the end of the oldest response so the next one starts at rx[0]
+		want = response_length(&pl->request[pl->next_recv]) - pl->rx_len;
+		rc = read(pl->port->fd, pl->rx + pl->rx_len, want);
+		if(rc > 0)
+		{
+			trace_record(TRACE_RX, pl->port->index, pl->rx + pl->rx_len, rc);
+			pl->rx_len += rc;
+			if(rc == want)
+				pipeline_complete(pl);
+			continue;
+		}
+		if(rc == 0 || (errno != EAGAIN && errno != EINTR))
+			pl->port->hangup = true; // adapter unplugged or the other end went away
+		break;
+	}
+}
+
+// fail the oldest request if its response is overdue
+void pipeline_check_timeout(struct pipeline_t *pl)
+{
+	if(pl->next_recv < pl->next_send && !pl->port->hangup && monotonic_ms() >= pl->deadline)
+	{
+#ifdef DEBUG
+		fprintf(stderr, "pipeline timeout for command 0x%x address 0x%x\n",
+			pl->request[pl->next_recv].command, pl->request[pl->next_recv].address);
+#endif
+		pl->port->timeouts++;
+		address_stats(pl->port, pl->request[pl->next_recv].address)->timeouts++;
+		pipeline_fail(pl);
+	}
+}
+
+// drive a pipeline to completion, returns the number of requests that succeeded
+uint8_t pipeline_run(struct pipeline_t *pl)
+{
+	struct pollfd pfd;
+	uint64_t now;
+	uint8_t i, good = 0;
+	int rc;
+
+	while(!pipeline_done(pl))
+	{
+		pfd.fd = pl->port->fd;
+		pfd.events = pipeline_events(pl);
+		pfd.revents = 0;
+
+		now = monotonic_ms();
+		rc = poll(&pfd, 1, pl->deadline > now ? (int)(pl->deadline - now) : 0);
+		if(rc < 0 && errno != EINTR)
+		{
+			pl->port->hangup = true;
+			break;
+		}
+		if(rc > 0)
+		{
+			if(pfd.revents & (POLLERR | POLLNVAL))
+				pl->port->hangup = true;
+			if(pfd.revents & POLLOUT)
+				pipeline_on_writable(pl);
+			if(pfd.revents & (POLLIN | POLLHUP))
+				pipeline_on_readable(pl);
+		}
+		pipeline_check_timeout(pl);
+	}
+
+	for(i = 0; i < pl->count; i++)
+		good += pl->request[i].ok;
+	return good;
+}
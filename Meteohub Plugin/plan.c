@@ -0,0 +1,185 @@
+#include "mhpmpi.h"
+
+/*
+	plan.c
+
+	read planner: turns the sensor bitmask into the fewest short read
+	transactions by merging adjacent Pentametric registers into spans,
+	then slices the responses back out for the decode_format*() functions.
+*/
+
+/*
+	build a read plan for the sensors selected in sensor_mask.
+
+	Selected registers are walked in address order and appended to the
+	current span while they are contiguous. A gap made up only of known
+	registers is bridged (the unwanted bytes are read and ignored) when it
+	costs fewer bytes than starting a new transaction would. With
+	block_reads false every register gets its own transaction, which is
+	the original one-read-per-sensor behaviour.
+*/
+void build_read_plan(struct read_plan_t *plan, uint32_t sensor_mask, boolean block_reads)
+{
+	uint8_t selected[PENTAMETRIC_MAX_DATA_ADDRESS + 1];
+	uint8_t length[PENTAMETRIC_MAX_DATA_ADDRESS + 1];
+	uint8_t a, b, i, gap_bytes, image_length = 0;
+	struct read_span_t *span = NULL;
+
+	memset(plan, 0, sizeof(struct read_plan_t));
+	memset(selected, 0, sizeof(selected));
+
+	for(a = 0; a <= PENTAMETRIC_MAX_DATA_ADDRESS; a++)
+		length[a] = get_register_length(a);
+
+	for(i = 0; i < PENTAMETRIC_SENSOR_COUNT; i++)
+		if(sensor_mask & get_sensor(i)->mask)
+			selected[get_sensor(i)->address] = true;
+
+	for(a = 1; a <= PENTAMETRIC_MAX_DATA_ADDRESS; a++)
+	{
+		if(!selected[a])
+			continue;
+
+		if(span != NULL && block_reads)
+		{
+			// cost of the gap between the end of the current span and this register
+			gap_bytes = 0;
+			for(b = span->address + span->count; b < a; b++)
+			{
+				if(length[b] == 0)
+				{
+					gap_bytes = UINT8_MAX; // unknown register, can't bridge
+					break;
+				}
+				gap_bytes += length[b];
+			}
+
+			if(gap_bytes <= PENTAMETRIC_READ_OVERHEAD_BYTES &&
+				span->length + gap_bytes + length[a] <= PENTAMETRIC_MAX_SPAN_BYTES)
+			{
+				for(b = span->address + span->count; b <= a; b++)
+				{
+					plan->offset[b] = image_length;
+					plan->span_of[b] = plan->span_count - 1;
+					image_length += length[b];
+					span->length += length[b];
+					span->count++;
+				}
+				plan->selected[a] = true;
+				continue;
+			}
+		}
+
+		// start a new span
+		span = &plan->span[plan->span_count++];
+		span->address = a;
+		span->count = 1;
+		span->length = length[a];
+		span->offset = image_length;
+		plan->offset[a] = image_length;
+		plan->span_of[a] = plan->span_count - 1;
+		plan->selected[a] = true;
+		image_length += length[a];
+	}
+}
+
+/*
+	start reading a plan: every span becomes one request in a pipelined
+	run on pl. Drive pl with the pipeline_on_*() calls and hand it to
+	continue_read_plan() each time pipeline_done() says the run is over.
+*/
+void start_read_plan(struct serial_port_t *port, struct read_plan_t *plan, struct pipeline_t *pl)
+{
+	struct read_span_t *span;
+	uint8_t i;
+
+	memset(plan->valid, 0, sizeof(plan->valid));
+	plan->good = 0;
+	plan->fallback = false;
+
+	for(i = 0; i < plan->span_count; i++)
+	{
+		span = &plan->span[i];
+		plan->request[i].command = PENTAMETRIC_SHORT_READ_COMMAND;
+		plan->request[i].address = span->address;
+		plan->request[i].length = span->length;
+		plan->request[i].msg = &plan->image[span->offset];
+	}
+	pipeline_start(pl, port, plan->request, plan->span_count, port->pipeline_depth);
+}
+
+/*
+	collect the results of a finished pipeline run and mark which
+	registers came back with a good checksum. If a multi-register span
+	failed, its selected registers are queued as single register reads on
+	pl so one bad register can't take out its neighbours.
+
+	returns true when the plan is complete, false if another run was started on pl.
+*/
+boolean continue_read_plan(struct read_plan_t *plan, struct pipeline_t *pl)
+{
+	struct read_span_t *span;
+	uint8_t i, a, count = 0;
+
+	if(plan->fallback)
+	{
+		for(i = 0; i < pl->count; i++)
+		{
+			if((plan->valid[plan->single[i].address] = plan->single[i].ok))
+				plan->good++;
+		}
+		return true;
+	}
+
+	for(i = 0; i < plan->span_count; i++)
+	{
+		span = &plan->span[i];
+		for(a = span->address; a < span->address + span->count; a++)
+		{
+			if(plan->request[i].ok)
+			{
+				plan->valid[a] = true;
+				plan->good += plan->selected[a];
+			}
+			else if(span->count > 1 && plan->selected[a])
+			{
+				plan->single[count].command = PENTAMETRIC_SHORT_READ_COMMAND;
+				plan->single[count].address = a;
+				plan->single[count].length = get_register_length(a);
+				plan->single[count].msg = &plan->image[plan->offset[a]];
+				count++;
+			}
+		}
+	}
+
+	if(count == 0 || pl->port->hangup)
+		return true;
+
+#ifdef DEBUG
+	fprintf(stderr, "read plan falling back to %d single register reads\n", count);
+#endif
+	plan->fallback = true;
+	pipeline_start(pl, pl->port, plan->single, count, pl->port->pipeline_depth);
+	return false;
+}
+
+// read a plan to completion, returns the number of selected registers with valid data
+uint8_t execute_read_plan(struct serial_port_t *port, struct read_plan_t *plan)
+{
+	struct pipeline_t pl;
+
+	start_read_plan(port, plan, &pl);
+	do
+		pipeline_run(&pl);
+	while(!continue_read_plan(plan, &pl));
+
+	return plan->good;
+}
+
+// get the raw data bytes of a register from the last plan execution, NULL if not read or bad checksum
+uint8_t *get_plan_msg(struct read_plan_t *plan, uint8_t address)
+{
+	if(address > PENTAMETRIC_MAX_DATA_ADDRESS || !plan->valid[address])
+		return NULL;
+	return &plan->image[plan->offset[address]];
+}
@@ -0,0 +1,193 @@
+/*
+
+pmarc.c
+
+Reader for the archive mhpmpi writes with ARCHIVE_FILE (see archive.c for
+the format). Prints one line per value:
+
+	unix_time_ms,device,sensor_bit,p|s,value
+
+where p is a poll and s a sample read, and value is in the same units as
+the dataN/tN lines mhpmpi writes to meteohub. Lines come out block by
+block, so values of different sensors are not interleaved in time order;
+pipe through sort -n to merge them.
+
+The archive is mapped read-only and decoded a whole block at a time.
+When a time, device or sensor filter is given and the .idx file is there,
+only the blocks it lists as matching are decoded, plus the blocks it
+doesn't list yet whose own headers match: those mhpmpi was still filling
+when it wrote them out, or when it was killed.
+
+*/
+#include "mhpmpi.h"
+#include <sys/mman.h>
+
+struct arc_options_t
+{
+	int device;				// -1 = every device
+	int sensor;				// -1 = every sensor
+	uint64_t from_ms;
+	uint64_t to_ms;
+	boolean summary;
+};
+
+struct arc_totals_t
+{
+	uint32_t blocks;
+	uint32_t bad_blocks;
+	uint64_t values;
+	uint64_t encoded;		// header and payload bytes actually used by the decoded blocks
+};
+
+static void arc_usage(char *myname)
+{
+	fprintf(stderr, "Usage: %s [-d device] [-s sensor_bit] [-f from] [-t to] [-S] archive_file\n", myname);
+	fprintf(stderr, "  -d device        Only values from this device (0 = first DEVICE in mhpmpi.conf).\n");
+	fprintf(stderr, "  -s sensor_bit    Only this sensor, by bit number in the sensor bitmask (0 = BATTERY1_VOLTS).\n");
+	fprintf(stderr, "  -f from          Only values at or after this unix time in seconds.\n");
+	fprintf(stderr, "  -t to            Only values before this unix time in seconds.\n");
+	fprintf(stderr, "  -S               Print totals and the compression achieved instead of the values.\n");
+	exit(EXIT_FAILURE);
+}
+
+// whether a block described by device, sensor and time range can hold values the options want
+static boolean arc_block_wanted(struct arc_options_t *opt, uint8_t device, uint8_t sensor, uint64_t first_ms, uint64_t last_ms)
+{
+	if(opt->device >= 0 && device != opt->device)
+		return false;
+	if(opt->sensor >= 0 && (sensor & ~RING_SAMPLE) != opt->sensor)
+		return false;
+	return last_ms >= opt->from_ms && first_ms < opt->to_ms;
+}
+
+static void arc_print_block(struct arc_options_t *opt, struct arc_totals_t *totals, const struct archive_block_t *block)
+{
+	static uint64_t time_ms[ARCHIVE_MAX_BLOCK_VALUES];
+	static int32_t value[ARCHIVE_MAX_BLOCK_VALUES];
+	const struct archive_block_header_t *header = &block->header;
+	char kind = header->sensor & RING_SAMPLE ? 's' : 'p';
+	int i, n;
+
+	if(header->magic == 0 && header->count == 0) // a slot reserved for a block that was never written out
+		return;
+	if(!arc_block_wanted(opt, header->device, header->sensor, header->first_ms, header->last_ms))
+		return;
+
+	if((n = archive_decode_block(block, time_ms, value)) < 0)
+	{
+		totals->bad_blocks++;
+		return;
+	}
+	totals->blocks++;
+	totals->encoded += sizeof(struct archive_block_header_t) + header->used;
+
+	for(i = 0; i < n; i++)
+	{
+		if(time_ms[i] < opt->from_ms || time_ms[i] >= opt->to_ms)
+			continue;
+		totals->values++;
+		if(!opt->summary)
+			fprintf(stdout, "%llu,%u,%u,%c,%d\n", (unsigned long long)time_ms[i], header->device, header->sensor & ~RING_SAMPLE, kind, value[i]);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct arc_options_t opt;
+	struct arc_totals_t totals;
+	const struct archive_block_t *block;
+	const struct archive_index_t *entry;
+	char index_name[FILENAME_MAX];
+	struct stat st, index_st;
+	uint8_t *map, *index_map = NULL, *indexed = NULL;
+	uint32_t block_count, i;
+	int fd, index_fd = -1, opt_char;
+
+	opt.device = -1;
+	opt.sensor = -1;
+	opt.from_ms = 0;
+	opt.to_ms = UINT64_MAX;
+	opt.summary = false;
+
+	while((opt_char = getopt(argc, argv, "d:f:hs:St:?")) != -1)
+	{
+		switch(opt_char)
+		{
+		case 'd': opt.device = atoi(optarg); break;
+		case 'f': opt.from_ms = (uint64_t)strtoull(optarg, NULL, 0) * 1000; break;
+		case 's': opt.sensor = atoi(optarg); break;
+		case 'S': opt.summary = true; break;
+		case 't': opt.to_ms = (uint64_t)strtoull(optarg, NULL, 0) * 1000; break;
+		default: arc_usage(argv[0]);
+		}
+	}
+	if(optind >= argc)
+		arc_usage(argv[0]);
+
+	if((fd = open(argv[optind], O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+	{
+		perror("pmarc: can't open archive");
+		return 1;
+	}
+	block_count = st.st_size / sizeof(struct archive_block_t);
+	if(block_count == 0)
+		return 0;
+	if((map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+	{
+		perror("pmarc: can't map archive");
+		return 1;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+	memset(&totals, 0, sizeof(totals));
+
+	// the index only pays off when it lets blocks be skipped
+	if(opt.device >= 0 || opt.sensor >= 0 || opt.from_ms > 0 || opt.to_ms < UINT64_MAX)
+	{
+		snprintf(index_name, sizeof(index_name), "%s.idx", argv[optind]);
+		if((index_fd = open(index_name, O_RDONLY)) >= 0 && fstat(index_fd, &index_st) == 0 && index_st.st_size >= (off_t)sizeof(struct archive_index_t))
+			index_map = mmap(NULL, index_st.st_size, PROT_READ, MAP_SHARED, index_fd, 0);
+		if(index_map == MAP_FAILED)
+			index_map = NULL;
+	}
+
+	if(index_map != NULL && (indexed = (uint8_t *)calloc(block_count, 1)) != NULL)
+	{
+		for(i = 0; i < index_st.st_size / sizeof(struct archive_index_t); i++)
+		{
+			entry = (const struct archive_index_t *)index_map + i;
+			if(entry->block >= block_count)
+				continue;
+			indexed[entry->block] = true;
+			if(arc_block_wanted(&opt, entry->device, entry->sensor, entry->first_ms, entry->last_ms))
+				arc_print_block(&opt, &totals, (const struct archive_block_t *)map + entry->block);
+		}
+		// blocks only indexed once full, the header of the rest says whether they are wanted
+		for(i = 0; i < block_count; i++)
+			if(!indexed[i])
+				arc_print_block(&opt, &totals, (const struct archive_block_t *)map + i);
+		free(indexed);
+		munmap(index_map, index_st.st_size);
+	}
+	else
+	{
+		for(i = 0; i < block_count; i++)
+		{
+			block = (const struct archive_block_t *)map + i;
+			arc_print_block(&opt, &totals, block);
+		}
+	}
+
+	if(opt.summary)
+		fprintf(stdout, "%u blocks of %u in the archive, %u unreadable, %llu values, %.2f bytes per value on disk, %.2f encoded\n",
+			totals.blocks, block_count, totals.bad_blocks, (unsigned long long)totals.values,
+			totals.values > 0 ? (double)totals.blocks * sizeof(struct archive_block_t) / totals.values : 0.0,
+			totals.values > 0 ? (double)totals.encoded / totals.values : 0.0);
+	fflush(stdout);
+
+	munmap(map, st.st_size);
+	if(index_fd >= 0)
+		close(index_fd);
+	close(fd);
+	return 0;
+}
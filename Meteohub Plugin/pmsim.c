@@ -0,0 +1,555 @@
+/*
+
+pmsim.c
+
+Pentametric PM-100-C simulator for testing mhpmpi without hardware.
+
+Creates a pseudo-terminal and answers short read and short write frames
+on it the way the Pentametric does, using the same register addresses and
+data encodings that decode_format1()..decode_format8() in mhpmpi.c expect.
+Point mhpmpi at the slave side (printed on start-up, or the -l link).
+
+Timing is modelled on the wire: command bytes take one byte time each at
+the simulated baud rate to "arrive", the device waits a turnaround delay
+(plus optional jitter) before answering and response bytes are released
+one byte time apart. Faults can be injected as randomly dropped response
+bytes and corrupted response checksums. With -k every register holds
+its base value, so the values mhpmpi reads are known in advance.
+
+A read longer than the addressed register carries on into the following
+registers, which is what the block read planner in plan.c relies on.
+
+*/
+#define _GNU_SOURCE
+#include "mhpmpi.h"
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
+
+#define SIM_MAX_PENDING 4096 // response bytes waiting to go out
+#define SIM_MAX_INPUT 512 // command bytes waiting to be decoded
+
+// how a simulated register is encoded
+enum sim_encoding
+{
+	SIM_VOLTS,			// format 1
+	SIM_AMPS,			// format 2/3 and 2b/3b
+	SIM_AMP_HOURS3,		// format 4
+	SIM_WATT_HOURS,		// format 5
+	SIM_PERCENT,		// format 6
+	SIM_DAYS,			// format 7
+	SIM_TEMPERATURE		// format 8
+};
+
+struct sim_register_t
+{
+	uint8_t address;
+	uint8_t length;
+	enum sim_encoding encoding;
+	int32_t base;		// value in meteohub units (1/100 V, 1/100 A, ...)
+	int32_t swing;		// +/- variation around base
+	uint32_t period;	// seconds per cycle of the variation, 0 = constant
+};
+
+// every data register mhpmpi knows about, values are for a 12V system with one battery shunt
+static struct sim_register_t sim_register[] =
+{
+	{PENTAMETRIC_ADDRESS_BATTERY1_VOLTS,				2, SIM_VOLTS,		1265,	40,		600},
+	{PENTAMETRIC_ADDRESS_BATTERY2_VOLTS,				2, SIM_VOLTS,		1270,	10,		900},
+	{PENTAMETRIC_ADDRESS_AVERAGE_BATTERY1_VOLTS,		2, SIM_VOLTS,		1262,	5,		3600},
+	{PENTAMETRIC_ADDRESS_AVERAGE_BATTERY2_VOLTS,		2, SIM_VOLTS,		1268,	5,		3600},
+	{PENTAMETRIC_ADDRESS_AMPS1,							3, SIM_AMPS,		-850,	2500,	120},
+	{PENTAMETRIC_ADDRESS_AMPS2,							3, SIM_AMPS,		1520,	1500,	300},
+	{PENTAMETRIC_ADDRESS_AMPS3,							3, SIM_AMPS,		-310,	200,	60},
+	{PENTAMETRIC_ADDRESS_AVERAGE_AMPS1,					3, SIM_AMPS,		-800,	100,	3600},
+	{PENTAMETRIC_ADDRESS_AVERAGE_AMPS2,					3, SIM_AMPS,		1500,	100,	3600},
+	{PENTAMETRIC_ADDRESS_AVERAGE_AMPS3,					3, SIM_AMPS,		-300,	20,		3600},
+	{PENTAMETRIC_ADDRESS_AMP_HOURS1,					3, SIM_AMPS,		-4210,	300,	7200},
+	{PENTAMETRIC_ADDRESS_AMP_HOURS2,					3, SIM_AMPS,		2890,	300,	7200},
+	{PENTAMETRIC_ADDRESS_AMP_HOURS3,					4, SIM_AMP_HOURS3,	-1150,	100,	7200},
+	{PENTAMETRIC_ADDRESS_CUM_AMP_HOURS1,				3, SIM_AMPS,		-10450,	0,		0},
+	{PENTAMETRIC_ADDRESS_CUM_AMP_HOURS2,				3, SIM_AMPS,		98700,	0,		0},
+	{PENTAMETRIC_ADDRESS_WATT_HOURS1,					4, SIM_WATT_HOURS,	-52400,	3000,	7200},
+	{PENTAMETRIC_ADDRESS_WATT_HOURS2,					4, SIM_WATT_HOURS,	36100,	3000,	7200},
+	{PENTAMETRIC_ADDRESS_WATTS1,						3, SIM_AMPS,		-10750,	30000,	120},
+	{PENTAMETRIC_ADDRESS_WATTS2,						3, SIM_AMPS,		19230,	18000,	300},
+	{PENTAMETRIC_ADDRESS_TEMPERATURE,					1, SIM_TEMPERATURE,	21,		4,		86400},
+	{PENTAMETRIC_ADDRESS_BATTERY1_PERCENT_FULL,			1, SIM_PERCENT,		87,		5,		7200},
+	{PENTAMETRIC_ADDRESS_BATTERY2_PERCENT_FULL,			1, SIM_PERCENT,		92,		3,		7200},
+	{PENTAMETRIC_ADDRESS_DAYS_SINCE_BATTERY1_CHARGED,	2, SIM_DAYS,		150,	0,		0},
+	{PENTAMETRIC_ADDRESS_DAYS_SINCE_BATTERY2_CHARGED,	2, SIM_DAYS,		75,		0,		0},
+	{PENTAMETRIC_ADDRESS_DAYS_SINCE_BATTERY1_EQUALIZED,	2, SIM_DAYS,		2130,	0,		0},
+	{PENTAMETRIC_ADDRESS_DAYS_SINCE_BATTERY2_EQUALIZED,	2, SIM_DAYS,		1870,	0,		0}
+};
+
+#define SIM_REGISTER_COUNT (sizeof(sim_register) / sizeof(sim_register[0]))
+
+struct sim_options_t
+{
+	uint32_t baud;
+	uint32_t turnaround_ms;
+	uint32_t jitter_ms;
+	double drop_rate;		// chance of losing each response byte
+	double corrupt_rate;	// chance of a bad checksum on each response
+	uint8_t firmware;		// version x10
+	uint8_t shunt_select;	// SHUNTn_500A bits
+	uint8_t shunt_labels;	// SHUNTn_BATTERY bits
+	char *link;				// symlink to the slave pty
+	boolean hold;			// keep every register at its base value
+	boolean verbose;
+};
+
+struct sim_state_t
+{
+	int master;
+	uint64_t start_us;
+	uint64_t byte_us;
+	uint64_t rx_free_us;	// when the last command byte finished arriving
+	uint64_t tx_free_us;	// when the transmitter is next idle
+	uint8_t input[SIM_MAX_INPUT];
+	uint16_t input_len;
+	uint64_t input_done_us;
+	uint8_t pending[SIM_MAX_PENDING];
+	uint64_t pending_due[SIM_MAX_PENDING];
+	uint16_t pending_head;
+	uint16_t pending_len;
+	int32_t cleared[PENTAMETRIC_MAX_DATA_ADDRESS + 1]; // offset applied by reset commands
+	boolean hold;			// -k, no variation so a run's values are known in advance
+	uint32_t frames;
+	uint32_t reads;
+	uint32_t writes;
+	uint32_t dropped;
+	uint32_t corrupted;
+	uint32_t garbage;
+};
+
+static volatile sig_atomic_t sim_stop = false;
+
+static void sim_signal(int sig)
+{
+	sim_stop = true;
+}
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static boolean chance(double rate)
+{
+	return rate > 0 && (double)random() / RAND_MAX < rate;
+}
+
+// triangle wave between base - swing and base + swing so values move without needing libm
+static int32_t sim_value(struct sim_state_t *sim, struct sim_register_t *r)
+{
+	uint64_t t, phase;
+	int64_t v;
+
+	if(sim->hold || r->period == 0 || r->swing == 0)
+		return r->base - sim->cleared[r->address];
+
+	t = (now_us() - sim->start_us) / 1000000 + r->address * 37; // stagger registers
+	phase = t % r->period;
+	if(phase < r->period / 2)
+		v = -r->swing + (int64_t)4 * r->swing * phase / r->period;
+	else
+		v = 3 * r->swing - (int64_t)4 * r->swing * phase / r->period;
+
+	return r->base + (int32_t)v - sim->cleared[r->address];
+}
+
+/*
+	encoders, the inverse of decode_format1..8. Positive values are
+	"charging" and have the high bit set with the magnitude inverted,
+	negative values are "discharging" and carry the magnitude as is.
+*/
+static void encode_le(uint8_t *msg, uint32_t raw, uint8_t length)
+{
+	uint8_t i;
+
+	for(i = 0; i < length; i++)
+		msg[i] = (raw >> (8 * i)) & 0xff;
+}
+
+static void sim_encode(struct sim_state_t *sim, struct sim_register_t *r, uint8_t *msg)
+{
+	int32_t v = sim_value(sim, r);
+	uint32_t raw = 0;
+
+	switch(r->encoding)
+	{
+	case SIM_VOLTS:
+		raw = (uint32_t)(v < 0 ? 0 : v) / 5 & 0x7ff; // 1/20 V steps
+		break;
+	case SIM_AMPS:
+		raw = v >= 0 ? ~(uint32_t)v & 0xffffff : (uint32_t)-v & 0x7fffff;
+		break;
+	case SIM_AMP_HOURS3:
+		raw = v >= 0 ? ~((uint32_t)v << 7) : ((uint32_t)-v << 7) & 0x7ffffff;
+		break;
+	case SIM_WATT_HOURS:
+		raw = v >= 0 ? ~(uint32_t)v : (uint32_t)-v & 0x7ffffff;
+		break;
+	case SIM_PERCENT:
+		raw = v < 0 ? 0 : (v > 100 ? 100 : v);
+		break;
+	case SIM_DAYS:
+		raw = (uint32_t)v & 0xffff;
+		break;
+	case SIM_TEMPERATURE:
+		raw = (uint8_t)(int8_t)v;
+		break;
+	}
+	encode_le(msg, raw, r->length);
+}
+
+static struct sim_register_t *find_register(uint8_t address)
+{
+	uint8_t i;
+
+	for(i = 0; i < SIM_REGISTER_COUNT; i++)
+		if(sim_register[i].address == address)
+			return &sim_register[i];
+	return NULL;
+}
+
+// fill n bytes of read data starting at address a
+static void sim_read_data(struct sim_state_t *sim, struct sim_options_t *opt, uint8_t a, uint8_t n, uint8_t *data)
+{
+	struct sim_register_t *r;
+	uint8_t reg[4];
+	uint16_t done = 0, i;
+
+	memset(data, 0, n);
+
+	switch(a)
+	{
+	case PENTAMETRIC_ADDRESS_FIRMWARE_VERSION:
+		data[0] = opt->firmware;
+		return;
+	case PENTAMETRIC_ADDRESS_SHUNT_SELECT:
+		for(i = 0; i < 3 && i < n; i++)
+			data[i] = (opt->shunt_select & (1 << i)) ? 0x10 : 0x00;
+		return;
+	case PENTAMETRIC_ADDRESS_SHUNT_LABELS:
+		for(i = 0; i < 3 && i < n; i++)
+			data[i] = (opt->shunt_labels & (1 << i)) ? 0x05 : 0x01;
+		return;
+	}
+
+	while(done < n && a <= PENTAMETRIC_MAX_DATA_ADDRESS)
+	{
+		if((r = find_register(a)) != NULL)
+		{
+			sim_encode(sim, r, reg);
+			for(i = 0; i < r->length && done < n; i++)
+				data[done++] = reg[i];
+		}
+		a++;
+	}
+}
+
+// apply a write to the reset address
+static void sim_reset(struct sim_state_t *sim, uint8_t command)
+{
+	struct sim_register_t *r;
+	uint8_t clear[3] = {0, 0, 0};
+	uint8_t i;
+
+	switch(command)
+	{
+	case PENTAMETRIC_CLEAR_AMP_HOURS_1:	clear[0] = PENTAMETRIC_ADDRESS_AMP_HOURS1; break;
+	case PENTAMETRIC_CLEAR_AMP_HOURS_2:	clear[0] = PENTAMETRIC_ADDRESS_AMP_HOURS2; break;
+	case PENTAMETRIC_CLEAR_AMP_HOURS_3:	clear[0] = PENTAMETRIC_ADDRESS_AMP_HOURS3; break;
+	case PENTAMETRIC_CLEAR_AMP_HOURS:
+		clear[0] = PENTAMETRIC_ADDRESS_AMP_HOURS1;
+		clear[1] = PENTAMETRIC_ADDRESS_AMP_HOURS2;
+		clear[2] = PENTAMETRIC_ADDRESS_AMP_HOURS3;
+		break;
+	case PENTAMETRIC_CLEAR_WATT_HOURS1:	clear[0] = PENTAMETRIC_ADDRESS_WATT_HOURS1; break;
+	case PENTAMETRIC_CLEAR_WATT_HOURS2:	clear[0] = PENTAMETRIC_ADDRESS_WATT_HOURS2; break;
+	case PENTAMETRIC_CLEAR_WATT_HOURS:
+		clear[0] = PENTAMETRIC_ADDRESS_WATT_HOURS1;
+		clear[1] = PENTAMETRIC_ADDRESS_WATT_HOURS2;
+		break;
+	}
+
+	for(i = 0; i < 3; i++)
+	{
+		if(clear[i] && (r = find_register(clear[i])) != NULL)
+		{
+			sim->cleared[clear[i]] = 0;
+			sim->cleared[clear[i]] = sim_value(sim, r); // value reads as zero from now
+		}
+	}
+}
+
+// schedule response bytes on the simulated transmitter, applying faults
+static void sim_respond(struct sim_state_t *sim, struct sim_options_t *opt, uint8_t *data, uint16_t n)
+{
+	uint64_t t;
+	uint16_t i, slot;
+
+	t = sim->input_done_us + opt->turnaround_ms * 1000;
+	if(opt->jitter_ms)
+		t += (uint64_t)(random() % (opt->jitter_ms * 1000 + 1));
+	if(t < sim->tx_free_us)
+		t = sim->tx_free_us;
+
+	if(chance(opt->corrupt_rate))
+	{
+		data[n - 1] ^= 1 << (random() % 8);
+		sim->corrupted++;
+	}
+
+	for(i = 0; i < n; i++)
+	{
+		t += sim->byte_us;
+		if(chance(opt->drop_rate))
+		{
+			sim->dropped++;
+			continue;
+		}
+		if(sim->pending_len >= SIM_MAX_PENDING)
+			break; // transmitter overrun, byte is lost
+		slot = (sim->pending_head + sim->pending_len++) % SIM_MAX_PENDING;
+		sim->pending[slot] = data[i];
+		sim->pending_due[slot] = t;
+	}
+	sim->tx_free_us = t;
+}
+
+// decode complete command frames from the input buffer
+static void sim_process_input(struct sim_state_t *sim, struct sim_options_t *opt)
+{
+	uint8_t response[UINT8_MAX + 1];
+	uint8_t command, a, n, cs;
+	uint16_t frame_len, i;
+
+	while(sim->input_len >= 4)
+	{
+		command = sim->input[0];
+		a = sim->input[1];
+		n = sim->input[2];
+
+		if(command == PENTAMETRIC_SHORT_READ_COMMAND)
+			frame_len = 4;
+		else if(command == PENTAMETRIC_SHORT_WRITE_COMMAND)
+			frame_len = 4 + n;
+		else
+			frame_len = 0;
+
+		if(frame_len > sim->input_len)
+			return; // rest of the frame not here yet
+
+		cs = 0;
+		for(i = 0; i < frame_len; i++)
+			cs += sim->input[i];
+
+		if(frame_len == 0 || cs != PENTAMETRIC_CHECKSUM)
+		{
+			// not a frame start, slide along one byte like a real receiver hunting for sync
+			sim->garbage++;
+			memmove(sim->input, sim->input + 1, --sim->input_len);
+			continue;
+		}
+
+		sim->frames++;
+		if(command == PENTAMETRIC_SHORT_READ_COMMAND)
+		{
+			sim->reads++;
+			sim_read_data(sim, opt, a, n, response);
+			cs = 0;
+			for(i = 0; i < n; i++)
+				cs += response[i];
+			response[n] = ~cs;
+			if(opt->verbose)
+				fprintf(stderr, "pmsim: read 0x%02x length %d\n", a, n);
+			sim_respond(sim, opt, response, n + 1);
+		}
+		else
+		{
+			sim->writes++;
+			if(a == PENTAMETRIC_ADDRESS_RESET && n == 1)
+				sim_reset(sim, sim->input[3]);
+			if(opt->verbose)
+				fprintf(stderr, "pmsim: write 0x%02x length %d\n", a, n);
+			response[0] = sim->input[frame_len - 1];
+			sim_respond(sim, opt, response, 1);
+		}
+
+		sim->input_len -= frame_len;
+		memmove(sim->input, sim->input + frame_len, sim->input_len);
+	}
+}
+
+// take command bytes from the master side, paced at the simulated baud rate
+static void sim_receive(struct sim_state_t *sim, struct sim_options_t *opt)
+{
+	uint8_t buf[256];
+	ssize_t rc, i;
+	uint64_t t = now_us();
+
+	while((rc = read(sim->master, buf, sizeof(buf))) > 0)
+	{
+		for(i = 0; i < rc; i++)
+		{
+			if(sim->rx_free_us < t)
+				sim->rx_free_us = t;
+			sim->rx_free_us += sim->byte_us;
+			if(sim->input_len < SIM_MAX_INPUT)
+				sim->input[sim->input_len++] = buf[i];
+		}
+		sim->input_done_us = sim->rx_free_us;
+		sim_process_input(sim, opt);
+	}
+}
+
+// release response bytes whose time has come
+static void sim_transmit(struct sim_state_t *sim)
+{
+	uint8_t buf[SIM_MAX_PENDING];
+	uint16_t n = 0;
+	uint64_t t = now_us();
+
+	while(sim->pending_len > 0 && sim->pending_due[sim->pending_head] <= t)
+	{
+		buf[n++] = sim->pending[sim->pending_head];
+		sim->pending_head = (sim->pending_head + 1) % SIM_MAX_PENDING;
+		sim->pending_len--;
+	}
+	if(n > 0 && write(sim->master, buf, n) < 0 && errno != EAGAIN)
+		perror("pmsim: write");
+}
+
+static void sim_usage(char *myname)
+{
+	fprintf(stderr, "pmsim - Pentametric PM-100-C simulator for mhpmpi.\n");
+	fprintf(stderr, "Usage: %s [-b baud] [-t turnaround_ms] [-j jitter_ms] [-D drop_rate] [-c corrupt_rate]\n", myname);
+	fprintf(stderr, "          [-f firmware] [-S shunt_select] [-L shunt_labels] [-l link] [-r seed] [-k] [-v]\n");
+	fprintf(stderr, "  -b baud          Simulated line speed, default 2400.\n");
+	fprintf(stderr, "  -t turnaround_ms Delay between the end of a command and the first response byte, default 30.\n");
+	fprintf(stderr, "  -j jitter_ms     Random extra turnaround of up to this many ms, default 0.\n");
+	fprintf(stderr, "  -D drop_rate     Fraction of response bytes lost (0.0 - 1.0), default 0.\n");
+	fprintf(stderr, "  -c corrupt_rate  Fraction of responses sent with a bad checksum (0.0 - 1.0), default 0.\n");
+	fprintf(stderr, "  -f firmware      Firmware version x10 reported at 0xf7, default 16.\n");
+	fprintf(stderr, "  -S shunt_select  500A shunt bits (0x01 shunt 1, 0x02 shunt 2, 0x04 shunt 3), default 0x01.\n");
+	fprintf(stderr, "  -L shunt_labels  Battery shunt bits (0x01 shunt 1, 0x02 shunt 2, 0x04 shunt 3), default 0x01.\n");
+	fprintf(stderr, "  -l link          Create a symlink to the slave pty at this path.\n");
+	fprintf(stderr, "  -r seed          Seed for the fault injection random numbers.\n");
+	fprintf(stderr, "  -k               Hold every register at its base value instead of varying it.\n");
+	fprintf(stderr, "  -v               Log every frame to stderr.\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct sim_options_t opt;
+	struct sim_state_t sim;
+	struct termios tio;
+	struct pollfd pfd;
+	char *slave;
+	uint64_t t;
+	int opt_char, timeout;
+
+	opt.baud = 2400;
+	opt.turnaround_ms = 30;
+	opt.jitter_ms = 0;
+	opt.drop_rate = 0;
+	opt.corrupt_rate = 0;
+	opt.firmware = 16;
+	opt.shunt_select = SHUNT1_500A;
+	opt.shunt_labels = SHUNT1_BATTERY;
+	opt.link = NULL;
+	opt.hold = false;
+	opt.verbose = false;
+	srandom(time(NULL));
+
+	while((opt_char = getopt(argc, argv, "b:c:D:f:hj:kl:L:r:S:t:v?")) != -1)
+	{
+		switch(opt_char)
+		{
+		case 'b': opt.baud = atoi(optarg); break;
+		case 'c': opt.corrupt_rate = atof(optarg); break;
+		case 'D': opt.drop_rate = atof(optarg); break;
+		case 'f': opt.firmware = (uint8_t)atoi(optarg); break;
+		case 'j': opt.jitter_ms = atoi(optarg); break;
+		case 'k': opt.hold = true; break;
+		case 'l': opt.link = optarg; break;
+		case 'L': opt.shunt_labels = (uint8_t)strtol(optarg, NULL, 0); break;
+		case 'r': srandom(atoi(optarg)); break;
+		case 'S': opt.shunt_select = (uint8_t)strtol(optarg, NULL, 0); break;
+		case 't': opt.turnaround_ms = atoi(optarg); break;
+		case 'v': opt.verbose = true; break;
+		default: sim_usage(argv[0]);
+		}
+	}
+	if(opt.baud == 0)
+		sim_usage(argv[0]);
+
+	memset(&sim, 0, sizeof(sim));
+	sim.byte_us = 10000000ULL / opt.baud; // start + 8 data + stop bits
+	sim.start_us = now_us();
+	sim.hold = opt.hold;
+
+	if((sim.master = posix_openpt(O_RDWR | O_NOCTTY)) < 0 || grantpt(sim.master) < 0 || unlockpt(sim.master) < 0)
+	{
+		perror("pmsim: can't create pseudo-terminal");
+		return 1;
+	}
+	slave = ptsname(sim.master);
+
+	// raw master so frame bytes pass through untouched
+	tcgetattr(sim.master, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(sim.master, TCSANOW, &tio);
+	fcntl(sim.master, F_SETFL, fcntl(sim.master, F_GETFL) | O_NONBLOCK);
+
+	if(opt.link != NULL)
+	{
+		unlink(opt.link);
+		if(symlink(slave, opt.link) < 0)
+			perror("pmsim: can't create link");
+	}
+
+	fprintf(stdout, "%s\n", opt.link != NULL ? opt.link : slave);
+	fflush(stdout);
+
+	signal(SIGINT, sim_signal);
+	signal(SIGTERM, sim_signal);
+
+	while(!sim_stop)
+	{
+		timeout = -1;
+		if(sim.pending_len > 0)
+		{
+			t = now_us();
+			timeout = sim.pending_due[sim.pending_head] > t ? (int)((sim.pending_due[sim.pending_head] - t + 999) / 1000) : 0;
+		}
+
+		pfd.fd = sim.master;
+		pfd.events = POLLIN;
+		if(poll(&pfd, 1, timeout) < 0 && errno != EINTR)
+			break;
+
+		// POLLHUP just means no process has the slave open at the moment
+		if(pfd.revents & POLLIN)
+			sim_receive(&sim, &opt);
+		else if(pfd.revents & POLLHUP)
+			usleep(10000);
+
+		sim_transmit(&sim);
+	}
+
+	fprintf(stderr, "pmsim: %u frames (%u reads, %u writes), %u bytes dropped, %u checksums corrupted, %u garbage bytes\n",
+		sim.frames, sim.reads, sim.writes, sim.dropped, sim.corrupted, sim.garbage);
+
+	if(opt.link != NULL)
+		unlink(opt.link);
+	close(sim.master);
+	return 0;
+}
@@ -0,0 +1,221 @@
+#include "mhpmpi.h"
+#include <sys/inotify.h>
+#include <libgen.h>
+#include <errno.h>
+
+/*
+	reload.c
+
+	configuration reload on SIGHUP, or when the .conf file is saved. The
+	config is built again from scratch the way main() built it, checked,
+	and only then copied over the running one, so a half edited file
+	never takes effect. The event loop applies it between cycles while
+	no device has a read in flight, and replans every device from the
+	shunt configuration read at startup: the ttys stay open and the
+	firmware version, shunt select and shunt labels aren't read again.
+
+	Settings that open or size files, sockets or devices only take effect
+	on a restart, and a change to one of them is logged as such: DEVICE,
+	CLOSE_DEVICE, RING_FILE, RING_RECORDS, ARCHIVE_FILE, METADATA_FILE,
+	SOCKET_PATH, SHM_NAME, HTTP_ADDRESS, HTTP_PORT, OUTPUT_QUEUE_BYTES,
+	OUTPUT_SPILL_FILE, the sink files and SINK_QUEUE_BYTES, TRACE_FILE,
+	WRITE_LOG, LOG_FILE_NAME, LOG_ROTATE_* and WATCH_CONFIG.
+*/
+
+/*
+	watch the directory of the .conf file, editors often save by writing
+	a new file and renaming it over the old one.
+
+	returns the inotify fd, or -1 if there is nothing to watch
+*/
+int config_watch_open(struct config_t *config)
+{
+	char dir[FILENAME_MAX];
+	int fd;
+
+	if(!config->watch_config || strlen(config->config_path) == 0)
+		return -1;
+
+	snprintf(dir, sizeof(dir), "%s", config->config_path);
+	if((fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+		return -1;
+	if(inotify_add_watch(fd, dirname(dir), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// read every queued inotify event, returns true if one of them was the .conf file
+boolean config_watch_changed(int fd, struct config_t *config)
+{
+	char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	char path[FILENAME_MAX];
+	const struct inotify_event *event;
+	const char *name;
+	boolean changed = false;
+	ssize_t n, i;
+
+	snprintf(path, sizeof(path), "%s", config->config_path);
+	name = basename(path);
+
+	while((n = read(fd, buffer, sizeof(buffer))) > 0)
+	{
+		for(i = 0; i < n; i += sizeof(struct inotify_event) + event->len)
+		{
+			event = (const struct inotify_event *)&buffer[i];
+			if(event->len > 0 && strcmp(event->name, name) == 0)
+				changed = true;
+		}
+	}
+	return changed;
+}
+
+// log a setting that changed in the file but needs a restart
+static void restart_needed(struct config_t *config, char *myname, const char *setting)
+{
+	char message_buffer[128];
+
+	if(!config->write_log)
+		return;
+	snprintf(message_buffer, sizeof(message_buffer), "%s changed, it takes effect on the next restart", setting);
+	writelog_level(LOG_LEVEL_WARNING, config->log_file_name, myname, message_buffer);
+}
+
+/*
+	build the config again and, if it is usable, make it the running one
+	and replan every device. Must only be called while no device is busy.
+
+	returns:	0 = new config applied
+				1 = new config applied and the poll interval changed
+				-1 = new config rejected, the old one stays
+*/
+int reload_configuration(struct config_t *config, struct pentametric_t *pentametric, uint8_t count, char *myname)
+{
+	static struct config_t fresh; // too big for the stack of the event loop
+	char message_buffer[FILENAME_MAX + 128];
+	const char *problem = NULL;
+	boolean new_interval;
+	uint8_t d;
+
+	if(!load_configuration(&fresh))
+		problem = "no readable .conf file";
+	else if(poll_period_ms(&fresh) == 0)
+		problem = "SLEEP_SECONDS or SLEEP_MS must be at least 1";
+	else if((fresh.sensor_mask & ((1UL << PENTAMETRIC_SENSOR_COUNT) - 1)) == 0)
+		problem = "SENSOR_MASK selects no sensors";
+	else if(fresh.pipeline_depth < 1 || fresh.pipeline_depth > PIPELINE_MAX_DEPTH)
+		problem = "PIPELINE_DEPTH out of range";
+
+	if(problem != NULL)
+	{
+		if(config->write_log)
+		{
+			sprintf(message_buffer, "Configuration not reloaded, %s", problem);
+			writelog_level(LOG_LEVEL_ERROR, config->log_file_name, myname, message_buffer);
+		}
+		return -1;
+	}
+
+	// what can't change without reopening something stays as it is
+	if(fresh.device_count != count)
+		restart_needed(config, myname, "DEVICE");
+	else
+		for(d = 0; d < count; d++)
+			if(strcmp(fresh.device[d], config->device[d]) != 0)
+			{
+				restart_needed(config, myname, "DEVICE");
+				break;
+			}
+	if(fresh.close_tty_file != config->close_tty_file)
+		restart_needed(config, myname, "CLOSE_DEVICE");
+	if(strcmp(fresh.ring_file_name, config->ring_file_name) != 0)
+		restart_needed(config, myname, "RING_FILE");
+	if(fresh.ring_records != config->ring_records)
+		restart_needed(config, myname, "RING_RECORDS");
+	if(strcmp(fresh.metadata_file_name, config->metadata_file_name) != 0)
+		restart_needed(config, myname, "METADATA_FILE");
+	if(strcmp(fresh.archive_file_name, config->archive_file_name) != 0)
+		restart_needed(config, myname, "ARCHIVE_FILE");
+	if(strcmp(fresh.socket_path, config->socket_path) != 0)
+		restart_needed(config, myname, "SOCKET_PATH");
+	if(strcmp(fresh.shm_name, config->shm_name) != 0)
+		restart_needed(config, myname, "SHM_NAME");
+	if(strcmp(fresh.http_address, config->http_address) != 0)
+		restart_needed(config, myname, "HTTP_ADDRESS");
+	if(fresh.http_port != config->http_port)
+		restart_needed(config, myname, "HTTP_PORT");
+	if(fresh.output_queue_bytes != config->output_queue_bytes)
+		restart_needed(config, myname, "OUTPUT_QUEUE_BYTES");
+	if(strcmp(fresh.output_spill_file, config->output_spill_file) != 0)
+		restart_needed(config, myname, "OUTPUT_SPILL_FILE");
+	if(strcmp(fresh.csv_file, config->csv_file) != 0)
+		restart_needed(config, myname, "CSV_FILE");
+	if(strcmp(fresh.json_fifo, config->json_fifo) != 0)
+		restart_needed(config, myname, "JSON_FIFO");
+	if(strcmp(fresh.json_spill_file, config->json_spill_file) != 0)
+		restart_needed(config, myname, "JSON_SPILL_FILE");
+	if(strcmp(fresh.binary_file, config->binary_file) != 0)
+		restart_needed(config, myname, "BINARY_FILE");
+	if(strcmp(fresh.binary_spill_file, config->binary_spill_file) != 0)
+		restart_needed(config, myname, "BINARY_SPILL_FILE");
+	if(fresh.sink_queue_bytes != config->sink_queue_bytes)
+		restart_needed(config, myname, "SINK_QUEUE_BYTES");
+	if(strcmp(fresh.trace_file_name, config->trace_file_name) != 0)
+		restart_needed(config, myname, "TRACE_FILE");
+	if(strcmp(fresh.log_file_name, config->log_file_name) != 0)
+		restart_needed(config, myname, "LOG_FILE_NAME");
+	if(fresh.write_log != config->write_log)
+		restart_needed(config, myname, "WRITE_LOG");
+	if(fresh.log_rotate_bytes != config->log_rotate_bytes)
+		restart_needed(config, myname, "LOG_ROTATE_BYTES");
+	if(fresh.log_rotate_seconds != config->log_rotate_seconds)
+		restart_needed(config, myname, "LOG_ROTATE_SECONDS");
+	if(fresh.log_rotate_keep != config->log_rotate_keep)
+		restart_needed(config, myname, "LOG_ROTATE_KEEP");
+	if(fresh.watch_config != config->watch_config)
+		restart_needed(config, myname, "WATCH_CONFIG");
+
+	new_interval = (poll_period_ms(&fresh) != poll_period_ms(config));
+
+	config->sensor_mask = fresh.sensor_mask;
+	config->sleep_seconds = fresh.sleep_seconds;
+	config->sleep_ms = fresh.sleep_ms;
+	config->block_reads = fresh.block_reads;
+	config->reset_amp_hrs = fresh.reset_amp_hrs;
+	config->device_id_stride = fresh.device_id_stride;
+	config->serial_timeout_ms = fresh.serial_timeout_ms;
+	config->serial_retries = fresh.serial_retries;
+	config->pipeline_depth = fresh.pipeline_depth;
+	config->sample_mask = fresh.sample_mask;
+	config->sample_id_base = fresh.sample_id_base;
+	config->analytics = fresh.analytics;
+	config->analytics_id_base = fresh.analytics_id_base;
+	config->battery_capacity_ah = fresh.battery_capacity_ah;
+	config->archive_samples = fresh.archive_samples;
+	config->log_level = fresh.log_level;
+	memcpy(config->sensor_period, fresh.sensor_period, sizeof(config->sensor_period));
+	memcpy(config->deadband, fresh.deadband, sizeof(config->deadband));
+	memcpy(config->deadband_relative, fresh.deadband_relative, sizeof(config->deadband_relative));
+	config->report_by_exception = fresh.report_by_exception;
+	config->heartbeat_seconds = fresh.heartbeat_seconds;
+	config->metadata_refresh_seconds = fresh.metadata_refresh_seconds;
+	config->output_spill_max_bytes = fresh.output_spill_max_bytes;
+	logger_set_level(config->log_level);
+
+	for(d = 0; d < count; d++)
+	{
+		pentametric[d].port.timeout_ms = config->serial_timeout_ms;
+		pentametric[d].port.retries = config->serial_retries;
+		apply_firmware_version(&pentametric[d], config, myname, "");
+		pentametric_plan(&pentametric[d], config, myname);
+	}
+
+	if(config->write_log)
+	{
+		sprintf(message_buffer, "Configuration reloaded from %s, polling at %g sec intervals", fresh.config_path, poll_period_ms(config) / 1000.0);
+		writelog(config->log_file_name, myname, message_buffer);
+	}
+	return new_interval ? 1 : 0;
+}
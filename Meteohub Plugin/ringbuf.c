@@ -0,0 +1,166 @@
+#include "mhpmpi.h"
+#include <sys/mman.h>
+
+/*
+	ringbuf.c
+
+	fixed size, memory mapped ring file of the most recent decoded values,
+	so a restart of meteohub or a stalled stdout pipe doesn't lose them.
+	Appending is a plain store into the mapping, no system call per value;
+	the dirty pages are flushed with one msync() after each poll.
+
+	Every record carries the low 32 bits of its sequence number (the head
+	count when it was written). After a power cut the header may have
+	reached the disk ahead of some records, so on open the head is walked
+	back past any record whose sequence number doesn't match.
+*/
+
+// first byte of the record area, rounded to a page so records never share the header page
+static size_t ring_records_offset(void)
+{
+	long page = sysconf(_SC_PAGESIZE);
+
+	return page > (long)sizeof(struct ring_header_t) ? (size_t)page : sizeof(struct ring_header_t);
+}
+
+// true if the record for seq is still in the ring and was completely written
+static boolean ring_valid(struct ring_t *ring, uint64_t seq)
+{
+	if(seq >= ring->header->head || ring->header->head - seq > ring->header->capacity)
+		return false;
+	return ring->record[seq % ring->header->capacity].seq == (uint32_t)seq;
+}
+
+/*
+	map the ring file, creating or resizing it when it doesn't match capacity
+
+	returns:	0 = OK, ring opened with existing records
+				1 = OK, new empty ring
+				-1 = file could not be opened or sized
+				-2 = file could not be mapped
+*/
+int ring_open(struct ring_t *ring, char *path, uint32_t capacity)
+{
+	struct stat st;
+	size_t offset = ring_records_offset();
+	boolean fresh = false;
+	void *map;
+
+	memset(ring, 0, sizeof(struct ring_t));
+	ring->fd = -1;
+	if(capacity == 0)
+		return -1;
+
+	ring->map_len = offset + (size_t)capacity * sizeof(struct ring_record_t);
+	if((ring->fd = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+		return -1;
+	if(fstat(ring->fd, &st) < 0 || (st.st_size != (off_t)ring->map_len && ftruncate(ring->fd, ring->map_len) < 0))
+	{
+		ring_close(ring);
+		return -1;
+	}
+
+	if((map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0)) == MAP_FAILED)
+	{
+		ring_close(ring);
+		return -2;
+	}
+	ring->header = (struct ring_header_t *)map;
+	ring->record = (struct ring_record_t *)((uint8_t *)map + offset);
+
+	// start over when the file is new or was laid out for a different capacity or record format
+	if(ring->header->magic != RING_MAGIC || ring->header->version != RING_VERSION ||
+		ring->header->record_size != sizeof(struct ring_record_t) || ring->header->capacity != capacity)
+	{
+		memset(map, 0, ring->map_len);
+		ring->header->magic = RING_MAGIC;
+		ring->header->version = RING_VERSION;
+		ring->header->record_size = sizeof(struct ring_record_t);
+		ring->header->capacity = capacity;
+		ring->header->head = 0;
+		fresh = true;
+	}
+
+	// drop records the header counted but that never made it to disk
+	while(ring->header->head > 0 && !ring_valid(ring, ring->header->head - 1))
+		ring->header->head--;
+
+	ring->synced = ring->header->head;
+	if(fresh)
+		ring_sync(ring);
+	return fresh ? 1 : 0;
+}
+
+void ring_close(struct ring_t *ring)
+{
+	if(ring->header != NULL)
+	{
+		ring_sync(ring);
+		munmap(ring->header, ring->map_len);
+	}
+	if(ring->fd >= 0)
+		close(ring->fd);
+	ring->header = NULL;
+	ring->record = NULL;
+	ring->fd = -1;
+}
+
+// store one value at the head of the ring
+void ring_append(struct ring_t *ring, struct timespec *ts, uint8_t device, uint8_t sensor, int32_t value)
+{
+	struct ring_record_t *rec;
+	uint64_t seq = ring->header->head;
+
+	rec = &ring->record[seq % ring->header->capacity];
+	rec->time = (uint32_t)ts->tv_sec;
+	rec->msec = (uint16_t)(ts->tv_nsec / 1000000);
+	rec->device = device;
+	rec->sensor = sensor;
+	rec->value = value;
+	rec->seq = (uint32_t)seq; // written last, marks the record complete
+	ring->header->head = seq + 1;
+}
+
+// flush the records written since the last sync and the header to disk
+void ring_sync(struct ring_t *ring)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	uint64_t head = ring->header->head;
+	uintptr_t first, last;
+	uint32_t capacity = ring->header->capacity;
+
+	if(head != ring->synced)
+	{
+		if(head - ring->synced >= capacity || ring->synced % capacity > (head - 1) % capacity)
+		{
+			// wrapped, flush the whole record area
+			first = (uintptr_t)ring->record;
+			last = (uintptr_t)&ring->record[capacity];
+		}
+		else
+		{
+			first = (uintptr_t)&ring->record[ring->synced % capacity];
+			last = (uintptr_t)&ring->record[(head - 1) % capacity + 1];
+		}
+		first &= ~(uintptr_t)(page - 1);
+		msync((void *)first, last - first, MS_SYNC);
+	}
+
+	msync(ring->header, sizeof(struct ring_header_t), MS_SYNC);
+	ring->synced = head;
+}
+
+// copy out the record for seq, returns false if it has been overwritten or was never completed
+boolean ring_get(struct ring_t *ring, uint64_t seq, struct ring_record_t *rec)
+{
+	if(!ring_valid(ring, seq))
+		return false;
+	*rec = ring->record[seq % ring->header->capacity];
+	return true;
+}
+
+// sequence number of the oldest record still in the ring
+uint64_t ring_tail(struct ring_t *ring)
+{
+	return ring->header->head > ring->header->capacity ? ring->header->head - ring->header->capacity : 0;
+}
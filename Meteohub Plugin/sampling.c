@@ -0,0 +1,58 @@
+#include "mhpmpi.h"
+#include <math.h>
+
+/*
+	sampling.c
+
+	running aggregates of the fast registers read between polls. Each
+	sampled sensor keeps its count, min, max, mean and sum of squared
+	differences from the mean (Welford's method), so memory stays the same
+	no matter how many samples fit in one poll interval.
+*/
+
+// start a new aggregation interval
+void sample_stat_reset(struct sample_stat_t *stat)
+{
+	stat->count = 0;
+	stat->min = INT32_MAX;
+	stat->max = INT32_MIN;
+	stat->mean = 0.0;
+	stat->m2 = 0.0;
+}
+
+// fold one decoded value into an aggregate
+void sample_stat_add(struct sample_stat_t *stat, int32_t value)
+{
+	double delta;
+
+	stat->count++;
+	if(value < stat->min)
+		stat->min = value;
+	if(value > stat->max)
+		stat->max = value;
+
+	delta = value - stat->mean;
+	stat->mean += delta / stat->count;
+	stat->m2 += delta * (value - stat->mean);
+}
+
+// population standard deviation of the values folded in so far
+double sample_stat_stddev(struct sample_stat_t *stat)
+{
+	return stat->count > 0 ? sqrt(stat->m2 / stat->count) : 0.0;
+}
+
+// decode every register of a finished sample read into its aggregate, skipping ones that failed
+void add_samples(struct poll_plan_t *sample, struct sample_stat_t *stat)
+{
+	struct poll_item_t *item;
+	uint8_t *msg;
+	uint8_t i;
+
+	for(i = 0; i < sample->count; i++)
+	{
+		item = &sample->item[i];
+		if((msg = get_plan_msg(&sample->read, item->address)) != NULL)
+			sample_stat_add(&stat[i], item->decode(msg));
+	}
+}
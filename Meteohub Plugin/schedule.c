@@ -0,0 +1,146 @@
+#include "mhpmpi.h"
+
+/*
+	schedule.c
+
+	per-sensor poll periods. Every item of a device's poll plan sits in a
+	min-heap keyed on the monotonic time it is next due. At each poll the
+	items that are due come off the heap and only their registers are
+	read, merged into as few short reads as build_read_plan() can manage.
+	The values of sensors that were not due stay in the poll plan's image,
+	so every output cycle still has every sensor.
+
+	A sensor whose read fails goes back on the heap still due and is
+	tried again next poll; a good read moves it a whole period on. Without
+	any PERIOD_* settings every sensor is due every poll and the device is
+	read exactly as before.
+*/
+
+static void heap_swap(struct schedule_t *s, uint8_t a, uint8_t b)
+{
+	struct schedule_entry_t t = s->heap[a];
+
+	s->heap[a] = s->heap[b];
+	s->heap[b] = t;
+}
+
+static void heap_push(struct schedule_t *s, uint8_t item, uint64_t due_ms)
+{
+	uint8_t i = s->count++, parent;
+
+	s->heap[i].due_ms = due_ms;
+	s->heap[i].item = item;
+	for(; i > 0; i = parent)
+	{
+		parent = (i - 1) / 2;
+		if(s->heap[parent].due_ms <= s->heap[i].due_ms)
+			break;
+		heap_swap(s, i, parent);
+	}
+}
+
+static struct schedule_entry_t heap_pop(struct schedule_t *s)
+{
+	struct schedule_entry_t top = s->heap[0];
+	uint8_t i = 0, child;
+
+	s->heap[0] = s->heap[--s->count];
+	for(;;)
+	{
+		child = 2 * i + 1;
+		if(child >= s->count)
+			break;
+		if(child + 1 < s->count && s->heap[child + 1].due_ms < s->heap[child].due_ms)
+			child++;
+		if(s->heap[i].due_ms <= s->heap[child].due_ms)
+			break;
+		heap_swap(s, i, child);
+		i = child;
+	}
+	return top;
+}
+
+/*
+	put every item of a poll plan on the heap, due now. period holds the
+	seconds between reads of each sensor bitmask bit, 0 for every poll.
+*/
+void schedule_init(struct schedule_t *s, struct poll_plan_t *poll, uint32_t *period)
+{
+	uint64_t now = monotonic_ms();
+	uint8_t i;
+
+	memset(s, 0, sizeof(struct schedule_t));
+	s->due_mask = UINT32_MAX; // no due plan built yet
+	for(i = 0; i < poll->count; i++)
+	{
+		s->period_ms[i] = period[poll->item[i].bit] * 1000ULL;
+		heap_push(s, i, now);
+	}
+}
+
+/*
+	take every item due by now + slack_ms off the heap and build the read
+	plan for them in due. The plan is only rebuilt when the set of due
+	sensors changed since the last poll.
+
+	returns the number of items due
+*/
+uint8_t schedule_take_due(struct schedule_t *s, struct poll_plan_t *poll, struct read_plan_t *due, boolean block_reads, uint64_t slack_ms)
+{
+	uint64_t horizon = monotonic_ms() + slack_ms;
+	uint32_t mask = 0;
+
+	s->taken = 0;
+	while(s->count > 0 && s->heap[0].due_ms <= horizon)
+	{
+		s->taken_entry[s->taken] = heap_pop(s);
+		mask |= poll->item[s->taken_entry[s->taken].item].sensor->mask;
+		s->taken++;
+	}
+
+	if(mask != s->due_mask)
+	{
+		build_read_plan(due, mask, block_reads);
+		s->due_mask = mask;
+	}
+	return s->taken;
+}
+
+/*
+	copy what the due read got into the poll plan's image and put the
+	items back on the heap: a period on from when they were due if the
+	read was good, still due if it wasn't.
+*/
+void schedule_put_back(struct schedule_t *s, struct poll_plan_t *poll, struct read_plan_t *due)
+{
+	struct read_plan_t *cache = &poll->read;
+	struct schedule_entry_t *entry;
+	uint64_t now = monotonic_ms();
+	uint8_t a, i;
+
+	for(a = 0; a <= PENTAMETRIC_MAX_DATA_ADDRESS; a++)
+	{
+		if(!cache->selected[a])
+			continue; // bridged over in either plan, nothing reads it
+		if(due->valid[a])
+		{
+			memcpy(&cache->image[cache->offset[a]], &due->image[due->offset[a]], get_register_length(a));
+			cache->valid[a] = true;
+		}
+		else if(due->selected[a])
+			cache->valid[a] = false; // was due and failed, don't keep showing the old value
+	}
+
+	for(i = 0; i < s->taken; i++)
+	{
+		entry = &s->taken_entry[i];
+		if(due->valid[poll->item[entry->item].address])
+		{
+			entry->due_ms += s->period_ms[entry->item];
+			if(entry->due_ms < now) // don't try to catch up on polls that were missed
+				entry->due_ms = now + s->period_ms[entry->item];
+		}
+		heap_push(s, entry->item, entry->due_ms);
+	}
+	s->taken = 0;
+}
@@ -0,0 +1,98 @@
+#include "mhpmpi.h"
+
+/*
+	sensors.c
+
+	registry of every Pentametric value mhpmpi can log. Each entry ties a
+	sensor bitmask bit to its register address, data length, decoder and
+	meteohub output kind. compile_poll_plan() turns the registry, the
+	sensor mask and the shunt configuration into a flat array, so the poll
+	loop never has to look at the mask or shunt sizes again.
+
+	Adding a register is one new line here plus its bitmask define.
+*/
+
+// registry in sensor bitmask order, which is also the meteohub sensor numbering order
+static const struct sensor_t sensor_registry[PENTAMETRIC_SENSOR_COUNT] =
+{
+	// mask									address											len	shunt		100A/only decoder	500A decoder		kind				name
+	{PENTAMETRIC_BATTERY1_VOLTS,				PENTAMETRIC_ADDRESS_BATTERY1_VOLTS,				2,	0,			decode_format1,		NULL,				SENSOR_KIND_DATA,	"battery1_volts"},
+	{PENTAMETRIC_BATTERY2_VOLTS,				PENTAMETRIC_ADDRESS_BATTERY2_VOLTS,				2,	0,			decode_format1,		NULL,				SENSOR_KIND_DATA,	"battery2_volts"},
+	{PENTAMETRIC_AVERAGE_BATTERY1_VOLTS,		PENTAMETRIC_ADDRESS_AVERAGE_BATTERY1_VOLTS,		2,	0,			decode_format1,		NULL,				SENSOR_KIND_DATA,	"average_battery1_volts"},
+	{PENTAMETRIC_AVERAGE_BATTERY2_VOLTS,		PENTAMETRIC_ADDRESS_AVERAGE_BATTERY2_VOLTS,		2,	0,			decode_format1,		NULL,				SENSOR_KIND_DATA,	"average_battery2_volts"},
+	{PENTAMETRIC_AMPS1,							PENTAMETRIC_ADDRESS_AMPS1,						3,	SHUNT1_500A,decode_format3,		decode_format2,		SENSOR_KIND_DATA,	"amps1"},
+	{PENTAMETRIC_AMPS2,							PENTAMETRIC_ADDRESS_AMPS2,						3,	SHUNT2_500A,decode_format3,		decode_format2,		SENSOR_KIND_DATA,	"amps2"},
+	{PENTAMETRIC_AMPS3,							PENTAMETRIC_ADDRESS_AMPS3,						3,	SHUNT3_500A,decode_format3,		decode_format2,		SENSOR_KIND_DATA,	"amps3"},
+	{PENTAMETRIC_AVERAGE_AMPS1,					PENTAMETRIC_ADDRESS_AVERAGE_AMPS1,				3,	SHUNT1_500A,decode_format3,		decode_format2,		SENSOR_KIND_DATA,	"average_amps1"},
+	{PENTAMETRIC_AVERAGE_AMPS2,					PENTAMETRIC_ADDRESS_AVERAGE_AMPS2,				3,	SHUNT2_500A,decode_format3,		decode_format2,		SENSOR_KIND_DATA,	"average_amps2"},
+	{PENTAMETRIC_AVERAGE_AMPS3,					PENTAMETRIC_ADDRESS_AVERAGE_AMPS3,				3,	SHUNT3_500A,decode_format3,		decode_format2,		SENSOR_KIND_DATA,	"average_amps3"},
+	{PENTAMETRIC_AMP_HOURS1,					PENTAMETRIC_ADDRESS_AMP_HOURS1,					3,	0,			decode_format3,		NULL,				SENSOR_KIND_DATA,	"amp_hours1"},
+	{PENTAMETRIC_AMP_HOURS2,					PENTAMETRIC_ADDRESS_AMP_HOURS2,					3,	0,			decode_format3,		NULL,				SENSOR_KIND_DATA,	"amp_hours2"},
+	{PENTAMETRIC_AMP_HOURS3,					PENTAMETRIC_ADDRESS_AMP_HOURS3,					4,	0,			decode_format4,		NULL,				SENSOR_KIND_DATA,	"amp_hours3"},
+	{PENTAMETRIC_CUM_AMP_HOURS1,				PENTAMETRIC_ADDRESS_CUM_AMP_HOURS1,				3,	SHUNT1_500A,decode_format3b,	decode_format2b,	SENSOR_KIND_DATA,	"cum_amp_hours1"},
+	{PENTAMETRIC_CUM_AMP_HOURS2,				PENTAMETRIC_ADDRESS_CUM_AMP_HOURS2,				3,	SHUNT2_500A,decode_format3b,	decode_format2b,	SENSOR_KIND_DATA,	"cum_amp_hours2"},
+	{PENTAMETRIC_WATTS1,						PENTAMETRIC_ADDRESS_WATTS1,						3,	SHUNT1_500A,decode_format3,		decode_format2,		SENSOR_KIND_DATA,	"watts1"},
+	{PENTAMETRIC_WATTS2,						PENTAMETRIC_ADDRESS_WATTS2,						3,	SHUNT2_500A,decode_format3,		decode_format2,		SENSOR_KIND_DATA,	"watts2"},
+	{PENTAMETRIC_WATT_HOURS1,					PENTAMETRIC_ADDRESS_WATT_HOURS1,				4,	0,			decode_format5,		NULL,				SENSOR_KIND_DATA,	"watt_hours1"},
+	{PENTAMETRIC_WATT_HOURS2,					PENTAMETRIC_ADDRESS_WATT_HOURS2,				4,	0,			decode_format5,		NULL,				SENSOR_KIND_DATA,	"watt_hours2"},
+	{PENTAMETRIC_BATTERY1_PERCENT_FULL,			PENTAMETRIC_ADDRESS_BATTERY1_PERCENT_FULL,		1,	0,			decode_format6,		NULL,				SENSOR_KIND_DATA,	"battery1_percent_full"},
+	{PENTAMETRIC_BATTERY2_PERCENT_FULL,			PENTAMETRIC_ADDRESS_BATTERY2_PERCENT_FULL,		1,	0,			decode_format6,		NULL,				SENSOR_KIND_DATA,	"battery2_percent_full"},
+	{PENTAMETRIC_DAYS_SINCE_BATTERY1_CHARGED,	PENTAMETRIC_ADDRESS_DAYS_SINCE_BATTERY1_CHARGED,	2,	0,			decode_format7,		NULL,				SENSOR_KIND_DATA,	"days_since_battery1_charged"},
+	{PENTAMETRIC_DAYS_SINCE_BATTERY2_CHARGED,	PENTAMETRIC_ADDRESS_DAYS_SINCE_BATTERY2_CHARGED,	2,	0,			decode_format7,		NULL,				SENSOR_KIND_DATA,	"days_since_battery2_charged"},
+	{PENTAMETRIC_DAYS_SINCE_BATTERY1_EQUALIZED,	PENTAMETRIC_ADDRESS_DAYS_SINCE_BATTERY1_EQUALIZED,	2,	0,			decode_format7,		NULL,				SENSOR_KIND_DATA,	"days_since_battery1_equalized"},
+	{PENTAMETRIC_DAYS_SINCE_BATTERY2_EQUALIZED,	PENTAMETRIC_ADDRESS_DAYS_SINCE_BATTERY2_EQUALIZED,	2,	0,			decode_format7,		NULL,				SENSOR_KIND_DATA,	"days_since_battery2_equalized"},
+	{PENTAMETRIC_TEMPERATURE,					PENTAMETRIC_ADDRESS_TEMPERATURE,				1,	0,			decode_format8,		NULL,				SENSOR_KIND_TEMP,	"temperature"}
+};
+
+// registry entry for a sensor bitmask bit number
+const struct sensor_t *get_sensor(uint8_t sensor_bit)
+{
+	return sensor_bit < PENTAMETRIC_SENSOR_COUNT ? &sensor_registry[sensor_bit] : NULL;
+}
+
+// data byte length of a register, 0 if it is not in the registry
+uint8_t get_register_length(uint8_t address)
+{
+	uint8_t i;
+
+	for(i = 0; i < PENTAMETRIC_SENSOR_COUNT; i++)
+		if(sensor_registry[i].address == address)
+			return sensor_registry[i].length;
+	return 0;
+}
+
+/*
+	compile the sensors selected in sensor_mask into a poll plan. The
+	decoder for shunt dependent values is picked here once from
+	shunt_select, and each item gets its meteohub sensor number counting
+	up from id_base for its kind.
+*/
+void compile_poll_plan(struct poll_plan_t *poll, uint32_t sensor_mask, uint8_t shunt_select, boolean block_reads, uint32_t *id_base)
+{
+	const struct sensor_t *sensor;
+	struct poll_item_t *item;
+	uint32_t next_id[SENSOR_KIND_COUNT];
+	uint8_t i;
+
+	for(i = 0; i < SENSOR_KIND_COUNT; i++)
+		next_id[i] = id_base[i];
+
+	memset(poll, 0, sizeof(struct poll_plan_t));
+
+	for(i = 0; i < PENTAMETRIC_SENSOR_COUNT; i++)
+	{
+		sensor = &sensor_registry[i];
+		if(!(sensor_mask & sensor->mask))
+			continue;
+
+		item = &poll->item[poll->count++];
+		item->sensor = sensor;
+		item->bit = i;
+		item->address = sensor->address;
+		item->kind = sensor->kind;
+		item->id = next_id[sensor->kind]++;
+		item->decode = (sensor->shunt & shunt_select) ? sensor->decode_500a : sensor->decode;
+	}
+
+	build_read_plan(&poll->read, sensor_mask, block_reads);
+}
@@ -0,0 +1,130 @@
+#include "mhpmpi.h"
+#include <poll.h>
+#include <errno.h>
+
+/*
+	serial.c
+
+	serial transport for the Pentametric: a non-blocking raw tty fd with
+	poll() based deadlines, so a lost byte costs one timeout instead of a
+	hung process, plus tcflush() resynchronisation after a bad frame.
+*/
+
+// milliseconds on the monotonic clock, unaffected by time of day changes
+uint64_t monotonic_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// deadline for a transaction of n bytes on the wire in both directions
+uint64_t serial_deadline(struct serial_port_t *port, uint16_t n)
+{
+	return monotonic_ms() + port->timeout_ms + (n * SERIAL_BYTE_USEC + 999) / 1000;
+}
+
+// open the tty in non-blocking raw mode, returns 0 or a set_tty_port() error code
+int serial_open(struct serial_port_t *port, char *device, char *myname, char *log_file_name, boolean writetolog)
+{
+	int error_code;
+
+	port->hangup = false;
+	strncpy(port->device, device, sizeof(port->device) - 1);
+	port->device[sizeof(port->device) - 1] = '\0';
+
+	if((port->fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK)) < 0)
+		return -4;
+
+	if(!isatty(port->fd))
+	{
+		serial_close(port);
+		return -5;
+	}
+
+	if((error_code = set_tty_port(port->fd, device, myname, log_file_name, writetolog)))
+	{
+		serial_close(port);
+		return error_code;
+	}
+
+	tcflush(port->fd, TCIOFLUSH); // drop anything left over from a previous owner of the port
+	trace_record(TRACE_OPEN, port->index, (const uint8_t *)port->device, strlen(port->device));
+	return 0;
+}
+
+void serial_close(struct serial_port_t *port)
+{
+	if(port->fd >= 0)
+		close(port->fd);
+	port->fd = -1;
+}
+
+// wait for the fd to become ready for events, false on timeout or hangup
+static boolean serial_wait(struct serial_port_t *port, short events, uint64_t deadline)
+{
+	struct pollfd pfd;
+	uint64_t now;
+	int rc;
+
+	pfd.fd = port->fd;
+	pfd.events = events;
+
+	for(;;)
+	{
+		now = monotonic_ms();
+		if(now >= deadline)
+			return false;
+
+		rc = poll(&pfd, 1, (int)(deadline - now));
+		if(rc < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			port->hangup = true;
+			return false;
+		}
+		if(rc == 0)
+			return false;
+		if(pfd.revents & (POLLERR | POLLNVAL))
+		{
+			port->hangup = true;
+			return false;
+		}
+		if(pfd.revents & events)
+			return true;
+		if(pfd.revents & POLLHUP)
+		{
+			port->hangup = true;
+			return false;
+		}
+	}
+}
+
+/*
+	get back in step with the device after a timeout or bad checksum.
+	Anything already queued is flushed, then late bytes of the abandoned
+	response are discarded until the line has been quiet for
+	SERIAL_QUIET_MS, so the next command starts on a frame boundary.
+*/
+void serial_resync(struct serial_port_t *port)
+{
+	uint8_t junk[64];
+	uint64_t give_up = monotonic_ms() + port->timeout_ms;
+	ssize_t rc;
+
+	port->resyncs++;
+	trace_record(TRACE_RESYNC, port->index, NULL, 0);
+	tcflush(port->fd, TCIOFLUSH);
+
+	while(!port->hangup && monotonic_ms() < give_up)
+	{
+		if(!serial_wait(port, POLLIN, monotonic_ms() + SERIAL_QUIET_MS))
+			break;
+		if((rc = read(port->fd, junk, sizeof(junk))) <= 0)
+			break;
+		trace_record(TRACE_RX, port->index, junk, rc);
+	}
+	tcflush(port->fd, TCIFLUSH);
+}
@@ -0,0 +1,353 @@
+#include "mhpmpi.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <errno.h>
+
+/*
+	server.c
+
+	unix domain socket that hands the latest poll cycle to local clients,
+	so dashboards and scripts never open the tty themselves. A client
+	connects and sends one command line:
+
+		snapshot	the latest cycle is sent and the connection closed
+		subscribe	the latest cycle is sent, then every new one as it is polled
+		stats		protocol statistics as of the latest cycle (see stats.c)
+
+	A cycle is sent as "time <unix seconds>", the same dataN/tN lines
+	written to meteohub, and an empty line.
+
+	Everything is non-blocking. A client that hasn't taken the previous
+	cycle when the next one is published simply misses it, so a slow
+	reader can never hold up a poll. The listening socket and the clients
+	live in their own epoll set, which the event loop watches as one fd.
+*/
+
+// stop watching a client and free its slot
+static void server_drop(struct server_t *server, uint8_t slot)
+{
+	struct server_client_t *client = server->client[slot];
+
+	epoll_ctl(server->epfd, EPOLL_CTL_DEL, client->fd, NULL);
+	close(client->fd);
+	free(client);
+	server->client[slot] = NULL;
+	server->clients--;
+}
+
+// send as much of a client's pending output as the socket takes, returns false if the client has to go
+static boolean server_flush(struct server_t *server, struct server_client_t *client)
+{
+	struct epoll_event ev;
+	ssize_t n;
+	uint32_t events;
+
+	while(client->out_done < client->out_len)
+	{
+		n = send(client->fd, client->out + client->out_done, client->out_len - client->out_done, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if(n < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return false;
+		}
+		client->out_done += n;
+	}
+
+	if(client->out_done == client->out_len)
+	{
+		client->out_len = client->out_done = 0;
+		if(!client->subscribed)
+			return false; // snapshot delivered, done
+	}
+
+	// only ask for EPOLLOUT while output is waiting
+	events = EPOLLIN | (client->out_len > 0 ? EPOLLOUT : 0);
+	if(events != client->events)
+	{
+		memset(&ev, 0, sizeof(ev));
+		ev.events = events;
+		ev.data.ptr = client;
+		epoll_ctl(server->epfd, EPOLL_CTL_MOD, client->fd, &ev);
+		client->events = events;
+	}
+	return true;
+}
+
+// queue the latest cycle for a client, returns false if there's still an older one waiting
+static boolean server_queue_snapshot(struct server_t *server, struct server_client_t *client)
+{
+	if(server->snapshot_len == 0)
+		return true; // nothing polled yet
+	if(client->out_len > 0)
+		return false;
+
+	memcpy(client->out, server->snapshot, server->snapshot_len);
+	client->out_len = server->snapshot_len;
+	client->out_done = 0;
+	return true;
+}
+
+// act on a complete command line from a client, returns false if the client has to go
+static boolean server_command(struct server_t *server, struct server_client_t *client, char *line)
+{
+	static const char unknown[] = "error unknown command, use snapshot, subscribe or stats\n";
+
+	if(strcmp(line, "stats") == 0)
+	{
+		memcpy(client->out, server->stats, server->stats_len);
+		client->out_len = server->stats_len;
+		client->out_done = 0;
+		client->answered = true;
+		return server_flush(server, client);
+	}
+	if(strcmp(line, "subscribe") == 0)
+		client->subscribed = true;
+	else if(strcmp(line, "snapshot") != 0)
+	{
+		send(client->fd, unknown, sizeof(unknown) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+		return false;
+	}
+
+	server_queue_snapshot(server, client);
+	client->answered = true;
+	return server_flush(server, client);
+}
+
+// read a client's command, returns false if the client has to go
+static boolean server_receive(struct server_t *server, struct server_client_t *client)
+{
+	char buffer[SERVER_COMMAND_BYTES];
+	char *eol;
+	ssize_t n, i;
+
+	n = recv(client->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+	if(n == 0)
+		return false; // client closed its end
+	if(n < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+	if(client->answered)
+		return true; // one command per connection, ignore the rest
+
+	for(i = 0; i < n; i++)
+	{
+		if(client->in_len >= sizeof(client->in) - 1)
+			return false; // no command is that long
+		client->in[client->in_len++] = buffer[i];
+		client->in[client->in_len] = '\0';
+		if((eol = strchr(client->in, '\n')) != NULL)
+		{
+			*eol = '\0';
+			if(eol > client->in && eol[-1] == '\r')
+				eol[-1] = '\0';
+			return server_command(server, client, client->in);
+		}
+	}
+	return true;
+}
+
+// take every pending connection, turning away any beyond SERVER_MAX_CLIENTS
+static void server_accept(struct server_t *server)
+{
+	struct server_client_t *client;
+	struct epoll_event ev;
+	uint8_t slot;
+	int fd;
+
+	while((fd = accept(server->listen_fd, NULL, NULL)) >= 0)
+	{
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+		for(slot = 0; slot < SERVER_MAX_CLIENTS && server->client[slot] != NULL; slot++)
+			;
+		if(slot == SERVER_MAX_CLIENTS || (client = (struct server_client_t *)calloc(1, sizeof(struct server_client_t))) == NULL)
+		{
+			server->refused++;
+			close(fd);
+			continue;
+		}
+
+		client->fd = fd;
+		client->accepted_ms = monotonic_ms();
+		client->events = EPOLLIN;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = client;
+		if(epoll_ctl(server->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		{
+			server->refused++;
+			close(fd);
+			free(client);
+			continue;
+		}
+		server->client[slot] = client;
+		server->clients++;
+	}
+}
+
+/*
+	create the listening socket, replacing a stale one left at path
+
+	returns:	0 = OK
+				-1 = socket could not be created or bound
+				-2 = epoll set could not be created
+*/
+int server_open(struct server_t *server, char *path)
+{
+	struct sockaddr_un addr;
+	struct epoll_event ev;
+
+	memset(server, 0, sizeof(struct server_t));
+	server->listen_fd = -1;
+	server->epfd = -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(addr.sun_path))
+		return -1;
+	strcpy(addr.sun_path, path);
+	strcpy(server->path, path);
+
+	unlink(path);
+	if((server->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+		bind(server->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		listen(server->listen_fd, SERVER_MAX_CLIENTS) < 0)
+	{
+		server_close(server);
+		return -1;
+	}
+	fcntl(server->listen_fd, F_SETFL, fcntl(server->listen_fd, F_GETFL) | O_NONBLOCK);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL; // the listening socket
+	if((server->epfd = epoll_create(SERVER_MAX_CLIENTS + 1)) < 0 || epoll_ctl(server->epfd, EPOLL_CTL_ADD, server->listen_fd, &ev) < 0)
+	{
+		server_close(server);
+		return -2;
+	}
+	return 0;
+}
+
+void server_close(struct server_t *server)
+{
+	uint8_t slot;
+
+	for(slot = 0; slot < SERVER_MAX_CLIENTS; slot++)
+		if(server->client[slot] != NULL)
+			server_drop(server, slot);
+	if(server->epfd >= 0)
+		close(server->epfd);
+	if(server->listen_fd >= 0)
+	{
+		close(server->listen_fd);
+		unlink(server->path);
+	}
+	server->epfd = -1;
+	server->listen_fd = -1;
+}
+
+/*
+	drop clients that connected SERVER_COMMAND_TIMEOUT_MS ago and still
+	haven't sent a command. The event loop calls this every time round,
+	not just when a client is ready, so a client that goes quiet is
+	dropped on time even when nobody else connects.
+
+	returns:	monotonic ms when the next client still waiting for its
+				command is due to be dropped, UINT64_MAX for none
+*/
+uint64_t server_expire(struct server_t *server)
+{
+	uint64_t now = monotonic_ms();
+	uint64_t next = UINT64_MAX;
+	uint8_t slot;
+
+	for(slot = 0; slot < SERVER_MAX_CLIENTS; slot++)
+	{
+		if(server->client[slot] == NULL || server->client[slot]->answered)
+			continue;
+		if(now - server->client[slot]->accepted_ms >= SERVER_COMMAND_TIMEOUT_MS)
+			server_drop(server, slot);
+		else if(server->client[slot]->accepted_ms + SERVER_COMMAND_TIMEOUT_MS < next)
+			next = server->client[slot]->accepted_ms + SERVER_COMMAND_TIMEOUT_MS;
+	}
+	return next;
+}
+
+/*
+	handle whatever is ready on the listening socket and the clients,
+	never blocks. Clients that never said what they want go first, so
+	they can't keep the slots from the ones that do.
+*/
+void server_service(struct server_t *server)
+{
+	struct epoll_event ev[SERVER_MAX_CLIENTS + 1];
+	struct server_client_t *client;
+	uint8_t slot;
+	int n, i;
+
+	server_expire(server);
+	n = epoll_wait(server->epfd, ev, SERVER_MAX_CLIENTS + 1, 0);
+	for(i = 0; i < n; i++)
+	{
+		if(ev[i].data.ptr == NULL)
+		{
+			server_accept(server);
+			continue;
+		}
+
+		client = (struct server_client_t *)ev[i].data.ptr;
+		if(((ev[i].events & (EPOLLERR | EPOLLHUP)) ||
+			((ev[i].events & EPOLLIN) && !server_receive(server, client)) ||
+			((ev[i].events & EPOLLOUT) && !server_flush(server, client))))
+		{
+			// slot lookup only on the way out, the client pointer is what epoll hands back
+			for(slot = 0; slot < SERVER_MAX_CLIENTS; slot++)
+				if(server->client[slot] == client)
+				{
+					server_drop(server, slot);
+					break;
+				}
+		}
+	}
+}
+
+// make a poll cycle the latest snapshot and push it to every subscriber
+void server_publish(struct server_t *server, char *text, uint32_t len)
+{
+	struct server_client_t *client;
+	uint8_t slot;
+	int n;
+
+	n = snprintf(server->snapshot, sizeof(server->snapshot), "time %ld\n", (long)time(NULL));
+	if(n + len + 1 > sizeof(server->snapshot))
+		len = sizeof(server->snapshot) - n - 1;
+	memcpy(server->snapshot + n, text, len);
+	server->snapshot[n + len] = '\n'; // empty line ends the cycle
+	server->snapshot_len = n + len + 1;
+
+	for(slot = 0; slot < SERVER_MAX_CLIENTS; slot++)
+	{
+		if((client = server->client[slot]) == NULL || !client->subscribed)
+			continue;
+		if(!server_queue_snapshot(server, client))
+		{
+			server->skipped++; // still sending the last one
+			continue;
+		}
+		if(!server_flush(server, client))
+			server_drop(server, slot);
+	}
+}
+
+// keep the latest protocol statistics for "stats" commands
+void server_publish_stats(struct server_t *server, char *text, uint32_t len)
+{
+	if(len > sizeof(server->stats))
+		len = sizeof(server->stats);
+	memcpy(server->stats, text, len);
+	server->stats_len = len;
+}
@@ -0,0 +1,131 @@
+#include "mhpmpi.h"
+#include <sys/mman.h>
+
+/*
+	shm.c
+
+	latest poll cycle published in a POSIX shared memory segment for
+	readers that want it without a system call. The segment is one
+	struct shm_segment_t guarded by a sequence lock:
+
+		writer:	seq becomes odd, the data is written, seq becomes even
+		reader:	read seq, copy the data, read seq again, and keep the copy
+				only if both reads were the same even number
+
+	The writer never waits for a reader, and a reader never blocks the
+	writer; it just copies again in the rare case a publish overlapped.
+	shm_snapshot_copy() does the reader side for C programs that include
+	mhpmpi.h.
+*/
+
+/*
+	create or open the segment, sized and stamped for this layout
+
+	returns:	0 = OK
+				-1 = segment could not be opened or sized
+				-2 = segment could not be mapped
+*/
+int shm_open_segment(struct shm_t *shm, char *name)
+{
+	void *map;
+
+	memset(shm, 0, sizeof(struct shm_t));
+	strncpy(shm->name, name, sizeof(shm->name) - 1);
+
+	if((shm->fd = shm_open(name, O_RDWR | O_CREAT, 0644)) < 0)
+		return -1;
+	if(ftruncate(shm->fd, sizeof(struct shm_segment_t)) < 0)
+	{
+		shm_close_segment(shm);
+		return -1;
+	}
+	if((map = mmap(NULL, sizeof(struct shm_segment_t), PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0)) == MAP_FAILED)
+	{
+		shm_close_segment(shm);
+		return -2;
+	}
+	shm->segment = (struct shm_segment_t *)map;
+
+	// a reader seeing the old layout mid-change retries on the odd seq
+	__atomic_store_n(&shm->segment->seq, shm->segment->seq | 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memset((uint8_t *)shm->segment + sizeof(shm->segment->seq), 0, sizeof(struct shm_segment_t) - sizeof(shm->segment->seq));
+	shm->segment->magic = SHM_MAGIC;
+	shm->segment->version = SHM_VERSION;
+	shm->segment->size = sizeof(struct shm_segment_t);
+	__atomic_store_n(&shm->segment->seq, shm->segment->seq + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+// unmap the segment, it stays behind with its last snapshot for readers
+void shm_close_segment(struct shm_t *shm)
+{
+	if(shm->segment != NULL)
+		munmap(shm->segment, sizeof(struct shm_segment_t));
+	if(shm->fd >= 0)
+		close(shm->fd);
+	shm->segment = NULL;
+	shm->fd = -1;
+}
+
+// publish the configuration and latest poll of every device
+void shm_publish(struct shm_t *shm, struct pentametric_t *pentametric, uint8_t count)
+{
+	struct shm_segment_t *seg = shm->segment;
+	struct shm_device_t *dev;
+	struct poll_item_t *item;
+	struct timespec ts;
+	uint8_t *msg;
+	uint32_t seq;
+	uint8_t d, i;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	seq = seg->seq;
+	__atomic_store_n(&seg->seq, seq + 1, __ATOMIC_RELAXED); // odd: update in progress
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	seg->device_count = count;
+	seg->time_ms = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	seg->cycles++;
+	for(d = 0; d < count && d < PENTAMETRIC_MAX_DEVICES; d++)
+	{
+		dev = &seg->device[d];
+		strncpy(dev->device, pentametric[d].port.device, sizeof(dev->device) - 1);
+		dev->firmware_version = pentametric[d].firmware_version;
+		dev->shunt_select = pentametric[d].shunt_select;
+		dev->shunt_labels = pentametric[d].shunt_labels;
+		dev->hangup = pentametric[d].port.hangup;
+		dev->valid = 0;
+		for(i = 0; i < pentametric[d].poll.count; i++)
+		{
+			item = &pentametric[d].poll.item[i];
+			if((msg = get_plan_msg(&pentametric[d].poll.read, item->address)) == NULL)
+				continue;
+			dev->value[item->bit] = item->decode(msg);
+			dev->valid |= 1UL << item->bit;
+		}
+	}
+
+	__atomic_store_n(&seg->seq, seq + 2, __ATOMIC_RELEASE); // even: consistent again
+}
+
+// reader side: take a consistent copy of a mapped segment, returns false if the writer kept it busy
+boolean shm_snapshot_copy(const struct shm_segment_t *seg, struct shm_segment_t *copy)
+{
+	uint32_t before, after;
+	uint16_t tries;
+
+	for(tries = 0; tries < 1000; tries++)
+	{
+		before = __atomic_load_n(&seg->seq, __ATOMIC_ACQUIRE);
+		if(before & 1)
+			continue; // publish in progress
+		memcpy(copy, seg, sizeof(struct shm_segment_t));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		after = __atomic_load_n(&seg->seq, __ATOMIC_RELAXED);
+		if(before == after)
+			return copy->magic == SHM_MAGIC && copy->version == SHM_VERSION;
+	}
+	return false;
+}
@@ -0,0 +1,364 @@
+#include "mhpmpi.h"
+#include <math.h>
+#include <errno.h>
+
+/*
+	sink.c
+
+	fan out of each poll cycle. When every device has finished, the cycle
+	is decoded once into points, one for each value meteohub would get:
+	the polled sensors, the sample aggregates and the analytics. Every
+	sink renders the points its own way and queues the text on its own
+	output queue (output.c):
+
+		meteohub	dataN/tN lines on stdout, always on
+		CSV_FILE	a time,device,sensor,id,value row per value
+		JSON_FIFO	a JSON object per device per cycle
+		BINARY_FILE	a 16 byte struct sink_record_t per value
+
+	The event loop watches the file of each sink on its own, so a sink
+	whose reader falls behind only fills its own queue. What happens then
+	is the sink's backpressure policy: with a spill file (OUTPUT_SPILL_FILE
+	for meteohub, JSON_SPILL_FILE, BINARY_SPILL_FILE) the queue carries on
+	on disk, without one the cycles that don't fit are dropped whole.
+	Either way the other sinks and the polls carry on.
+
+	A sink path that is a FIFO is opened read-write, so a reader coming
+	and going never closes it under mhpmpi or raises SIGPIPE; while nobody
+	reads it the pipe fills up and the policy takes over. JSON_FIFO is
+	made a FIFO when it doesn't exist, the other paths regular files that
+	are appended to.
+
+	Binary records carry meteohub units. CSV and JSON have the sensor's
+	own units, volts, amps and so on, with 2 decimals, 1 for temperature.
+	A value that couldn't be read is an empty CSV field, a JSON null and
+	a record with SINK_RECORD_FAILED set.
+*/
+
+static const char *const sample_suffix[SAMPLE_STAT_COUNT] = {"_min", "_max", "_mean", "_stddev"};
+static const char *const kind_prefix[SENSOR_KIND_COUNT] = {"data", "t"}; // indexed by SENSOR_KIND_*
+static const uint8_t kind_decimals[SENSOR_KIND_COUNT] = {2, 1};
+
+/*
+	open a sink of kind SINK_*, the meteohub sink is stdout and has no path
+
+	returns:	0 = OK
+				-1 = path could not be opened
+				-2 = no memory for the queue
+				-3 = spill file could not be opened, the sink drops what doesn't fit instead
+				-4 = the JSON FIFO could not be created
+*/
+int sink_open(struct sink_t *sink, uint8_t kind, const char *path, uint32_t queue_bytes, const char *spill_name, uint32_t spill_max)
+{
+	static const char csv_header[] = "time,device,sensor,id,value\n";
+	struct stat st;
+	int fd, error_code;
+
+	memset(sink, 0, sizeof(struct sink_t));
+	sink->kind = kind;
+	if(kind == SINK_METEOHUB)
+	{
+		strcpy(sink->path, "stdout");
+		fd = STDOUT_FILENO;
+	}
+	else
+	{
+		snprintf(sink->path, sizeof(sink->path), "%s", path);
+		if(kind == SINK_JSON && stat(path, &st) < 0 && errno == ENOENT && mkfifo(path, 0644) < 0)
+			return -4; // don't let the open below make a regular file of it
+		if(stat(path, &st) == 0 && S_ISFIFO(st.st_mode))
+		{
+			sink->fifo = true;
+			fd = open(path, O_RDWR | O_CLOEXEC);
+		}
+		else
+			fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if(fd < 0)
+			return -1;
+		if(queue_bytes < SINK_TEXT_BYTES) // room for a whole rendered cycle
+			queue_bytes = SINK_TEXT_BYTES;
+	}
+
+	if((error_code = output_queue_open(&sink->queue, fd, queue_bytes, spill_name, spill_max)) == -1)
+	{
+		if(fd != STDOUT_FILENO)
+			close(fd);
+		return -2;
+	}
+	if(kind == SINK_CSV && !sink->fifo && fstat(fd, &st) == 0 && st.st_size == 0)
+		output_queue_put(&sink->queue, csv_header, sizeof(csv_header) - 1);
+	return error_code < 0 ? -3 : 0;
+}
+
+/*
+	write out or keep what a sink has queued, see output_queue_close(),
+	and close its file
+
+	returns bytes that were neither written nor kept
+*/
+uint64_t sink_close(struct sink_t *sink)
+{
+	int fd = sink->queue.fd;
+	uint64_t lost;
+
+	lost = output_queue_close(&sink->queue);
+	if(sink->kind != SINK_METEOHUB)
+		close(fd);
+	return lost;
+}
+
+static void set_point(struct sink_point_t *p, const char *name, const char *suffix, uint32_t id, int32_t value, uint8_t device, uint8_t kind, boolean ok)
+{
+	p->name = name;
+	p->suffix = suffix;
+	p->id = id;
+	p->value = ok ? value : -SHRT_MAX;
+	p->device = device;
+	p->kind = kind;
+	p->ok = ok;
+	p->report = true;
+}
+
+/*
+	decode the latest poll cycle of every device into points. With
+	exceptions set, deadbanded sensors are only reported to meteohub when
+	they changed enough or are due a heartbeat, and never as a failed
+	read; the other sinks get every point.
+*/
+void sink_cycle_build(struct sink_cycle_t *cycle, struct pentametric_t *pentametric, uint8_t count, struct config_t *exceptions)
+{
+	struct pentametric_t *pm;
+	struct poll_item_t *item;
+	struct sample_stat_t *stat;
+	struct sink_point_t *p = cycle->point;
+	int32_t value[ANALYTICS_COUNT > SAMPLE_STAT_COUNT ? ANALYTICS_COUNT : SAMPLE_STAT_COUNT];
+	uint64_t now = monotonic_ms();
+	uint8_t *msg;
+	uint8_t d, i, j;
+
+	clock_gettime(CLOCK_REALTIME, &cycle->time);
+	for(d = 0; d < count; d++)
+	{
+		pm = &pentametric[d];
+		cycle->device[d] = pm->port.device;
+
+		for(i = 0; i < pm->poll.count; i++, p++)
+		{
+			item = &pm->poll.item[i];
+			msg = get_plan_msg(&pm->poll.read, item->address);
+			set_point(p, item->sensor->name, "", item->id, msg != NULL ? item->decode(msg) : 0, d, item->kind, msg != NULL);
+			if(exceptions != NULL && exceptions->deadband[item->bit] >= 0)
+				p->report = p->ok && report_changed(&pm->report_state[i], p->value, exceptions->deadband[item->bit],
+					exceptions->deadband_relative[item->bit], exceptions->heartbeat_seconds * 1000ULL, now);
+		}
+
+		// min, max, mean and stddev of each sampled sensor over the interval
+		for(i = 0; i < pm->sample.count; i++)
+		{
+			stat = &pm->report[i];
+			if(stat->count > 0)
+			{
+				value[0] = stat->min;
+				value[1] = stat->max;
+				value[2] = (int32_t)lround(stat->mean);
+				value[3] = (int32_t)lround(sample_stat_stddev(stat));
+			}
+			for(j = 0; j < SAMPLE_STAT_COUNT; j++, p++)
+				set_point(p, pm->sample.item[i].sensor->name, sample_suffix[j], pm->sample_id_base + i * SAMPLE_STAT_COUNT + j,
+					value[j], d, SENSOR_KIND_DATA, stat->count > 0);
+		}
+
+		if(pm->analytics.enabled)
+		{
+			analytics_values(&pm->analytics, value);
+			for(j = 0; j < ANALYTICS_COUNT; j++, p++)
+				set_point(p, analytics_name[j], "", pm->analytics.id_base + j, value[j], d, SENSOR_KIND_DATA, value[j] != -SHRT_MAX);
+		}
+	}
+	cycle->count = p - cycle->point;
+}
+
+/*
+	a decoded cycle as meteohub dataN/tN lines, only the points reported
+	to meteohub this cycle unless all is set
+
+	returns the text length
+*/
+uint32_t sink_format_meteohub(const struct sink_cycle_t *cycle, char *text, uint32_t size, boolean all)
+{
+	const struct sink_point_t *p;
+	uint32_t len = 0;
+
+	for(p = cycle->point; p < cycle->point + cycle->count; p++)
+		if(all || p->report)
+			len = format_line(text, size, len, kind_prefix[p->kind], p->id, p->value);
+	return len;
+}
+
+// "2026-01-31T12:00:00.000Z" written at p, returns the length
+static uint32_t format_time(char *p, const struct timespec *ts)
+{
+	struct tm tm;
+	uint32_t n;
+
+	gmtime_r(&ts->tv_sec, &tm);
+	n = strftime(p, 24, "%Y-%m-%dT%H:%M:%S", &tm);
+	p[n++] = '.';
+	p[n++] = '0' + ts->tv_nsec / 100000000;
+	p[n++] = '0' + ts->tv_nsec / 10000000 % 10;
+	p[n++] = '0' + ts->tv_nsec / 1000000 % 10;
+	p[n++] = 'Z';
+	return n;
+}
+
+static char *put(char *p, const char *s, uint32_t n)
+{
+	memcpy(p, s, n);
+	return p + n;
+}
+
+// returns the text length, rows that don't fit are left out
+static uint32_t format_csv(const struct sink_cycle_t *cycle, char *text, uint32_t size)
+{
+	const struct sink_point_t *pt;
+	char time[32], *p = text;
+	uint32_t time_len = format_time(time, &cycle->time);
+	uint32_t device_len, name_len, suffix_len;
+
+	for(pt = cycle->point; pt < cycle->point + cycle->count; pt++)
+	{
+		device_len = strlen(cycle->device[pt->device]);
+		name_len = strlen(pt->name);
+		suffix_len = strlen(pt->suffix);
+		if((uint32_t)(p - text) + time_len + device_len + name_len + suffix_len + OUTPUT_MAX_LINE_NUMBERS + 4 > size)
+			continue;
+
+		p = put(p, time, time_len);
+		*p++ = ',';
+		p = put(p, cycle->device[pt->device], device_len);
+		*p++ = ',';
+		p = put(p, pt->name, name_len);
+		p = put(p, pt->suffix, suffix_len);
+		*p++ = ',';
+		p += format_uint(p, pt->id);
+		*p++ = ',';
+		if(pt->ok)
+			p += format_fixed(p, pt->value, kind_decimals[pt->kind]);
+		*p++ = '\n';
+	}
+	return p - text;
+}
+
+// s as a JSON string at p, returns the length, at most 6 * strlen(s) + 2
+static uint32_t format_json_string(char *p, const char *s)
+{
+	static const char hex[] = "0123456789abcdef";
+	char *start = p;
+
+	*p++ = '"';
+	for(; *s; s++)
+	{
+		if(*s == '"' || *s == '\\')
+		{
+			*p++ = '\\';
+			*p++ = *s;
+		}
+		else if((unsigned char)*s < 0x20)
+		{
+			p = put(p, "\\u00", 4);
+			*p++ = hex[(unsigned char)*s >> 4];
+			*p++ = hex[*s & 0x0f];
+		}
+		else
+			*p++ = *s;
+	}
+	*p++ = '"';
+	return p - start;
+}
+
+// returns the text length, devices and values that don't fit are left out
+static uint32_t format_json(const struct sink_cycle_t *cycle, char *text, uint32_t size)
+{
+	const struct sink_point_t *pt = cycle->point, *end = cycle->point + cycle->count;
+	char time[32], *p = text;
+	uint32_t time_len = format_time(time, &cycle->time);
+	uint32_t name_len, suffix_len;
+	uint8_t d;
+
+	while(pt < end)
+	{
+		d = pt->device;
+		if((uint32_t)(p - text) + time_len + strlen(cycle->device[d]) * 6 + 32 > size)
+			break;
+
+		p = put(p, "{\"time\":\"", 9);
+		p = put(p, time, time_len);
+		p = put(p, "\",\"device\":", 11);
+		p += format_json_string(p, cycle->device[d]);
+		for(; pt < end && pt->device == d; pt++)
+		{
+			name_len = strlen(pt->name);
+			suffix_len = strlen(pt->suffix);
+			if((uint32_t)(p - text) + name_len + suffix_len + OUTPUT_MAX_LINE_NUMBERS + 8 > size) // keeps room for the closing brace
+				continue;
+			p = put(p, ",\"", 2);
+			p = put(p, pt->name, name_len);
+			p = put(p, pt->suffix, suffix_len);
+			p = put(p, "\":", 2);
+			if(pt->ok)
+				p += format_fixed(p, pt->value, kind_decimals[pt->kind]);
+			else
+				p = put(p, "null", 4);
+		}
+		p = put(p, "}\n", 2);
+	}
+	return p - text;
+}
+
+// returns the length, records that don't fit are left out
+static uint32_t format_binary(const struct sink_cycle_t *cycle, char *text, uint32_t size)
+{
+	const struct sink_point_t *pt;
+	struct sink_record_t rec;
+	uint32_t len = 0;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.time = (uint32_t)cycle->time.tv_sec;
+	rec.msec = (uint16_t)(cycle->time.tv_nsec / 1000000);
+	for(pt = cycle->point; pt < cycle->point + cycle->count && len + sizeof(rec) <= size; pt++)
+	{
+		rec.device = pt->device;
+		rec.kind = pt->kind | (pt->ok ? 0 : SINK_RECORD_FAILED);
+		rec.id = pt->id;
+		rec.value = pt->value;
+		memcpy(text + len, &rec, sizeof(rec));
+		len += sizeof(rec);
+	}
+	return len;
+}
+
+// a meteohub cycle with every line as long as it gets, rendered by sink_publish() below
+_Static_assert(SNAPSHOT_MAX_BYTES <= SINK_TEXT_BYTES, "a whole meteohub cycle must fit the sink text buffer");
+
+/*
+	render a decoded cycle the sink's way and queue it, the event loop
+	writes it out as the sink's file takes it
+
+	returns:	true = queued
+				false = the sink's queue is full, the cycle was dropped
+*/
+boolean sink_publish(struct sink_t *sink, const struct sink_cycle_t *cycle)
+{
+	static char text[SINK_TEXT_BYTES];
+	uint32_t len;
+
+	if(sink->kind == SINK_CSV)
+		len = format_csv(cycle, text, sizeof(text));
+	else if(sink->kind == SINK_JSON)
+		len = format_json(cycle, text, sizeof(text));
+	else if(sink->kind == SINK_BINARY)
+		len = format_binary(cycle, text, sizeof(text));
+	else
+		len = sink_format_meteohub(cycle, text, sizeof(text), false);
+	return output_queue_put(&sink->queue, text, len);
+}
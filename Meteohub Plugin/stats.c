@@ -0,0 +1,163 @@
+#include "mhpmpi.h"
+
+/*
+	stats.c
+
+	protocol statistics, so a site with gaps in its data can tell a bad
+	cable (checksum errors), a dead adapter (timeouts on everything) and a
+	slow Pentametric (latency creeping up) apart. The pipeline counts
+	requests, checksum errors, timeouts, retries and requests given up on
+	for each register address, and the round trip time of every good
+	response goes into a histogram for that address. The event loop keeps
+	one more histogram of whole poll cycle durations, the timer queue
+	counts the poll boundaries cycles overran, and each output sink how
+	often its reader stopped reading and what piled up while it did.
+
+	Histograms have STATS_LATENCY_BUCKETS power of two buckets in
+	milliseconds, so everything lives in fixed memory inside each
+	serial_port_t no matter how long mhpmpi runs.
+
+	The text from stats_format() is logged on SIGUSR1 and on exit, and is
+	what the socket server answers to a "stats" command.
+*/
+
+// microseconds on the monotonic clock
+uint64_t monotonic_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// counters of the slot an address belongs to, config and reset addresses share the last one
+struct address_stats_t *address_stats(struct serial_port_t *port, uint8_t address)
+{
+	return &port->stats[address <= PENTAMETRIC_MAX_DATA_ADDRESS ? address : STATS_ADDRESS_SLOTS - 1];
+}
+
+void histogram_add(struct histogram_t *h, uint64_t us)
+{
+	uint64_t ms = us / 1000;
+	uint8_t b = 0;
+
+	while(ms > 0 && b < STATS_LATENCY_BUCKETS - 1) // bucket b > 0 holds 2^(b-1) <= ms < 2^b
+	{
+		ms >>= 1;
+		b++;
+	}
+	h->bucket[b]++;
+	h->count++;
+	h->sum_us += us;
+	if(us > h->max_us)
+		h->max_us = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+}
+
+// append " avg <ms> max <ms> <1:n <2:n ..." for the buckets in use
+static int format_histogram(char *text, size_t size, const struct histogram_t *h)
+{
+	int n, len;
+	uint8_t b;
+
+	if(h->count == 0)
+		return snprintf(text, size, " none");
+
+	len = snprintf(text, size, " avg %.1f max %.1f", h->sum_us / 1000.0 / h->count, h->max_us / 1000.0);
+	for(b = 0; b < STATS_LATENCY_BUCKETS && len < (int)size; b++)
+	{
+		if(h->bucket[b] == 0)
+			continue;
+		if(b == STATS_LATENCY_BUCKETS - 1)
+			n = snprintf(text + len, size - len, " >=%u:%u", 1U << (b - 1), h->bucket[b]);
+		else
+			n = snprintf(text + len, size - len, " <%u:%u", 1U << b, h->bucket[b]);
+		len += n;
+	}
+	return len;
+}
+
+/*
+	every device's counters as text, one line per address that has been
+	asked for anything, one line for the poll timer, one line per output
+	sink and one line for the poll cycle durations.
+
+	returns the text length, lines that don't fit are left out
+*/
+uint32_t stats_format(char *text, uint32_t size, struct pentametric_t *pentametric, uint8_t count, const struct histogram_t *cycle, const struct timer_queue_t *timer, const struct sink_t *sink, uint8_t sinks)
+{
+	char line[512];
+	struct serial_port_t *port;
+	struct address_stats_t *s;
+	uint32_t len = 0;
+	uint8_t d, a;
+	int n;
+
+	for(d = 0; d < count; d++)
+	{
+		port = &pentametric[d].port;
+		n = snprintf(line, sizeof(line), "stats %s timeouts %u checksum_errors %u retries %u resyncs %u\n",
+			port->device, port->timeouts, port->checksum_errors, port->retried, port->resyncs);
+		if(len + n < size)
+			len += sprintf(text + len, "%s", line);
+
+		for(a = 0; a < STATS_ADDRESS_SLOTS; a++)
+		{
+			s = &port->stats[a];
+			if(s->requests == 0)
+				continue;
+			if(a == STATS_ADDRESS_SLOTS - 1)
+				n = snprintf(line, sizeof(line), "stats %s address other", port->device);
+			else
+				n = snprintf(line, sizeof(line), "stats %s address 0x%02x", port->device, a);
+			n += snprintf(line + n, sizeof(line) - n, " requests %u checksum_errors %u timeouts %u retries %u failed %u latency_ms",
+				s->requests, s->checksum_errors, s->timeouts, s->retries, s->failed);
+			n += format_histogram(line + n, sizeof(line) - n - 1, &s->latency);
+			if(n > (int)sizeof(line) - 2)
+				n = sizeof(line) - 2;
+			line[n++] = '\n';
+			line[n] = '\0';
+			if(len + n < size)
+				len += sprintf(text + len, "%s", line);
+		}
+	}
+
+	n = snprintf(line, sizeof(line), "stats timer period_ms %u polls %llu overruns %llu clock_changes %u\n",
+		timer->period_ms, (unsigned long long)timer->polls, (unsigned long long)timer->overruns, timer->clock_changes);
+	if(len + n < size)
+		len += sprintf(text + len, "%s", line);
+
+	for(d = 0; d < sinks; d++)
+	{
+		n = snprintf(line, sizeof(line), "stats sink %s queued %llu spilled %llu dropped %u stalls %u\n", sink[d].path,
+			(unsigned long long)output_queue_bytes(&sink[d].queue), (unsigned long long)sink[d].queue.spilled, sink[d].queue.dropped, sink[d].queue.stalls);
+		if(len + n < size)
+			len += sprintf(text + len, "%s", line);
+	}
+
+	n = snprintf(line, sizeof(line), "stats cycles %u duration_ms", cycle->count);
+	n += format_histogram(line + n, sizeof(line) - n - 1, cycle);
+	if(n > (int)sizeof(line) - 2)
+		n = sizeof(line) - 2;
+	line[n++] = '\n';
+	line[n] = '\0';
+	if(len + n < size)
+		len += sprintf(text + len, "%s", line);
+	return len;
+}
+
+// write the stats to the log, one log line per stats line
+void stats_log(struct config_t *config, struct pentametric_t *pentametric, uint8_t count, const struct histogram_t *cycle, const struct timer_queue_t *timer, const struct sink_t *sink, uint8_t sinks, char *myname)
+{
+	static char text[STATS_TEXT_BYTES];
+	char *line, *eol;
+
+	if(!config->write_log)
+		return;
+
+	text[stats_format(text, sizeof(text), pentametric, count, cycle, timer, sink, sinks)] = '\0';
+	for(line = text; (eol = strchr(line, '\n')) != NULL; line = eol + 1)
+	{
+		*eol = '\0';
+		writelog(config->log_file_name, myname, line);
+	}
+}
@@ -0,0 +1,192 @@
+#include "mhpmpi.h"
+#include <sys/timerfd.h>
+#include <errno.h>
+
+/*
+	timer.c
+
+	timed jobs of the event loop: the next poll, the midnight amp hour
+	reset and the next metadata refresh each have an absolute deadline on
+	CLOCK_REALTIME, and one timerfd is armed for the earliest of them. The
+	loop gets the jobs that are due back as a bitmask and hands the work
+	to the devices, which do it between their reads, so no job ever blocks
+	the loop.
+
+	Polls are on even boundaries of the poll period counted from local
+	midnight, and on local midnight itself, so there is always a poll
+	that captures the day's totals just before the amp hour reset that
+	comes due at the same time. The poll deadline is armed again from the
+	clock after every cycle rather than by adding up sleeps, so the polls
+	never drift, and a cycle that runs past one or more boundaries is
+	counted as an overrun instead of shifting the ones after it.
+
+	Midnight is found with mktime(), so days with a daylight saving change
+	have their 23 or 25 hours. When the clock is set (NTP stepping it, or
+	by hand) the kernel cancels the timer, and the poll and the midnight
+	jobs are worked out again from the new time.
+*/
+
+// poll period from SLEEP_MS, or from SLEEP_SECONDS when that isn't set
+uint32_t poll_period_ms(const struct config_t *config)
+{
+	return config->sleep_ms ? config->sleep_ms : config->sleep_seconds * 1000U;
+}
+
+// realtime in ms
+static uint64_t realtime_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// realtime in ms of local midnight at the start of the day that time_ms is in, days later
+static uint64_t local_midnight_ms(uint64_t time_ms, int days)
+{
+	struct tm tm;
+	time_t t = time_ms / 1000;
+
+	localtime_r(&t, &tm);
+	tm.tm_sec = 0;
+	tm.tm_min = 0;
+	tm.tm_hour = 0;
+	tm.tm_mday += days;
+	tm.tm_isdst = -1; // let mktime work out whether that midnight is in daylight saving time
+	return (uint64_t)mktime(&tm) * 1000;
+}
+
+// arm the timerfd for the earliest job, or disarm it when none is scheduled
+static void arm_earliest(struct timer_queue_t *q)
+{
+	struct itimerspec its;
+	uint64_t earliest = 0;
+	uint8_t job;
+
+	for(job = 0; job < JOB_COUNT; job++)
+		if(q->due_ms[job] != 0 && (earliest == 0 || q->due_ms[job] < earliest))
+			earliest = q->due_ms[job];
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = earliest / 1000;
+	its.it_value.tv_nsec = (earliest % 1000) * 1000000;
+	if(timerfd_settime(q->fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL) < 0)
+		timerfd_settime(q->fd, TFD_TIMER_ABSTIME, &its, NULL); // kernels before 3.0 can't cancel on a clock change
+}
+
+// returns the timerfd, or -1 if it could not be created
+int timer_queue_open(struct timer_queue_t *q)
+{
+	memset(q, 0, sizeof(struct timer_queue_t));
+	q->fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+	return q->fd;
+}
+
+void timer_queue_close(struct timer_queue_t *q)
+{
+	if(q->fd >= 0)
+		close(q->fd);
+	q->fd = -1;
+}
+
+// schedule a job at an absolute realtime in ms, replacing any deadline it had
+void timer_queue_schedule(struct timer_queue_t *q, uint8_t job, uint64_t due_ms)
+{
+	q->due_ms[job] = due_ms;
+	arm_earliest(q);
+}
+
+// schedule a job ms from now
+void timer_queue_after(struct timer_queue_t *q, uint8_t job, uint64_t ms)
+{
+	timer_queue_schedule(q, job, realtime_ms() + ms);
+}
+
+// schedule a job at the coming local midnight
+void timer_queue_at_midnight(struct timer_queue_t *q, uint8_t job)
+{
+	timer_queue_schedule(q, job, local_midnight_ms(realtime_ms(), 1));
+}
+
+// true while a job has a deadline that hasn't come yet
+boolean timer_queue_pending(const struct timer_queue_t *q, uint8_t job)
+{
+	return q->due_ms[job] != 0;
+}
+
+/*
+	schedule the next poll on the first boundary after now, or at local
+	midnight when that comes first. Boundaries between the one the last
+	poll was for and now were missed by an overrunning cycle and are
+	added to overruns.
+
+	returns ms until the poll
+*/
+uint64_t timer_queue_next_poll(struct timer_queue_t *q, uint32_t period_ms)
+{
+	uint64_t now, midnight, next_midnight, deadline, index;
+
+	now = realtime_ms();
+	midnight = local_midnight_ms(now, 0);
+	next_midnight = local_midnight_ms(now, 1);
+	index = (now - midnight) / period_ms + 1;
+	deadline = midnight + index * period_ms;
+
+	if(q->started && q->period_ms == period_ms && q->midnight == midnight && index > q->index + 1)
+		q->overruns += index - q->index - 1;
+
+	if(deadline >= next_midnight)
+	{
+		deadline = next_midnight;
+		midnight = next_midnight; // the midnight poll is boundary 0 of the new day
+		index = 0;
+	}
+	q->period_ms = period_ms;
+	q->midnight = midnight;
+	q->index = index;
+	q->started = true;
+	timer_queue_schedule(q, JOB_POLL, deadline);
+
+	return deadline > now ? deadline - now : 0;
+}
+
+/*
+	read the timer after epoll reported it readable and take the jobs that
+	are due off the queue
+
+	returns a bitmask of the jobs due, 1 << JOB_*
+*/
+uint32_t timer_queue_fired(struct timer_queue_t *q)
+{
+	uint64_t expirations, now;
+	uint32_t fired = 0;
+	uint8_t job;
+
+	if(read(q->fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+	{
+		if(errno == ECANCELED) // the clock was set, deadlines worked out from the old time are off
+		{
+			q->clock_changes++;
+			q->started = false; // boundaries before the change tell nothing about overruns
+			if(q->due_ms[JOB_POLL] != 0)
+				timer_queue_next_poll(q, q->period_ms);
+			if(q->due_ms[JOB_AMP_HOUR_RESET] != 0)
+				timer_queue_at_midnight(q, JOB_AMP_HOUR_RESET);
+			arm_earliest(q);
+		}
+		return 0;
+	}
+
+	now = realtime_ms();
+	for(job = 0; job < JOB_COUNT; job++)
+	{
+		if(q->due_ms[job] == 0 || q->due_ms[job] > now)
+			continue;
+		q->due_ms[job] = 0;
+		fired |= 1 << job;
+	}
+	if(fired & (1 << JOB_POLL))
+		q->polls++;
+	arm_earliest(q);
+	return fired;
+}
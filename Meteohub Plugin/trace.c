@@ -0,0 +1,517 @@
+#include "mhpmpi.h"
+#include <sys/mman.h>
+#include <errno.h>
+
+/*
+	trace.c
+
+	capture of the raw serial traffic with TRACE_FILE, and playback of a
+	capture through the decoders with -P, so odd values from a site can be
+	looked at again, and a new decoder build run over months of real
+	traffic, without the hardware.
+
+	A trace file is a header of TRACE_MAGIC and TRACE_VERSION followed by
+	records, each run of mhpmpi appends its own:
+
+		tag			kind << 4 | device index
+		delta		varint, microseconds on the monotonic clock since the record before
+		length		varint, bytes of payload
+		payload		TRACE_TX, TRACE_RX: the bytes written to or read from the port
+					TRACE_OPEN: the device path, the port was (re)opened
+					TRACE_RESYNC: nothing, the port was flushed after a timeout or bad checksum
+					TRACE_SHUNTS: the SHUNTn_500A bits the device's decoders are picked with
+					TRACE_START: varint unix time in microseconds, first record of each run
+
+	so a frame costs 3 bytes on top of itself. Records are collected in
+	memory and written once per poll cycle, or sooner when
+	TRACE_BUFFER_BYTES fill up between polls, so capturing costs a memcpy
+	for each read() and write() on a port.
+
+	Playback splits each device's TX bytes into command frames and hands
+	the RX bytes to the oldest frame waiting for its response, the way the
+	pipeline matches them, checks the checksum and decodes every register
+	a good short read covers with the decoders compile_poll_plan() picks
+	for that device's shunts. Values come out as
+
+		unix_time_ms,device,sensor_bit,value
+
+	like pmarc prints the archive, stamped with the time the response was
+	complete. Playback runs flat out, or with -W at the pace of the capture.
+*/
+
+#define TRACE_MAX_RECORD_HEADER 21 // tag and two 10 byte varints
+#define REPLAY_MAX_PENDING 32 // command frames waiting for a response, per device
+
+// capture in progress
+static struct
+{
+	boolean running;
+	boolean failed;			// a write failed and capturing stopped, not reported yet
+	int fd;
+	uint64_t last_us;		// monotonic time of the record before
+	uint32_t len;
+	uint8_t buf[TRACE_BUFFER_BYTES];
+} trace = {false, false, -1};
+
+static uint16_t put_varint(uint8_t *p, uint64_t v)
+{
+	uint16_t n = 0;
+
+	while(v >= 0x80)
+	{
+		p[n++] = (uint8_t)v | 0x80;
+		v >>= 7;
+	}
+	p[n++] = (uint8_t)v;
+	return n;
+}
+
+// returns bytes used, 0 if the varint runs past end
+static uint16_t get_varint(const uint8_t *p, const uint8_t *end, uint64_t *v)
+{
+	uint16_t n = 0;
+	uint8_t shift = 0;
+
+	*v = 0;
+	while(p + n < end && shift < 64)
+	{
+		*v |= (uint64_t)(p[n] & 0x7f) << shift;
+		if(!(p[n++] & 0x80))
+			return n;
+		shift += 7;
+	}
+	return 0;
+}
+
+static uint64_t realtime_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+	start capturing to path, appending to what earlier runs captured
+
+	returns:	0 = OK
+				-1 = file could not be opened
+				-2 = header could not be written
+*/
+int trace_start(char *path)
+{
+	struct trace_header_t header;
+	struct stat st;
+	uint8_t stamp[10];
+
+	if((trace.fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0)
+		return -1;
+
+	if(fstat(trace.fd, &st) == 0 && st.st_size == 0)
+	{
+		memset(&header, 0, sizeof(header));
+		header.magic = TRACE_MAGIC;
+		header.version = TRACE_VERSION;
+		if(write(trace.fd, &header, sizeof(header)) != sizeof(header))
+		{
+			close(trace.fd);
+			trace.fd = -1;
+			return -2;
+		}
+	}
+
+	trace.running = true;
+	trace.failed = false;
+	trace.len = 0;
+	trace.last_us = monotonic_us();
+	trace_record(TRACE_START, 0, stamp, put_varint(stamp, realtime_us()));
+	return 0;
+}
+
+/*
+	write out the records collected so far, the event loop calls this
+	after every poll cycle
+
+	returns:	0 = OK
+				-1 = a write failed, this time or since the last call, and capturing has stopped
+*/
+int trace_flush(void)
+{
+	ssize_t rc;
+	uint32_t done = 0;
+
+	while(trace.running && done < trace.len)
+	{
+		if((rc = write(trace.fd, trace.buf + done, trace.len - done)) > 0)
+			done += rc;
+		else if(rc < 0 && errno == EINTR)
+			continue;
+		else
+		{
+			trace.running = false;
+			trace.failed = true;
+			close(trace.fd);
+			trace.fd = -1;
+		}
+	}
+	trace.len = 0;
+
+	if(trace.failed)
+	{
+		trace.failed = false;
+		return -1;
+	}
+	return 0;
+}
+
+// write out what is left and close the file
+void trace_stop(void)
+{
+	trace_flush();
+	if(trace.fd >= 0)
+		close(trace.fd);
+	trace.fd = -1;
+	trace.running = false;
+}
+
+// add a record for device, a no-op while not capturing. n is at most a pipeline's worth of frames or a path
+void trace_record(uint8_t kind, uint8_t device, const uint8_t *data, uint32_t n)
+{
+	uint64_t now;
+
+	if(!trace.running)
+		return;
+
+	if(trace.len + TRACE_MAX_RECORD_HEADER + n > TRACE_BUFFER_BYTES)
+	{
+		trace_flush();
+		if(!trace.running)
+		{
+			trace.failed = true; // keep it for the event loop to report
+			return;
+		}
+	}
+
+	now = monotonic_us();
+	trace.buf[trace.len++] = kind << 4 | (device & 0x0f);
+	trace.len += put_varint(trace.buf + trace.len, kind == TRACE_START ? 0 : now - trace.last_us);
+	trace.len += put_varint(trace.buf + trace.len, n);
+	if(n > 0)
+		memcpy(trace.buf + trace.len, data, n);
+	trace.len += n;
+	trace.last_us = now;
+}
+
+// a command frame waiting for its response during playback
+struct replay_frame_t
+{
+	uint8_t command;
+	uint8_t address;
+	uint8_t length;
+	uint8_t checksum;		// checksum byte of the command frame
+};
+
+struct replay_device_t
+{
+	uint8_t shunt_select;
+	struct poll_plan_t plan;	// every sensor, decoded the way this device's shunts need
+	uint8_t tx[UINT8_MAX + 5];	// command bytes that aren't a whole frame yet
+	uint16_t tx_len;
+	struct replay_frame_t pending[REPLAY_MAX_PENDING];
+	uint8_t head, count;
+	uint8_t rx[UINT8_MAX + 1];	// response to the oldest pending frame so far
+	uint16_t rx_len;
+};
+
+struct replay_totals_t
+{
+	uint64_t records;
+	uint64_t tx_bytes;
+	uint64_t rx_bytes;
+	uint64_t frames;
+	uint64_t good;
+	uint64_t checksum_errors;
+	uint64_t resyncs;
+	uint64_t opens;
+	uint64_t stray_bytes;	// bytes that fit no frame, in either direction
+	uint64_t values;
+};
+
+static void replay_plan(struct replay_device_t *rd, uint8_t shunt_select)
+{
+	uint32_t id_base[SENSOR_KIND_COUNT] = {0, 0};
+
+	rd->shunt_select = shunt_select;
+	compile_poll_plan(&rd->plan, (1U << PENTAMETRIC_SENSOR_COUNT) - 1, shunt_select, false, id_base);
+}
+
+// forget frames in flight, the port was flushed or reopened
+static void replay_reset(struct replay_device_t *rd)
+{
+	rd->tx_len = 0;
+	rd->head = rd->count = 0;
+	rd->rx_len = 0;
+}
+
+// split command bytes into frames and queue them for their responses
+static void replay_tx(struct replay_device_t *rd, struct replay_totals_t *totals, const uint8_t *p, uint32_t n)
+{
+	struct replay_frame_t *frame;
+	uint16_t need;
+
+	while(n > 0)
+	{
+		rd->tx[rd->tx_len++] = *p++;
+		n--;
+
+		if(rd->tx[0] != PENTAMETRIC_SHORT_READ_COMMAND && rd->tx[0] != PENTAMETRIC_SHORT_WRITE_COMMAND)
+		{
+			totals->stray_bytes++;
+			rd->tx_len = 0;
+			continue;
+		}
+		if(rd->tx_len < 3)
+			continue;
+		need = rd->tx[0] == PENTAMETRIC_SHORT_WRITE_COMMAND ? rd->tx[2] + 4 : 4;
+		if(rd->tx_len < need)
+			continue;
+
+		totals->frames++;
+		if(rd->count < REPLAY_MAX_PENDING)
+		{
+			frame = &rd->pending[(rd->head + rd->count++) % REPLAY_MAX_PENDING];
+			frame->command = rd->tx[0];
+			frame->address = rd->tx[1];
+			frame->length = rd->tx[2];
+			frame->checksum = rd->tx[need - 1];
+		}
+		rd->tx_len = 0;
+	}
+}
+
+/*
+	decode every register a good short read response covers. A read
+	carries on through the registers after the one addressed, each taking
+	its own length, the way build_read_plan() lays out a span.
+*/
+static void replay_values(struct replay_device_t *rd, struct replay_totals_t *totals, uint8_t device, struct replay_frame_t *frame, uint64_t time_us)
+{
+	uint8_t offset[PENTAMETRIC_MAX_DATA_ADDRESS + 2];
+	struct poll_item_t *item;
+	uint16_t used = 0;
+	uint8_t a, i;
+
+	if(frame->address == PENTAMETRIC_ADDRESS_SHUNT_SELECT && frame->length >= 3)
+	{
+		if(decode_shunt_select(rd->rx) != rd->shunt_select)
+			replay_plan(rd, decode_shunt_select(rd->rx));
+		return;
+	}
+
+	if(frame->address > PENTAMETRIC_MAX_DATA_ADDRESS)
+		return;
+
+	// offset of each register in the response, end past the last one that is all there
+	for(a = frame->address; a <= PENTAMETRIC_MAX_DATA_ADDRESS && get_register_length(a) > 0 && used + get_register_length(a) <= frame->length; a++)
+	{
+		offset[a] = used;
+		used += get_register_length(a);
+	}
+
+	for(i = 0; i < rd->plan.count; i++)
+	{
+		item = &rd->plan.item[i];
+		if(item->address < frame->address || item->address >= a)
+			continue;
+		totals->values++;
+		fprintf(stdout, "%llu,%u,%u,%d\n", (unsigned long long)(time_us / 1000), device, item->bit, item->decode(&rd->rx[offset[item->address]]));
+	}
+}
+
+// hand response bytes to the oldest frames waiting for them
+static void replay_rx(struct replay_device_t *rd, struct replay_totals_t *totals, uint8_t device, const uint8_t *p, uint32_t n, uint64_t time_us)
+{
+	struct replay_frame_t *frame;
+	uint16_t want, i;
+	uint8_t cs;
+	boolean ok;
+
+	while(n > 0)
+	{
+		if(rd->count == 0)
+		{
+			totals->stray_bytes += n;
+			return;
+		}
+		frame = &rd->pending[rd->head];
+		want = (frame->command == PENTAMETRIC_SHORT_READ_COMMAND ? frame->length + 1 : 1) - rd->rx_len;
+		if(want > n)
+			want = n;
+		memcpy(rd->rx + rd->rx_len, p, want);
+		rd->rx_len += want;
+		p += want;
+		n -= want;
+
+		if(rd->rx_len < (frame->command == PENTAMETRIC_SHORT_READ_COMMAND ? frame->length + 1 : 1))
+			return;
+
+		// the same checks as pipeline_complete()
+		if(frame->command == PENTAMETRIC_SHORT_READ_COMMAND)
+		{
+			for(cs = 0, i = 0; i <= frame->length; i++)
+				cs += rd->rx[i];
+			ok = (cs == PENTAMETRIC_CHECKSUM);
+		}
+		else
+			ok = (rd->rx[0] == frame->checksum);
+
+		if(!ok)
+			totals->checksum_errors++;
+		else
+		{
+			totals->good++;
+			if(frame->command == PENTAMETRIC_SHORT_READ_COMMAND)
+				replay_values(rd, totals, device, frame, time_us);
+		}
+
+		rd->head = (rd->head + 1) % REPLAY_MAX_PENDING;
+		rd->count--;
+		rd->rx_len = 0;
+	}
+}
+
+// sleep until the monotonic time in us
+static void replay_wait(uint64_t until_us)
+{
+	struct timespec ts;
+
+	ts.tv_sec = until_us / 1000000;
+	ts.tv_nsec = (until_us % 1000000) * 1000;
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/*
+	play a capture back through the decoders, values to stdout and a
+	summary of the run to stderr. With realtime the records are fed at
+	the pace they were captured, the time between runs is skipped.
+
+	returns:	0 = OK
+				-1 = file could not be opened or mapped
+				-2 = not a trace file, or a version this build can't read
+				-3 = no memory
+*/
+int trace_replay(char *path, boolean realtime)
+{
+	struct replay_device_t *rd;
+	struct replay_totals_t totals;
+	const struct trace_header_t *header;
+	const uint8_t *map, *p, *end, *payload;
+	uint64_t delta, length, time_us = 0, trace_us = 0, start_us, elapsed_us, stamp;
+	uint8_t tag, kind, device;
+	struct stat st;
+	uint16_t n1, n2;
+	int fd;
+
+	if((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return -1;
+	if(fstat(fd, &st) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+	if(st.st_size < (off_t)sizeof(struct trace_header_t))
+	{
+		close(fd);
+		return -2;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+		return -1;
+	madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+
+	header = (const struct trace_header_t *)map;
+	if(header->magic != TRACE_MAGIC || header->version != TRACE_VERSION)
+	{
+		munmap((void *)map, st.st_size);
+		return -2;
+	}
+	if((rd = (struct replay_device_t *)calloc(PENTAMETRIC_MAX_DEVICES, sizeof(struct replay_device_t))) == NULL)
+	{
+		munmap((void *)map, st.st_size);
+		return -3;
+	}
+	for(device = 0; device < PENTAMETRIC_MAX_DEVICES; device++)
+		replay_plan(&rd[device], 0);
+
+	memset(&totals, 0, sizeof(totals));
+	start_us = monotonic_us();
+	p = map + sizeof(struct trace_header_t);
+	end = map + st.st_size;
+
+	while(p < end)
+	{
+		tag = *p;
+		if((n1 = get_varint(p + 1, end, &delta)) == 0 || (n2 = get_varint(p + 1 + n1, end, &length)) == 0 ||
+			length > (uint64_t)(end - (p + 1 + n1 + n2)))
+			break; // cut off by a crash in the middle of a write
+		payload = p + 1 + n1 + n2;
+		p = payload + length;
+		kind = tag >> 4;
+		device = tag & 0x0f;
+		if(device >= PENTAMETRIC_MAX_DEVICES)
+			continue;
+
+		totals.records++;
+		time_us += delta;
+		trace_us += delta;
+		if(realtime)
+			replay_wait(start_us + trace_us);
+
+		switch(kind)
+		{
+		case TRACE_START:
+			if(get_varint(payload, payload + length, &stamp) > 0)
+				time_us = stamp;
+			for(device = 0; device < PENTAMETRIC_MAX_DEVICES; device++)
+				replay_reset(&rd[device]);
+			break;
+		case TRACE_OPEN:
+			totals.opens++;
+			replay_reset(&rd[device]);
+			break;
+		case TRACE_RESYNC:
+			totals.resyncs++;
+			replay_reset(&rd[device]);
+			break;
+		case TRACE_SHUNTS:
+			if(length == 1 && payload[0] != rd[device].shunt_select)
+				replay_plan(&rd[device], payload[0]);
+			break;
+		case TRACE_TX:
+			totals.tx_bytes += length;
+			replay_tx(&rd[device], &totals, payload, length);
+			break;
+		case TRACE_RX:
+			totals.rx_bytes += length;
+			replay_rx(&rd[device], &totals, device, payload, length, time_us);
+			break;
+		}
+	}
+	fflush(stdout);
+	elapsed_us = monotonic_us() - start_us;
+
+	fprintf(stderr, "%s: %llu records, %llu bytes sent and %llu received, %llu frames, %llu good responses, "
+		"%llu checksum errors, %llu resyncs, %llu opens, %llu stray bytes, %llu values\n", path,
+		(unsigned long long)totals.records, (unsigned long long)totals.tx_bytes, (unsigned long long)totals.rx_bytes,
+		(unsigned long long)totals.frames, (unsigned long long)totals.good, (unsigned long long)totals.checksum_errors,
+		(unsigned long long)totals.resyncs, (unsigned long long)totals.opens, (unsigned long long)totals.stray_bytes,
+		(unsigned long long)totals.values);
+	fprintf(stderr, "%.1f s of traffic played back in %.3f s, %.0f records/s%s\n", trace_us / 1e6, elapsed_us / 1e6,
+		elapsed_us > 0 ? totals.records * 1e6 / elapsed_us : 0.0, p < end ? ", trace cut off at the end" : "");
+
+	free(rd);
+	munmap((void *)map, st.st_size);
+	return 0;
+}